@@ -0,0 +1,150 @@
+#ifndef ARENA_HPP
+#define ARENA_HPP
+
+#include <sys/mman.h>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <iostream>
+#include <new>
+#include <string>
+#include <vector>
+#include <botan/mem_ops.h>
+
+#define SESSION_ARENA_SIZE (16u << 10)     // Enough for the key material of one 3DH handshake with room to spare
+
+// Allocation counters for the key material and message buffers (printed by simbench)
+struct ArenaStats
+{
+    std::atomic<std::size_t> slab_allocations = 0;     // Served from a session's locked slab
+    std::atomic<std::size_t> heap_allocations = 0;     // Slab exhausted, fell back to the heap
+    std::atomic<std::size_t> buffer_growths = 0;       // Reusable crypto buffers that had to grow
+};
+
+ArenaStats arena_stats;
+
+// Preallocated, mlock'd slab for key material: the transient values of a session's handshakes (wiped
+// at every rekey), or the key of one epoch (SessionKey). Allocations are carved off the slab and only
+// given back all at once by wipe(), which zeroes the used part.
+class SessionArena
+{
+    uint8_t* slab = nullptr;
+    std::size_t capacity;
+    std::size_t used = 0;
+
+public:
+    explicit SessionArena(std::size_t capacity = SESSION_ARENA_SIZE) : capacity(capacity)
+    {
+        void* mem = mmap(nullptr, capacity, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (mem == MAP_FAILED)
+            throw std::bad_alloc();
+        slab = static_cast<uint8_t*>(mem);
+
+        // Keep the key material out of swap; without the privilege (RLIMIT_MEMLOCK) it still works, just unlocked
+        static std::atomic<bool> warned = false;
+        if (mlock(slab, capacity) != 0 && !warned.exchange(true))
+            std::cerr << "Warning: could not lock the session key memory\n";
+#ifdef MADV_DONTDUMP
+        madvise(slab, capacity, MADV_DONTDUMP);
+#endif
+    }
+
+    SessionArena(const SessionArena&) = delete;
+    SessionArena& operator=(const SessionArena&) = delete;
+
+    ~SessionArena()
+    {
+        wipe();
+        munlock(slab, capacity);
+        munmap(slab, capacity);
+    }
+
+    void* allocate(std::size_t size, std::size_t align)
+    {
+        std::size_t offset = (used + align - 1) & ~(align - 1);
+        if (offset + size > capacity)
+        {
+            arena_stats.heap_allocations++;
+            return ::operator new(size);
+        }
+        used = offset + size;
+        arena_stats.slab_allocations++;
+        return slab + offset;
+    }
+
+    void deallocate(void* p, std::size_t size)
+    {
+        uint8_t* bytes = static_cast<uint8_t*>(p);
+        if (bytes >= slab && bytes < slab + capacity)
+        {
+            // The most recent allocation can be handed back right away; the rest waits for wipe()
+            if (bytes + size == slab + used)
+            {
+                Botan::secure_scrub_memory(bytes, size);
+                used = bytes - slab;
+            }
+            return;
+        }
+        Botan::secure_scrub_memory(p, size);
+        ::operator delete(p);
+    }
+
+    // Zeroes everything handed out since the last wipe and makes the slab reusable
+    void wipe()
+    {
+        Botan::secure_scrub_memory(slab, used);
+        used = 0;
+    }
+
+    std::size_t in_use() const
+    {
+        return used;
+    }
+};
+
+// Allocator handing out memory from a SessionArena, for containers holding key material
+template <typename T>
+class ArenaAllocator
+{
+public:
+    using value_type = T;
+
+    SessionArena* arena;
+
+    explicit ArenaAllocator(SessionArena& arena) : arena(&arena) {}
+
+    template <typename U>
+    ArenaAllocator(const ArenaAllocator<U>& other) : arena(other.arena) {}
+
+    T* allocate(std::size_t n)
+    {
+        return static_cast<T*>(arena->allocate(n * sizeof(T), alignof(T)));
+    }
+
+    void deallocate(T* p, std::size_t n)
+    {
+        arena->deallocate(p, n * sizeof(T));
+    }
+
+    template <typename U>
+    bool operator==(const ArenaAllocator<U>& other) const
+    {
+        return arena == other.arena;
+    }
+};
+
+template <typename T>
+using arena_vector = std::vector<T, ArenaAllocator<T>>;
+
+using arena_string = std::basic_string<char, std::char_traits<char>, ArenaAllocator<char>>;
+
+// Resizes a reusable buffer, counting the times it actually had to grow
+template <typename Buffer>
+void reuse_buffer(Buffer& buffer, std::size_t size)
+{
+    if (size > buffer.capacity())
+        arena_stats.buffer_growths++;
+    buffer.resize(size);
+}
+
+#endif
@@ -0,0 +1,234 @@
+#ifndef CALIBRATE_HPP
+#define CALIBRATE_HPP
+
+#include <botan/auto_rng.h>
+#include <botan/pubkey.h>
+#include <botan/version.h>
+#include <algorithm>
+#include <chrono>
+#include <exception>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+#include "crypt.hpp"
+#include "suite.hpp"
+
+#define CRYPTO_BENCH_PATH std::string("../lib/crypto_bench.txt")   // Results of the last calibration, reused while the host is the same
+#define CRYPTO_BENCH_BUDGET std::chrono::milliseconds(30)           // Measuring time per record cipher and per key agreement
+#define CRYPTO_BENCH_RECORD 1024                                    // Bytes of the messages the record ciphers are timed on
+
+// Chosen once at startup (DENIM_CIPHER, DENIM_KEX, DENIM_RECALIBRATE)
+std::string cipher_override;
+std::string kex_override;
+bool force_recalibration = false;
+
+// Speeds of the primitives on one host, 0 where Botan does not provide one
+struct CryptoBench
+{
+    std::string host;
+    double cipher_mbps[RECORD_CIPHERS] = {};    // Message bytes encrypted and decrypted per second, in MB
+    double kex_ms[KEY_AGREEMENTS] = {};         // One side of a 3DH handshake: two key pairs and four agreements
+};
+
+// Botan build and CPU the measurements hold for; any change there invalidates the cache
+std::string host_fingerprint()
+{
+    std::string cpu = "unknown CPU";
+    std::ifstream cpuinfo("/proc/cpuinfo");
+    std::string line;
+    while (std::getline(cpuinfo, line))
+        if (line.rfind("model name", 0) == 0 && line.find(':') != std::string::npos)
+        {
+            cpu = line.substr(line.find(':') + 2);
+            break;
+        }
+    std::string host = Botan::version_string() + "; " + cpu + "; " + std::to_string(std::thread::hardware_concurrency()) + " threads";
+    std::replace(host.begin(), host.end(), '\n', ' ');
+    return host;
+}
+
+// Seconds per call of f, averaged over the measuring budget after one warm-up call
+template <class F>
+double time_per_call(F&& f)
+{
+    f();
+    std::size_t calls = 0;
+    auto start = std::chrono::steady_clock::now();
+    std::chrono::duration<double> elapsed{0};
+    do
+    {
+        f();
+        calls++;
+        elapsed = std::chrono::steady_clock::now() - start;
+    } while (elapsed < CRYPTO_BENCH_BUDGET);
+    return elapsed.count() / calls;
+}
+
+// Times the message path itself (crypto::encrypt_message and decrypt_message), hex encoding included
+double bench_cipher(RecordCipher cipher)
+{
+    try
+    {
+        Botan::AutoSeeded_RNG rng;
+        Botan::secure_vector<uint8_t> key(32);
+        rng.randomize(key.data(), key.size());
+        std::string message(CRYPTO_BENCH_RECORD, 'm');
+        double seconds = time_per_call([&]() {
+            crypto::decrypt_message(cipher, key, crypto::encrypt_message(cipher, key, message));
+        });
+        return CRYPTO_BENCH_RECORD / seconds / 1e6;
+    } catch (std::exception&) {
+        return 0;
+    }
+}
+
+double bench_kex(KeyAgreement kex)
+{
+    try
+    {
+        Botan::AutoSeeded_RNG rng;
+        auto peer_public = new_agreement_key(kex, rng)->public_value();
+        double seconds = time_per_call([&]() {
+            auto key1 = new_agreement_key(kex, rng);
+            auto key2 = new_agreement_key(kex, rng);
+            for (const auto* key : {key1.get(), key1.get(), key2.get(), key2.get()})
+                Botan::PK_Key_Agreement(*key, rng, "SP800-56A(SHA-256)").derive_key(32, peer_public);
+        });
+        return seconds * 1e3;
+    } catch (std::exception&) {
+        return 0;
+    }
+}
+
+// The cached results, if they were measured on this host
+bool load_bench(CryptoBench& bench)
+{
+    std::ifstream file(CRYPTO_BENCH_PATH);
+    std::string line;
+    if (!std::getline(file, line) || line != "host " + bench.host)
+        return false;
+    std::size_t found = 0;
+    while (std::getline(file, line))
+    {
+        std::istringstream fields(line);
+        std::string kind, name;
+        double value;
+        if (!(fields >> kind >> name >> value))
+            return false;
+        if (auto cipher = parse_choice<RecordCipher>(name, record_cipher_names, RECORD_CIPHERS); kind == "cipher" && cipher)
+            bench.cipher_mbps[static_cast<int>(*cipher)] = value;
+        else if (auto kex = parse_choice<KeyAgreement>(name, key_agreement_names, KEY_AGREEMENTS); kind == "kex" && kex)
+            bench.kex_ms[static_cast<int>(*kex)] = value;
+        else
+            return false;
+        found++;
+    }
+    return found == RECORD_CIPHERS + KEY_AGREEMENTS;
+}
+
+void save_bench(const CryptoBench& bench)
+{
+    std::ofstream file(CRYPTO_BENCH_PATH, std::ios::trunc);
+    file << "host " << bench.host << "\n";
+    for (int i = 0; i < RECORD_CIPHERS; i++)
+        file << "cipher " << record_cipher_names[i] << " " << bench.cipher_mbps[i] << "\n";
+    for (int i = 0; i < KEY_AGREEMENTS; i++)
+        file << "kex " << key_agreement_names[i] << " " << bench.kex_ms[i] << "\n";
+    if (!file)
+        std::cerr << "Could not cache the crypto calibration in " << CRYPTO_BENCH_PATH << "\n";
+}
+
+// Available entries, fastest first
+template <class T, std::size_t N>
+std::vector<T> rank_by(const double (&speed)[N], bool higher_is_faster)
+{
+    std::vector<T> ranking;
+    for (std::size_t i = 0; i < N; i++)
+        if (speed[i] > 0)
+            ranking.push_back(static_cast<T>(i));
+    std::stable_sort(ranking.begin(), ranking.end(), [&](T a, T b) {
+        double x = speed[static_cast<int>(a)], y = speed[static_cast<int>(b)];
+        return higher_is_faster ? x > y : x < y;
+    });
+    return ranking;
+}
+
+// Ranks this side's suites by the speed of the primitives on this host, measured at the first start and
+// then read from the cache, and applies the overrides; prints the figures and what is preferred and why.
+// The ranking is what this side offers and chooses by in every handshake (choose_suite).
+CryptoBench calibrate_suites()
+{
+    CryptoBench bench;
+    bench.host = host_fingerprint();
+    bool cached = !force_recalibration && load_bench(bench);
+    if (!cached)
+    {
+        for (int i = 0; i < RECORD_CIPHERS; i++)
+            bench.cipher_mbps[i] = bench_cipher(static_cast<RecordCipher>(i));
+        for (int i = 0; i < KEY_AGREEMENTS; i++)
+            bench.kex_ms[i] = bench_kex(static_cast<KeyAgreement>(i));
+        save_bench(bench);
+    }
+
+    auto ciphers = rank_by<RecordCipher>(bench.cipher_mbps, true);
+    auto kexes = rank_by<KeyAgreement>(bench.kex_ms, false);
+    if (!ciphers.empty())
+        cipher_preference = ciphers;
+    if (!kexes.empty())
+        kex_preference = kexes;
+
+    // An override replaces the ranking, so a peer without any of its entries cannot connect
+    std::string cipher_reason = "fastest record cipher here", kex_reason = "fastest key agreement here";
+    if (!cipher_override.empty())
+    {
+        auto forced = parse_ranking<RecordCipher>(cipher_override, record_cipher_names, RECORD_CIPHERS);
+        if (forced.empty())
+            std::cerr << "Unknown DENIM_CIPHER " << cipher_override << ", using the calibrated ranking\n";
+        else
+        {
+            cipher_preference = forced;
+            cipher_reason = "set by DENIM_CIPHER";
+        }
+    }
+    if (!kex_override.empty())
+    {
+        auto forced = parse_ranking<KeyAgreement>(kex_override, key_agreement_names, KEY_AGREEMENTS);
+        if (forced.empty())
+            std::cerr << "Unknown DENIM_KEX " << kex_override << ", using the calibrated ranking\n";
+        else
+        {
+            kex_preference = forced;
+            kex_reason = "set by DENIM_KEX";
+        }
+    }
+
+    std::cout << "Crypto calibration (" << (cached ? "cached in " + CRYPTO_BENCH_PATH : "measured") << ") for " << bench.host << ":\n ";
+    for (RecordCipher cipher : {RecordCipher::Aes256Gcm, RecordCipher::ChaCha20Poly1305, RecordCipher::Aes256Cbc})
+    {
+        double mbps = bench.cipher_mbps[static_cast<int>(cipher)];
+        std::cout << " " << record_cipher_names[static_cast<int>(cipher)] << " ";
+        if (mbps > 0)
+            std::cout << mbps << " MB/s";
+        else
+            std::cout << "unavailable";
+    }
+    std::cout << " (" << CRYPTO_BENCH_RECORD << " byte messages)\n ";
+    for (KeyAgreement kex : {KeyAgreement::X25519, KeyAgreement::P256, KeyAgreement::Modp1536})
+    {
+        double ms = bench.kex_ms[static_cast<int>(kex)];
+        std::cout << " " << key_agreement_names[static_cast<int>(kex)] << " ";
+        if (ms > 0)
+            std::cout << ms << " ms";
+        else
+            std::cout << "unavailable";
+    }
+    std::cout << " (per side of a handshake)\n";
+    std::cout << "Preferring " << record_cipher_names[static_cast<int>(cipher_preference.front())] << " (" << cipher_reason << ") and "
+              << key_agreement_names[static_cast<int>(kex_preference.front())] << " (" << kex_reason << "), offering " << suite_offer() << "\n";
+    return bench;
+}
+
+#endif
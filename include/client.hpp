@@ -6,6 +6,9 @@
 #include <thread>
 #include <atomic>
 #include "readwrite.hpp"
+#include "group.hpp"
+#include "executor.hpp"
+#include "rekey.hpp"
 
 std::atomic<bool> stop_client_mode = false;
 std::atomic<bool> keyex_socket_connected = false;
@@ -26,7 +29,39 @@ void keyex_socket_connect(boost::asio::io_context& io_context, std::string& addr
     }
 }
 
-void client(boost::asio::io_context& io_context) {
+// The recipient is unreachable: keep what the user writes in the peer's outbox, stored with its message
+// history, until the next session with it
+template <class Mode>
+void queue_offline(const std::string& address)
+{
+    auto store = log_store_for(address);
+    std::cout << "Recipient is offline. Messages will be delivered when you next connect to it (Enter :b to go back)\n";
+    while(true)
+    {
+        std::string message;
+        std::cout << "Enter the message: (Enter :h for help)\n";
+        if(!std::getline(std::cin, message))
+            message = ":q";     // The console is closed
+        if(message == ":b")
+            return;
+        if(executeCommands<Mode>(message, *store))
+        {
+            if(quit_requested)
+                return;
+            continue;
+        }
+
+        std::time_t timestamp = clk::to_time_t(clk::now());
+        std::string time_str = std::ctime(&timestamp);
+        time_str.pop_back();
+        insert_message(*store, "YOU", message, time_str, "", DeliveryStatus::Queued);
+        std::cout << "Message queued!\n";
+        std::cout << "-----------------\n";
+    }
+}
+
+template <class Mode>
+void client_session(boost::asio::io_context& io_context) {
     try 
     {
         std::string address, port;
@@ -37,67 +72,100 @@ void client(boost::asio::io_context& io_context) {
 
         tcp::resolver resolver(io_context);
         auto endpoints = resolver.resolve(address, port);
-        tcp::socket socket(io_context);
+        auto socket = std::make_shared<tcp::socket>(io_context);
 
-        tcp::socket keyex_socket(io_context);
+        auto keyex_socket = std::make_shared<tcp::socket>(io_context);
 
         // Connect to the server
-        boost::asio::connect(socket, endpoints);
-
-        // Check and create db
-        sqlite3* DB;
-        const std::string path = "../lib/logs/";
-        const std::string dbname = path + "msghist_" + address + ".db";
-        sqlite3_open(dbname.c_str(), &DB);
-
-        // Create table if not exists
-        std::string create_table = "CREATE TABLE IF NOT EXISTS MSG_LOGS("
-                                   "ID INTEGER PRIMARY KEY AUTOINCREMENT,"
-                                   "PERSON TEXT NOT NULL,"
-                                   "MESSAGE TEXT NOT NULL,"
-                                   "TIME TEXT NOT NULL);";
-        execute_sql(DB, create_table);
-        sqlite3_close(DB);
+        boost::system::error_code connect_error;
+        boost::asio::connect(*socket, endpoints, connect_error);
+        if(connect_error)
+        {
+            std::cerr << "Client: Error connecting: " << connect_error.message() << "\n";
+            queue_offline<Mode>(address);
+            return;
+        }
+
+        // Message history shared by the read and write threads, opened once per peer
+        auto store = log_store_for(address);
+        auto keys = std::make_shared<KeyRing>();
+
+        // Frames go over the TCP connection, or over UDP with the TCP connection kept for setup and teardown
+        std::shared_ptr<FrameQueue> outbound;
+        std::shared_ptr<DatagramLink> link;
+        std::shared_ptr<SendQueue> send_queue;
+        if(data_transport == DataTransport::Udp)
+            outbound = link = open_datagram_link(*socket, keys, false);
+        else
+            outbound = send_queue = std::make_shared<SendQueue>(socket);   // Coalesces the session's outgoing frames
 
         std::this_thread::sleep_for(std::chrono::milliseconds(100));
-        Botan::secure_vector<uint8_t> shared_key;
         
-        std::thread keyex_socket_connect_thread([&](){
-            keyex_socket_connect(std::ref(io_context), std::ref(address), std::ref(port), std::ref(keyex_socket));
+        keyex_socket_connect(io_context, address, port, *keyex_socket);
+        if(!keyex_socket_connected)
+            return;
+
+        auto close_session = [socket, keyex_socket, link]() {
+            boost::system::error_code ignored;
+            socket->shutdown(tcp::socket::shutdown_both, ignored);
+            keyex_socket->shutdown(tcp::socket::shutdown_both, ignored);
+            if(link)
+                link->close();
+        };
+
+        // Pings the server and closes both sockets if it goes silent
+        auto heartbeat = std::make_shared<Heartbeat>(outbound, close_session);
+        heartbeat->start();
+
+        auto rekeyer = std::make_shared<Rekeyer>(KeyexRole::Client, keyex_socket, keys, heartbeat, close_session);
+
+        // History sync with the peer, answered and merged by the reader
+        auto sync = std::make_shared<HistorySync<Mode>>(store, outbound, keys);
+
+        start_reader<Mode>(socket, link, store, keys, heartbeat, sync, [heartbeat, rekeyer]() {
+            heartbeat->stop();
+            rekeyer->stop();
         });
-        keyex_socket_connect_thread.detach();
 
-        while(!keyex_socket_connected){
-            std::this_thread::sleep_for(std::chrono::milliseconds(100));
+        // The first key exchange has to finish before anything is sent; after that a new key is
+        // negotiated in the background whenever the active one has been used
+        if(!rekeyer->handshake()) {
+            std::cerr << "Client: Key exchange failed, closing the session\n";
+            close_session();
+            return;
         }
+        std::cout << "Client: Cipher suite " << suite_name(keys->peek()->suite) << "\n";
+        rekeyer->start();
 
-        // Launch read and write threads
-        while(true)
-        {
-        // Avoid key exchange if a command for viewing/editing has been entered
-        if(!command_entered)
-        {
-            std::thread keyex_thread([&](){
-                key_exchange_client(std::ref(keyex_socket), shared_key);
-            });
-            keyex_thread.detach();
-
-            while(!key_exchange_status_client){
-                std::this_thread::sleep_for(std::chrono::milliseconds(100));
-            }
-            key_exchange_status_client = false;
-        }
+        // Deliver what was written while the server was offline, before anything new
+        flush_outbox<Mode>(*outbound, *store, *keys);
 
-        std::thread write_thread(write_to_socket, std::ref(socket), dbname, std::ref(shared_key));
-        std::thread read_thread(read_from_socket, std::ref(socket), dbname, std::ref(shared_key));
-    
-        // Keep the client (main thread) running
-        write_thread.join();
-        read_thread.detach();
-        }
+        // Then exchange the edits, deletes and messages each side missed since the last sync
+        sync->request();
+
+        // Writing on this thread until the user terminates or the connection is lost
+        auto to_group = group_sender<Mode>(address, outbound, store, keys);
+        while(write_to_socket<Mode>(*outbound, *store, *keys, *sync, to_group));
+
+        group_rooms.leave(address);
+        rekeyer->stop();
+        heartbeat->stop();
+        print_rtt(heartbeat->stats());
+        if(send_queue)
+            print_send_queue(*send_queue);
+        if(link)
+            std::cout << link->retransmitted() << " datagram(s) retransmitted\n";
+        close_session();        // Ends the reader too
     } catch (std::exception& e) {
         std::cerr << "Client exception: " << e.what() << "\n";
     }
 }
 
+// Connects to a user in the mode chosen at startup
+void client(boost::asio::io_context& io_context) {
+    with_mode(security_mode, [&](auto mode) {
+        client_session<decltype(mode)>(io_context);
+    });
+}
+
 #endif
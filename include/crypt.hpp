@@ -9,27 +9,87 @@
     #include <botan/dh.h>
     #include <botan/cipher_mode.h>
     #include <botan/filters.h>
+    #include <botan/mac.h>
+    #include <botan/mem_ops.h>
     #include <boost/asio.hpp>
+    #include <array>
+    #include <memory>
+    #include <span>
+    #include <stdexcept>
+    #include <string_view>
+    #include "arena.hpp"
+    #include "suite.hpp"
+    #include "transport.hpp"
 
     using tcp = boost::asio::ip::tcp;
 
     namespace crypto
     {
-        static std::string compute_mac(const std::string& msg, const Botan::secure_vector<uint8_t>& key)
+        // Ciphers, MAC, RNG and buffers reused by every message encrypted or decrypted on this thread,
+        // so that the steady-state message path neither creates Botan objects nor allocates scratch
+        // buffers. What it still allocates are the strings it hands out: the ciphertext and MAC tag of a
+        // sealed message (its frame is a third allocation) and the plaintext of an opened one, which is
+        // logged. A record cipher is created the first time the thread uses it.
+        struct Scratch
         {
-            auto hmac = Botan::MessageAuthenticationCode::create_or_throw("HMAC(SHA-256)");
-            hmac->set_key(key);
-            hmac->update(msg);
+            Botan::AutoSeeded_RNG rng;
+            std::array<std::unique_ptr<Botan::Cipher_Mode>, RECORD_CIPHERS> enc;
+            std::array<std::unique_ptr<Botan::Cipher_Mode>, RECORD_CIPHERS> dec;
+            std::unique_ptr<Botan::MessageAuthenticationCode> hmac = Botan::MessageAuthenticationCode::create_or_throw("HMAC(SHA-256)");
+            Botan::secure_vector<uint8_t> iv;
+            Botan::secure_vector<uint8_t> text;     // Plaintext/ciphertext of the current message, wiped after use
+
+            Botan::Cipher_Mode& cipher(RecordCipher cipher, Botan::Cipher_Dir dir)
+            {
+                auto& mode = (dir == Botan::Cipher_Dir::Encryption ? enc : dec)[static_cast<int>(cipher)];
+                if (!mode)
+                    mode = Botan::Cipher_Mode::create_or_throw(record_cipher_modes[static_cast<int>(cipher)], dir);
+                return *mode;
+            }
+        };
+
+        Scratch& scratch()
+        {
+            thread_local Scratch s;
+            return s;
+        }
+
+        // Hex of the HMAC(SHA-256) tag of msg
+        static std::array<char, 64> mac_hex(std::string_view msg, std::span<const uint8_t> key)
+        {
+            auto& hmac = *scratch().hmac;
+            hmac.set_key(key);
+            hmac.update(reinterpret_cast<const uint8_t*>(msg.data()), msg.size());
+
+            std::array<uint8_t, 32> tag;
+            hmac.final(tag.data());
+            std::array<char, 64> hex;
+            Botan::hex_encode(hex.data(), tag.data(), tag.size());
+            return hex;
+        }
+
+        static std::string compute_mac(std::string_view msg, std::span<const uint8_t> key)
+        {
+            auto hex = mac_hex(msg, key);
+            return std::string(hex.begin(), hex.end());
+        }
 
-            return Botan::hex_encode(hmac->final());
+        // Checks a received tag in constant time, without building the expected one as a string
+        static bool verify_mac(std::string_view msg, std::span<const uint8_t> key, std::string_view tag)
+        {
+            auto hex = mac_hex(msg, key);
+            return tag.size() == hex.size()
+                && Botan::constant_time_compare(reinterpret_cast<const uint8_t*>(tag.data()), reinterpret_cast<const uint8_t*>(hex.data()), hex.size());
         }
 
-        void send_pubkey(tcp::socket& socket, const std::string& key_pub)
+        template <ByteStream Stream>
+        void send_pubkey(Stream& socket, const std::string& key_pub)
         {
             boost::asio::write(socket, boost::asio::buffer(key_pub));
         }
 
-        std::string receive_pubkey(tcp::socket& socket)
+        template <ByteStream Stream>
+        std::string receive_pubkey(Stream& socket)
         {
             char data[2048];
             boost::system::error_code error;
@@ -42,38 +102,49 @@
             return key_raw;
         }
 
-        std::string encrypt_message(const Botan::secure_vector<uint8_t>& key, const std::string& message)
+        // The AEAD ciphers append their tag to the ciphertext
+        std::string encrypt_message(RecordCipher cipher, std::span<const uint8_t> key, const std::string& message)
         {
-            Botan::AutoSeeded_RNG rng;
-
-            const auto enc = Botan::Cipher_Mode::create_or_throw("AES-256/CBC/PKCS7", Botan::Cipher_Dir::Encryption);
-            enc->set_key(key);
-
-            auto iv = rng.random_vec(enc->default_nonce_length());
-
-            Botan::secure_vector<uint8_t> pt(message.data(), message.data() + message.size());
-            enc->start(iv);
-            enc->finish(pt);
-
-            std::string encrypted_message = Botan::hex_encode(iv) + Botan::hex_encode(pt);
+            auto& s = scratch();
+            auto& enc = s.cipher(cipher, Botan::Cipher_Dir::Encryption);
+            enc.set_key(key);
+
+            reuse_buffer(s.iv, enc.default_nonce_length());
+            s.rng.randomize(s.iv.data(), s.iv.size());
+
+            reuse_buffer(s.text, message.size());
+            std::copy(message.begin(), message.end(), s.text.begin());
+            enc.start(s.iv);
+            enc.finish(s.text);
+
+            // Hex of the IV followed by the hex of the ciphertext
+            std::string encrypted_message(2 * (s.iv.size() + s.text.size()), '\0');
+            Botan::hex_encode(encrypted_message.data(), s.iv.data(), s.iv.size());
+            Botan::hex_encode(encrypted_message.data() + 2 * s.iv.size(), s.text.data(), s.text.size());
+            Botan::secure_scrub_memory(s.text.data(), s.text.size());
             return encrypted_message;
         }
 
-        std::string decrypt_message(const Botan::secure_vector<uint8_t>& key, const std::string& encrypted_message)
+        std::string decrypt_message(RecordCipher cipher, std::span<const uint8_t> key, std::string_view encrypted_message)
         {
-            Botan::AutoSeeded_RNG rng;
-
-            const auto dec = Botan::Cipher_Mode::create_or_throw("AES-256/CBC/PKCS7", Botan::Cipher_Dir::Decryption);
-            dec->set_key(key);
-
-            size_t iv_size = 2 * dec->default_nonce_length();
-            auto iv = Botan::hex_decode(encrypted_message.substr(0,iv_size));
-            auto ciphertext = Botan::hex_decode(encrypted_message.substr(iv_size));
-
-            dec->start(iv);
-            dec->finish(ciphertext);
-
-            return std::string(ciphertext.begin(), ciphertext.end());
+            auto& s = scratch();
+            auto& dec = s.cipher(cipher, Botan::Cipher_Dir::Decryption);
+            dec.set_key(key);
+
+            size_t iv_size = 2 * dec.default_nonce_length();
+            if (encrypted_message.size() < iv_size)
+                throw std::invalid_argument("Encrypted message shorter than its IV");
+            reuse_buffer(s.iv, iv_size / 2);
+            Botan::hex_decode(s.iv.data(), encrypted_message.data(), iv_size);
+            reuse_buffer(s.text, (encrypted_message.size() - iv_size) / 2);
+            s.text.resize(Botan::hex_decode(s.text.data(), encrypted_message.data() + iv_size, encrypted_message.size() - iv_size));
+
+            dec.start(s.iv);
+            dec.finish(s.text);
+
+            std::string message(s.text.begin(), s.text.end());
+            Botan::secure_scrub_memory(s.text.data(), s.text.size());
+            return message;
         }
     }
 
@@ -0,0 +1,580 @@
+#ifndef DATAGRAM_HPP
+#define DATAGRAM_HPP
+
+#include <boost/asio.hpp>
+#include <boost/endian/conversion.hpp>
+#include <botan/mem_ops.h>
+#include <algorithm>
+#include <array>
+#include <bitset>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <functional>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+#include "crypt.hpp"
+#include "message.hpp"
+#include "sendqueue.hpp"
+#include "heartbeat.hpp"
+#include "keyring.hpp"
+#include "executor.hpp"
+
+#define DATAGRAM_MTU 1200                   // Bytes per datagram, under the path MTU of common links
+#define DATAGRAM_WINDOW 256                 // Records covered by the replay window, and the most the sender leaves unacknowledged
+#define DATAGRAM_MAX_FRAGMENTS (DATAGRAM_WINDOW / 4)
+#define DATAGRAM_MAX_RETRIES 8              // Retransmissions of a record before the peer is given up on
+#define DATAGRAM_TICK std::chrono::milliseconds(20)     // Resolution of the retransmit timer
+#define DATAGRAM_TAG_SIZE 64                // Hex HMAC-SHA256
+#define DATAGRAM_MAC_LABEL std::string("DENIM_DATAGRAM")
+#define DATAGRAM_RELIABLE 0x01
+
+using udp = boost::asio::ip::udp;
+
+enum class DataTransport { Tcp, Udp };
+
+// Chosen once at startup (DENIM_TRANSPORT, DENIM_UDP_LOSS)
+DataTransport data_transport = DataTransport::Tcp;
+double datagram_loss = 0;       // Fraction of outgoing datagrams dropped on purpose, to exercise the recovery
+
+enum DatagramType : uint8_t
+{
+    DATAGRAM_RECORD = 1,    // A frame or one fragment of it
+    DATAGRAM_ACK = 2        // The receiver's replay window, acknowledging every reliable record in it
+};
+
+// Datagram header, big-endian on the wire, followed by the payload and the tag (HMAC over the label,
+// header and payload under the session key of the epoch)
+struct DatagramHeader
+{
+    uint8_t type;
+    uint8_t flags;
+    uint16_t frag;          // Records: index of this fragment within its frame
+    uint16_t frags;         // Records: fragments of the frame, which have consecutive sequence numbers
+    uint16_t length;        // Payload bytes
+    uint64_t epoch;
+    uint64_t seq;           // Records: sequence number. Acks: highest sequence number received.
+};
+static_assert(sizeof(DatagramHeader) == 24, "DatagramHeader must stay packed");
+
+#define DATAGRAM_MAX_PAYLOAD (DATAGRAM_MTU - sizeof(DatagramHeader) - DATAGRAM_TAG_SIZE)
+
+std::string encode_datagram(DatagramHeader header, const std::string& payload, const SessionKey& key)
+{
+    header.length = payload.size();
+    header.epoch = key.epoch;
+    boost::endian::native_to_big_inplace(header.frag);
+    boost::endian::native_to_big_inplace(header.frags);
+    boost::endian::native_to_big_inplace(header.length);
+    boost::endian::native_to_big_inplace(header.epoch);
+    boost::endian::native_to_big_inplace(header.seq);
+
+    std::string datagram(reinterpret_cast<const char*>(&header), sizeof(header));
+    datagram += payload;
+    datagram += crypto::compute_mac(DATAGRAM_MAC_LABEL + datagram, key.key);
+    return datagram;
+}
+
+// Parses the header and payload of a datagram; the tag is checked separately, once the key is known
+bool decode_datagram(const char* data, std::size_t size, DatagramHeader& header, std::string& payload)
+{
+    if (size < sizeof(header) + DATAGRAM_TAG_SIZE)
+        return false;
+    std::memcpy(&header, data, sizeof(header));
+    boost::endian::big_to_native_inplace(header.frag);
+    boost::endian::big_to_native_inplace(header.frags);
+    boost::endian::big_to_native_inplace(header.length);
+    boost::endian::big_to_native_inplace(header.epoch);
+    boost::endian::big_to_native_inplace(header.seq);
+    if (sizeof(header) + header.length + DATAGRAM_TAG_SIZE != size)
+        return false;
+    payload.assign(data + sizeof(header), header.length);
+    return true;
+}
+
+bool datagram_tag_ok(const char* data, std::size_t size, const SessionKey& key)
+{
+    std::string tag = crypto::compute_mac(DATAGRAM_MAC_LABEL + std::string(data, size - DATAGRAM_TAG_SIZE), key.key);
+    return Botan::constant_time_compare(reinterpret_cast<const uint8_t*>(tag.data()),
+                                        reinterpret_cast<const uint8_t*>(data + size - DATAGRAM_TAG_SIZE), DATAGRAM_TAG_SIZE);
+}
+
+// Datagram transport of one session, for lossy links where TCP holds every later message behind
+// one lost segment. Frames travel as MAC'd records with their own sequence numbers, and each frame
+// is delivered as soon as all of its fragments are in, whatever became of the frames before it.
+// Reliable records are retransmitted one by one until the peer's window acknowledges them, on the
+// RTO of an RFC 6298 estimator; the window also drops duplicates and replays. Records are MAC'd with
+// the session keys of the KeyRing, so nothing is sent before the first handshake has completed.
+class DatagramLink : public FrameQueue, public std::enable_shared_from_this<DatagramLink>
+{
+    struct Outstanding
+    {
+        std::string payload;
+        uint16_t frag;
+        uint16_t frags;
+        steady_clk::time_point sent{};      // Not sent yet while zero
+        unsigned retries = 0;
+    };
+
+    struct Fragment
+    {
+        uint16_t frag;
+        uint16_t frags;
+        std::string data;
+    };
+
+    std::shared_ptr<KeyRing> keys;
+    boost::asio::strand<boost::asio::io_context::executor_type> strand;
+    udp::socket socket;
+    udp::endpoint peer;
+    boost::asio::steady_timer timer;
+    std::array<char, 65536> rx_buffer;
+    udp::endpoint rx_from;
+
+    std::mutex mtx;
+    std::condition_variable changed;
+    uint64_t next_seq = 1;
+    std::map<uint64_t, Outstanding> unacked;
+    RttEstimator rtt;
+    uint64_t highest = 0;
+    std::bitset<DATAGRAM_WINDOW> seen;      // Bit i: record highest - i has been received
+    std::map<uint64_t, Fragment> partial;   // Fragments of incomplete frames, by sequence number
+    std::deque<std::string> delivered;      // Reassembled, not yet handed to the reader
+    std::size_t retransmits = 0;
+    bool failed = false;
+    bool closed = false;
+
+    // Strand only
+    std::function<void(const std::string&)> reader;
+    std::function<void()> on_end;
+    bool ended = false;
+
+    // Runs on the strand
+    void send_raw(const std::string& datagram)
+    {
+        thread_local std::mt19937 gen(std::random_device{}());
+        if (datagram_loss > 0 && std::uniform_real_distribution<double>(0, 1)(gen) < datagram_loss)
+            return;
+        boost::system::error_code ignored;      // A datagram the kernel refuses is just another loss
+        socket.send_to(boost::asio::buffer(datagram), peer, 0, ignored);
+    }
+
+    // Called with the lock held
+    std::string encode_record(uint64_t seq, const Outstanding& record, const SessionKey& key)
+    {
+        DatagramHeader header{};
+        header.type = DATAGRAM_RECORD;
+        header.flags = DATAGRAM_RELIABLE;
+        header.frag = record.frag;
+        header.frags = record.frags;
+        header.seq = seq;
+        return encode_datagram(header, record.payload, key);
+    }
+
+    // Called with the lock held
+    bool has_room(std::size_t frags)
+    {
+        return unacked.empty() || next_seq + frags - unacked.begin()->first <= DATAGRAM_WINDOW;
+    }
+
+    // Called with the lock held; returns the sequence numbers of the fragments
+    std::pair<uint64_t, uint64_t> push_reliable(const std::string& frame)
+    {
+        std::size_t frags = std::max<std::size_t>(1, (frame.size() + DATAGRAM_MAX_PAYLOAD - 1) / DATAGRAM_MAX_PAYLOAD);
+        uint64_t first = next_seq;
+        for (std::size_t i = 0; i < frags; i++)
+        {
+            Outstanding& record = unacked[next_seq++];
+            record.payload = frame.substr(i * DATAGRAM_MAX_PAYLOAD, DATAGRAM_MAX_PAYLOAD);
+            record.frag = i;
+            record.frags = frags;
+        }
+        return {first, next_seq};
+    }
+
+    void transmit(uint64_t first, uint64_t end)
+    {
+        boost::asio::post(strand, [self = shared_from_this(), first, end]() {
+            auto key = self->keys->peek();
+            if (!key)
+                return;     // The timer sends them once the first handshake is done
+            std::vector<std::string> datagrams;
+            {
+                std::lock_guard<std::mutex> lock(self->mtx);
+                for (auto it = self->unacked.lower_bound(first); it != self->unacked.end() && it->first < end; ++it)
+                {
+                    if (it->second.sent != steady_clk::time_point{})
+                        continue;
+                    datagrams.push_back(self->encode_record(it->first, it->second, *key));
+                    it->second.sent = steady_clk::now();
+                }
+            }
+            for (const auto& datagram : datagrams)
+                self->send_raw(datagram);
+        });
+    }
+
+    // Called with the lock held. Returns false for duplicates and for records too old to tell from a replay.
+    bool accept(uint64_t seq)
+    {
+        if (seq > highest)
+        {
+            uint64_t shift = seq - highest;
+            seen = shift >= DATAGRAM_WINDOW ? std::bitset<DATAGRAM_WINDOW>() : seen << shift;
+            seen.set(0);
+            highest = seq;
+            return true;
+        }
+        uint64_t age = highest - seq;
+        if (age >= DATAGRAM_WINDOW || seen.test(age))
+            return false;
+        seen.set(age);
+        return true;
+    }
+
+    // Called with the lock held: delivers the frame of a fragment once all of its fragments are in
+    void reassemble(uint64_t seq, Fragment fragment)
+    {
+        if (fragment.frags == 1)
+        {
+            delivered.push_back(std::move(fragment.data));
+            return;
+        }
+        uint64_t first = seq - fragment.frag;
+        uint16_t frags = fragment.frags;
+        partial[seq] = std::move(fragment);
+        for (uint64_t i = first; i < first + frags; i++)
+            if (!partial.count(i))
+                return;
+
+        std::string frame;
+        for (uint64_t i = first; i < first + frags; i++)
+        {
+            frame += partial[i].data;
+            partial.erase(i);
+        }
+        delivered.push_back(std::move(frame));
+    }
+
+    // Called with the lock held
+    void apply_ack(uint64_t acked_highest, const std::string& window)
+    {
+        auto now = steady_clk::now();
+        for (auto it = unacked.begin(); it != unacked.end() && it->first <= acked_highest;)
+        {
+            uint64_t age = acked_highest - it->first;
+            bool acked = age < DATAGRAM_WINDOW && (static_cast<uint8_t>(window[age / 8]) >> (age % 8)) & 1;
+            if (!acked)
+            {
+                ++it;
+                continue;
+            }
+            if (it->second.retries == 0 && it->second.sent != steady_clk::time_point{})     // Karn: only unambiguous samples
+                rtt.sample(std::chrono::duration_cast<std::chrono::microseconds>(now - it->second.sent));
+            it = unacked.erase(it);
+        }
+        changed.notify_all();
+    }
+
+    // Called with the lock held
+    std::string encode_ack(const SessionKey& key)
+    {
+        std::string window(DATAGRAM_WINDOW / 8, '\0');
+        for (std::size_t i = 0; i < DATAGRAM_WINDOW; i++)
+            if (seen.test(i))
+                window[i / 8] |= static_cast<char>(1 << (i % 8));
+
+        DatagramHeader header{};
+        header.type = DATAGRAM_ACK;
+        header.seq = highest;
+        return encode_datagram(header, window, key);
+    }
+
+    // Runs on the strand: hands the frames reassembled so far to the reader, then tells it once the link is over
+    void deliver()
+    {
+        if (!reader || ended)
+            return;
+        std::deque<std::string> frames;
+        bool over;
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            frames.swap(delivered);
+            over = failed || closed;
+        }
+        for (const auto& frame : frames)
+            reader(frame);
+        if (over)
+        {
+            ended = true;
+            reader = nullptr;       // The callbacks may own the link
+            auto end = std::move(on_end);
+            on_end = nullptr;
+            end();
+        }
+    }
+
+    void on_datagram(std::size_t size)
+    {
+        DatagramHeader header;
+        std::string payload;
+        if (rx_from != peer || !decode_datagram(rx_buffer.data(), size, header, payload))
+            return;
+        auto key = keys->find(header.epoch);
+        if (!key || !datagram_tag_ok(rx_buffer.data(), size, *key))
+            return;
+
+        std::string ack;
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            if (header.type == DATAGRAM_ACK)
+            {
+                if (payload.size() == DATAGRAM_WINDOW / 8)
+                    apply_ack(header.seq, payload);
+                return;
+            }
+            if (header.type != DATAGRAM_RECORD || header.frags == 0 || header.frags > DATAGRAM_MAX_FRAGMENTS || header.frag >= header.frags || header.seq < header.frag)
+                return;
+
+            if (accept(header.seq))
+            {
+                reassemble(header.seq, Fragment{header.frag, header.frags, std::move(payload)});
+                changed.notify_all();
+            }
+            // Duplicates are acknowledged again: the earlier ack may be the one that got lost
+            if (header.flags & DATAGRAM_RELIABLE)
+                ack = encode_ack(*key);
+        }
+        if (!ack.empty())
+            send_raw(ack);
+        deliver();
+    }
+
+    void receive_next()
+    {
+        socket.async_receive_from(boost::asio::buffer(rx_buffer), rx_from, boost::asio::bind_executor(strand,
+            [self = shared_from_this()](const boost::system::error_code& error, std::size_t size) {
+                if (error == boost::asio::error::operation_aborted)
+                    return;
+                if (!error)
+                    self->on_datagram(size);
+                if (self->socket.is_open())
+                    self->receive_next();
+            }));
+    }
+
+    void schedule()
+    {
+        timer.expires_after(DATAGRAM_TICK);
+        timer.async_wait(boost::asio::bind_executor(strand, [self = shared_from_this()](const boost::system::error_code& error) {
+            if (!error)
+                self->tick();
+        }));
+    }
+
+    // Sends what is due: records queued before the first key, and records whose RTO has expired,
+    // backing off exponentially per record
+    void tick()
+    {
+        auto key = keys->peek();
+        std::vector<std::string> datagrams;
+        bool gave_up = false;
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            if (closed || failed)
+                return;
+            if (key)
+            {
+                auto now = steady_clk::now();
+                auto rto = rtt.rto();
+                for (auto& [seq, record] : unacked)
+                {
+                    if (record.sent != steady_clk::time_point{})
+                    {
+                        if (now - record.sent < rto * (1 << std::min(record.retries, 6u)))
+                            continue;
+                        if (++record.retries > DATAGRAM_MAX_RETRIES)
+                        {
+                            std::cerr << "Datagram link: record " << seq << " never acknowledged, giving up on the peer\n";
+                            failed = gave_up = true;
+                            changed.notify_all();
+                            break;
+                        }
+                        retransmits++;
+                    }
+                    datagrams.push_back(encode_record(seq, record, *key));
+                    record.sent = now;
+                }
+            }
+        }
+        if (gave_up)
+            return deliver();
+        for (const auto& datagram : datagrams)
+            send_raw(datagram);
+        schedule();
+    }
+
+public:
+    DatagramLink(udp::socket socket, udp::endpoint peer, std::shared_ptr<KeyRing> keys)
+        : keys(std::move(keys)), strand(boost::asio::make_strand(executor.io())), socket(std::move(socket)), peer(std::move(peer)), timer(executor.io())
+    {
+    }
+
+    DatagramLink(const DatagramLink&) = delete;
+    DatagramLink& operator=(const DatagramLink&) = delete;
+
+    void start()
+    {
+        boost::asio::post(strand, [self = shared_from_this()]() {
+            self->receive_next();
+            self->schedule();
+        });
+    }
+
+    // Waits while the window is full
+    bool enqueue(std::string frame, SendClass type = SendClass::Interactive) override
+    {
+        if (type == SendClass::Unreliable && frame.size() <= DATAGRAM_MAX_PAYLOAD)
+            return try_enqueue(std::move(frame), type);
+
+        std::unique_lock<std::mutex> lock(mtx);
+        if (frame.size() > DATAGRAM_MAX_FRAGMENTS * DATAGRAM_MAX_PAYLOAD)
+        {
+            std::cerr << "Datagram link: " << frame.size() << " byte frame too large, not sent\n";
+            return false;
+        }
+        std::size_t frags = std::max<std::size_t>(1, (frame.size() + DATAGRAM_MAX_PAYLOAD - 1) / DATAGRAM_MAX_PAYLOAD);
+        changed.wait(lock, [&]() { return failed || closed || has_room(frags); });
+        if (failed || closed)
+            return false;
+        auto [first, end] = push_reliable(frame);
+        lock.unlock();
+        transmit(first, end);
+        return true;
+    }
+
+    // Unreliable frames are sent once, under a sequence number of their own, and never wait for room
+    bool try_enqueue(std::string frame, SendClass type = SendClass::Interactive) override
+    {
+        std::unique_lock<std::mutex> lock(mtx);
+        if (failed || closed)
+            return false;
+
+        if (type == SendClass::Unreliable && frame.size() <= DATAGRAM_MAX_PAYLOAD)
+        {
+            if (!has_room(1))       // Its sequence number would push the oldest unacknowledged record out of the peer's window
+                return false;
+            uint64_t seq = next_seq++;
+            lock.unlock();
+            boost::asio::post(strand, [self = shared_from_this(), seq, frame = std::move(frame)]() {
+                auto key = self->keys->peek();
+                if (!key)
+                    return;
+                DatagramHeader header{};
+                header.type = DATAGRAM_RECORD;
+                header.frags = 1;
+                header.seq = seq;
+                self->send_raw(encode_datagram(header, frame, *key));
+            });
+            return true;
+        }
+
+        std::size_t frags = std::max<std::size_t>(1, (frame.size() + DATAGRAM_MAX_PAYLOAD - 1) / DATAGRAM_MAX_PAYLOAD);
+        if (frags > DATAGRAM_MAX_FRAGMENTS || !has_room(frags))
+            return false;
+        auto [first, end] = push_reliable(frame);
+        lock.unlock();
+        transmit(first, end);
+        return true;
+    }
+
+    // Delivered here means acknowledged by the peer
+    bool wait_drained() override
+    {
+        std::unique_lock<std::mutex> lock(mtx);
+        changed.wait(lock, [this]() { return unacked.empty() || failed || closed; });
+        return unacked.empty();
+    }
+
+    bool ok() override
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        return !failed && !closed;
+    }
+
+    // Hands every frame from the peer, framed as on TCP, to reader on the link's strand as soon as it is
+    // reassembled, then calls on_end once the link is closed or has failed
+    void start_reading(std::function<void(const std::string&)> reader, std::function<void()> on_end)
+    {
+        boost::asio::post(strand, [self = shared_from_this(), reader = std::move(reader), on_end = std::move(on_end)]() mutable {
+            self->reader = std::move(reader);
+            self->on_end = std::move(on_end);
+            self->deliver();
+        });
+    }
+
+    RttEstimator stats()
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        return rtt;
+    }
+
+    std::size_t retransmitted()
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        return retransmits;
+    }
+
+    void close()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            closed = true;
+        }
+        changed.notify_all();
+        boost::asio::post(strand, [self = shared_from_this()]() {
+            self->timer.cancel();
+            boost::system::error_code ignored;
+            self->socket.close(ignored);
+            self->deliver();
+        });
+    }
+};
+
+// Opens the datagram link of a session whose TCP connection is up. The server's UDP port is the
+// port it listens on; the client picks one and tells the server over the TCP connection.
+std::shared_ptr<DatagramLink> open_datagram_link(tcp::socket& control, std::shared_ptr<KeyRing> keys, bool server_side)
+{
+    udp::socket socket(executor.io());
+    udp::endpoint peer;
+    uint16_t port;
+    if (server_side)
+    {
+        udp::endpoint local(control.local_endpoint().address(), control.local_endpoint().port());
+        socket.open(local.protocol());
+        socket.bind(local);
+        boost::asio::read(control, boost::asio::buffer(&port, sizeof(port)));
+        peer = udp::endpoint(control.remote_endpoint().address(), ntohs(port));
+    } else {
+        udp::endpoint local(control.local_endpoint().address(), 0);
+        socket.open(local.protocol());
+        socket.bind(local);
+        port = htons(socket.local_endpoint().port());
+        boost::asio::write(control, boost::asio::buffer(&port, sizeof(port)));
+        peer = udp::endpoint(control.remote_endpoint().address(), control.remote_endpoint().port());
+    }
+
+    auto link = std::make_shared<DatagramLink>(std::move(socket), peer, std::move(keys));
+    link->start();
+    return link;
+}
+
+#endif
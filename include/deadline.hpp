@@ -0,0 +1,60 @@
+#ifndef DEADLINE_HPP
+#define DEADLINE_HPP
+
+#include <boost/asio.hpp>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include "executor.hpp"
+#include "transport.hpp"
+
+// Bounds a stretch of blocking reads and writes on a socket: if it is still alive when the timeout
+// expires, the socket is shut down so that the blocked call fails instead of waiting forever.
+// The socket is unusable afterwards, so this is meant for steps whose failure ends the session.
+template <ByteStream Stream>
+class Deadline
+{
+    struct State
+    {
+        std::mutex mtx;
+        Stream* socket;
+        std::atomic<bool> expired = false;
+    };
+
+    std::shared_ptr<State> state;
+    boost::asio::steady_timer timer;
+
+public:
+    Deadline(Stream& socket, std::chrono::milliseconds timeout)
+        : state(std::make_shared<State>()), timer(executor.io(), timeout)
+    {
+        state->socket = &socket;
+        timer.async_wait([state = state](const boost::system::error_code& error) {
+            std::lock_guard<std::mutex> lock(state->mtx);
+            if (error || state->socket == nullptr)
+                return;
+            state->expired = true;
+            boost::system::error_code ignored;
+            state->socket->shutdown(boost::asio::ip::tcp::socket::shutdown_both, ignored);
+        });
+    }
+
+    Deadline(const Deadline&) = delete;
+    Deadline& operator=(const Deadline&) = delete;
+
+    ~Deadline()
+    {
+        // The handler may already be queued, so it is disarmed rather than just cancelled
+        std::lock_guard<std::mutex> lock(state->mtx);
+        state->socket = nullptr;
+        timer.cancel();
+    }
+
+    bool expired() const
+    {
+        return state->expired;
+    }
+};
+
+#endif
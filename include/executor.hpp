@@ -0,0 +1,389 @@
+#ifndef EXECUTOR_HPP
+#define EXECUTOR_HPP
+
+#include <boost/asio.hpp>
+#include <pthread.h>
+#include <sched.h>
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+#define EXECUTOR_BLOCKING_THREADS 8     // Blocking steps that finish: rekeys, history sync answers, maintenance passes
+#define EXECUTOR_NO_SHARD SIZE_MAX      // A thread that works for no session in particular
+
+// Chosen once at startup (DENIM_IO_SHARDS, DENIM_PIN_THREADS)
+std::size_t io_shard_count = 0;     // 0 is one per core
+bool pin_threads = false;           // Pin each I/O shard's thread, and the CPU pool's worker of the same index, to its own core
+
+// I/O shard of the session the calling thread works for: set on the shard's own thread, by a ShardScope,
+// and for the length of every task posted to a pool from a thread that had one
+thread_local std::size_t current_shard = EXECUTOR_NO_SHARD;
+
+// Makes the calling thread work for a shard until the end of the scope
+class ShardScope
+{
+    std::size_t previous;
+
+public:
+    explicit ShardScope(std::size_t shard) : previous(current_shard)
+    {
+        current_shard = shard;
+    }
+
+    ShardScope(const ShardScope&) = delete;
+    ShardScope& operator=(const ShardScope&) = delete;
+
+    ~ShardScope()
+    {
+        current_shard = previous;
+    }
+};
+
+void pin_to_core(std::thread& thread, std::size_t core)
+{
+#ifdef __linux__
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(core % std::max(1u, std::thread::hardware_concurrency()), &set);
+    pthread_setaffinity_np(thread.native_handle(), sizeof(set), &set);
+#endif
+}
+
+// Fixed-size pool where every worker owns a deque of tasks. A worker pops the newest task of its
+// own deque and, once that is empty, steals the oldest task from another worker. A task posted for
+// a shard goes to the deque of the worker with the shard's index, and runs in that shard.
+class WorkStealingPool
+{
+    struct Task
+    {
+        std::function<void()> run;
+        std::size_t shard = EXECUTOR_NO_SHARD;
+    };
+
+    struct Worker
+    {
+        std::mutex mtx;
+        std::deque<Task> tasks;
+    };
+
+    std::vector<std::unique_ptr<Worker>> workers;
+    std::vector<std::thread> threads;
+    std::mutex idle_mtx;
+    std::condition_variable idle_cv;
+    std::atomic<std::size_t> queued = 0;
+    std::atomic<std::size_t> next_worker = 0;
+    std::atomic<bool> stopping = false;
+
+    static inline thread_local WorkStealingPool* current_pool = nullptr;
+    static inline thread_local std::size_t current_index = 0;
+
+    bool try_pop(std::size_t index, Task& task)
+    {
+        {
+            Worker& own = *workers[index];
+            std::lock_guard<std::mutex> lock(own.mtx);
+            if (!own.tasks.empty())
+            {
+                task = std::move(own.tasks.back());
+                own.tasks.pop_back();
+                return true;
+            }
+        }
+        for (std::size_t i = 1; i < workers.size(); i++)
+        {
+            Worker& victim = *workers[(index + i) % workers.size()];
+            std::lock_guard<std::mutex> lock(victim.mtx);
+            if (!victim.tasks.empty())
+            {
+                task = std::move(victim.tasks.front());
+                victim.tasks.pop_front();
+                return true;
+            }
+        }
+        return false;
+    }
+
+    void run(std::size_t index)
+    {
+        current_pool = this;
+        current_index = index;
+        Task task;
+        while (true)
+        {
+            if (try_pop(index, task))
+            {
+                queued--;
+                current_shard = task.shard;
+                task.run();
+                task.run = nullptr;
+                continue;
+            }
+
+            std::unique_lock<std::mutex> lock(idle_mtx);
+            idle_cv.wait(lock, [this]() { return queued > 0 || stopping; });
+            if (stopping && queued == 0)
+                return;
+        }
+    }
+
+public:
+    explicit WorkStealingPool(std::size_t size, bool pinned = false)
+    {
+        size = std::max<std::size_t>(size, 1);
+        for (std::size_t i = 0; i < size; i++)
+            workers.push_back(std::make_unique<Worker>());
+        for (std::size_t i = 0; i < size; i++)
+        {
+            threads.emplace_back([this, i]() { run(i); });
+            if (pinned)
+                pin_to_core(threads.back(), i);
+        }
+    }
+
+    WorkStealingPool(const WorkStealingPool&) = delete;
+    WorkStealingPool& operator=(const WorkStealingPool&) = delete;
+
+    ~WorkStealingPool()
+    {
+        shutdown();
+    }
+
+    std::size_t size() const
+    {
+        return workers.size();
+    }
+
+    // Queues a task without a result. Tasks posted from a worker go to that worker's own deque, and
+    // the other ones to their shard's worker, if any.
+    void post(std::function<void()> task)
+    {
+        std::size_t index;
+        if (current_pool == this)
+            index = current_index;
+        else if (current_shard != EXECUTOR_NO_SHARD)
+            index = current_shard % workers.size();
+        else
+            index = next_worker++ % workers.size();
+
+        // Counted before it can be popped, so a worker stealing it cannot take the count below zero
+        {
+            std::lock_guard<std::mutex> lock(idle_mtx);
+            queued++;
+        }
+        {
+            Worker& worker = *workers[index];
+            std::lock_guard<std::mutex> lock(worker.mtx);
+            worker.tasks.push_back(Task{std::move(task), current_shard});
+        }
+        idle_cv.notify_one();
+    }
+
+    // Queues a task and returns a future for its result (or exception)
+    template <typename F>
+    auto submit(F&& f) -> std::future<std::invoke_result_t<std::decay_t<F>>>
+    {
+        using R = std::invoke_result_t<std::decay_t<F>>;
+        auto task = std::make_shared<std::packaged_task<R()>>(std::forward<F>(f));
+        std::future<R> result = task->get_future();
+        post([task]() { (*task)(); });
+        return result;
+    }
+
+    // Runs the tasks already queued, then joins the workers. Must not be called from a worker.
+    void shutdown()
+    {
+        {
+            std::lock_guard<std::mutex> lock(idle_mtx);
+            stopping = true;
+        }
+        idle_cv.notify_all();
+        for (auto& thread : threads)
+            if (thread.joinable())
+                thread.join();
+        threads.clear();
+    }
+
+    // Leaves workers that are stuck in a blocking call behind instead of joining them (process exit)
+    void abandon()
+    {
+        {
+            std::lock_guard<std::mutex> lock(idle_mtx);
+            stopping = true;
+        }
+        idle_cv.notify_all();
+        for (auto& thread : threads)
+            if (thread.joinable())
+                thread.detach();
+        threads.clear();
+    }
+};
+
+// Runs the tasks posted to it one at a time, in order, on a shared pool
+class SerialQueue
+{
+    WorkStealingPool& pool;
+    std::mutex mtx;
+    std::deque<std::function<void()>> tasks;
+    bool running = false;
+
+    void drain()
+    {
+        std::function<void()> task;     // Outlives the lock below: the last task may own this queue
+        while (true)
+        {
+            {
+                std::lock_guard<std::mutex> lock(mtx);
+                if (tasks.empty())
+                {
+                    running = false;
+                    return;
+                }
+                task = std::move(tasks.front());
+                tasks.pop_front();
+            }
+            task();
+        }
+    }
+
+public:
+    explicit SerialQueue(WorkStealingPool& pool) : pool(pool) {}
+
+    void post(std::function<void()> task)
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        tasks.push_back(std::move(task));
+        if (!running)
+        {
+            running = true;
+            pool.post([this]() { drain(); });
+        }
+    }
+};
+
+// One io_context with a thread of its own. A session's sockets and timers live on a single shard, so
+// all of its I/O completes on one thread (and core, with pin_threads) instead of waking another one.
+struct IoShard
+{
+    boost::asio::io_context io_context{1};      // Run by one thread only
+    std::unique_ptr<boost::asio::executor_work_guard<boost::asio::io_context::executor_type>> work;
+    std::thread thread;
+};
+
+// All threads of the process besides main, which runs the console: a work-stealing pool for CPU-bound
+// crypto, a pool for blocking steps, and the I/O shards. Sessions read with async operations on their
+// shard, so the thread count does not grow with them. Each session is assigned a shard when it starts;
+// its tasks carry the shard, so its sockets and timers (executor.io()) and its crypto stay there.
+class Executor
+{
+    std::vector<std::unique_ptr<IoShard>> shards;
+    std::atomic<std::size_t> next_shard = 0;
+    std::unique_ptr<WorkStealingPool> cpu_pool;
+    std::unique_ptr<WorkStealingPool> blocking_pool;
+
+public:
+    // Shard 0 exists from the start, for whatever is set up before start() (and the threads without a shard)
+    Executor()
+    {
+        shards.push_back(std::make_unique<IoShard>());
+    }
+
+    ~Executor()
+    {
+        // Only reached without shutdown() when the process exits on an error: workers may still be
+        // blocked on a socket, so they are left behind (and their pools leaked) rather than joined
+        for (auto& shard : shards)
+        {
+            shard->io_context.stop();
+            if (shard->thread.joinable())
+                shard->thread.detach();
+        }
+        if (blocking_pool)
+            blocking_pool.release()->abandon();
+        if (cpu_pool)
+            cpu_pool.release()->abandon();
+    }
+
+    void start(std::size_t cpu_threads = std::thread::hardware_concurrency(),
+               std::size_t shard_count = io_shard_count ? io_shard_count : std::thread::hardware_concurrency(),
+               std::size_t blocking_threads = EXECUTOR_BLOCKING_THREADS)
+    {
+        cpu_pool = std::make_unique<WorkStealingPool>(cpu_threads, pin_threads);
+        blocking_pool = std::make_unique<WorkStealingPool>(blocking_threads);
+
+        while (shards.size() < std::max<std::size_t>(shard_count, 1))
+            shards.push_back(std::make_unique<IoShard>());
+        for (std::size_t i = 0; i < shards.size(); i++)
+        {
+            IoShard& shard = *shards[i];
+            shard.work = std::make_unique<boost::asio::executor_work_guard<boost::asio::io_context::executor_type>>(shard.io_context.get_executor());
+            shard.thread = std::thread([&shard, i]() {
+                current_shard = i;
+                shard.io_context.run();
+            });
+            if (pin_threads)
+                pin_to_core(shard.thread, i);
+        }
+    }
+
+    std::size_t shard_count() const
+    {
+        return shards.size();
+    }
+
+    // Shard for a new session, round robin
+    std::size_t assign_shard()
+    {
+        return next_shard++ % shards.size();
+    }
+
+    WorkStealingPool& cpu()
+    {
+        return *cpu_pool;
+    }
+
+    WorkStealingPool& blocking()
+    {
+        return *blocking_pool;
+    }
+
+    // The io_context of the calling thread's shard (shard 0 without one)
+    boost::asio::io_context& io()
+    {
+        return io(current_shard == EXECUTOR_NO_SHARD ? 0 : current_shard);
+    }
+
+    boost::asio::io_context& io(std::size_t shard)
+    {
+        return shards[shard % shards.size()]->io_context;
+    }
+
+    // Lets the io_contexts run out of work, then finishes the queued tasks and joins every thread.
+    // Every session must have ended and every periodic timer been stopped. Must not be called from
+    // one of the executor's own threads.
+    void shutdown()
+    {
+        for (auto& shard : shards)
+        {
+            shard->work.reset();
+            if (shard->thread.joinable())
+                shard->thread.join();
+        }
+        blocking_pool->shutdown();
+        cpu_pool->shutdown();
+        blocking_pool.reset();
+        cpu_pool.reset();
+    }
+};
+
+Executor executor;
+
+#endif
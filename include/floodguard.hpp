@@ -0,0 +1,40 @@
+#ifndef FLOODGUARD_HPP
+#define FLOODGUARD_HPP
+
+#define KEYEX_RETRY std::string("RETRY_DHKE")       // Reply when the client has to wait, followed by ":" and the wait in milliseconds
+
+#include <algorithm>
+#include <chrono>
+
+// Chosen once at startup (DENIM_HANDSHAKE_RATE, DENIM_HANDSHAKE_BURST)
+double handshake_rate = 2;          // Handshakes per second the peer may start
+double handshake_burst = 8;         // Handshakes the peer may start back to back
+
+// Admission control in front of the server's DH work. The key exchange port only accepts the address
+// of the session's peer, so every request comes from that peer: a token bucket bounds how often it can
+// make this side generate keys, and a request over the limit is told how long to wait. One per session;
+// its handshakes run one after the other, so it needs no lock.
+class HandshakeBucket
+{
+    double tokens = handshake_burst;
+    std::chrono::steady_clock::time_point updated = std::chrono::steady_clock::now();
+
+public:
+    // Takes a token. Returns zero if there was one, otherwise how long until there is.
+    std::chrono::milliseconds admit()
+    {
+        auto now = std::chrono::steady_clock::now();
+        double elapsed = std::chrono::duration<double>(now - updated).count();
+        tokens = std::min(handshake_burst, tokens + elapsed * handshake_rate);
+        updated = now;
+        if (tokens >= 1)
+        {
+            tokens -= 1;
+            return std::chrono::milliseconds(0);
+        }
+        double wait = (1 - tokens) / std::max(handshake_rate, 0.001);
+        return std::chrono::milliseconds(static_cast<long>(wait * 1000) + 1);
+    }
+};
+
+#endif
@@ -0,0 +1,199 @@
+#ifndef GROUP_HPP
+#define GROUP_HPP
+
+#include <boost/asio.hpp>
+#include <chrono>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <atomic>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+#include "readwrite.hpp"
+#include "executor.hpp"
+#include "sendqueue.hpp"
+#include "keyring.hpp"
+
+// Frames a broadcast for one member, sealed under its pairwise key in the mode of its session
+template <class Mode>
+std::string seal_group_message(const std::string& group_id, const LogRecord& record, const SessionKey& session_key)
+{
+    auto msg_pkt = seal_packet<Mode>(record.message, session_key);
+    msg_pkt.set_group_id(group_id);
+    msg_pkt.set_sync_fields(record.uid, record.modified);
+    return serialize_packet(msg_pkt);
+}
+
+// One member of a group room, reached over its own pairwise session
+struct GroupMember
+{
+    std::string peer;
+    std::shared_ptr<FrameQueue> outbound;    // The member's connection queue, shared with its pairwise session
+    std::shared_ptr<const SessionKey> key;      // Active key of the pairwise session
+    std::shared_ptr<LogStore> store;
+    std::string (*seal)(const std::string&, const LogRecord&, const SessionKey&);  // seal_group_message of the session's mode
+    SerialQueue serial;                     // Keeps this member's frames in order
+    std::atomic<bool> dropped = false;
+
+    GroupMember(const std::string& peer, std::shared_ptr<FrameQueue> outbound, std::shared_ptr<const SessionKey> key, std::shared_ptr<LogStore> store,
+                std::string (*seal)(const std::string&, const LogRecord&, const SessionKey&))
+        : peer(peer), outbound(std::move(outbound)), key(std::move(key)), store(std::move(store)), seal(seal), serial(executor.cpu())
+    {
+    }
+};
+
+// A small group conversation. A broadcast is encrypted and MAC'd once per member under that member's
+// pairwise key, in parallel on the executor's CPU pool, and queued on the member's outgoing queue so a slow member
+// only fills its own queue instead of holding back the others. A member whose queue stays above its high
+// water mark is dropped from the room.
+class GroupRoom
+{
+    std::string group_id;
+    std::mutex mtx;
+    std::vector<std::shared_ptr<GroupMember>> members;
+
+public:
+    explicit GroupRoom(const std::string& group_id) : group_id(group_id) {}
+
+    const std::string& id() const
+    {
+        return group_id;
+    }
+
+    // Adds a member whose pairwise session runs in the given mode; its broadcasts are sealed the same way
+    template <class Mode>
+    void add_member(const std::string& peer, std::shared_ptr<FrameQueue> outbound, std::shared_ptr<const SessionKey> key, std::shared_ptr<LogStore> store)
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        members.push_back(std::make_shared<GroupMember>(peer, std::move(outbound), std::move(key), std::move(store), &seal_group_message<Mode>));
+    }
+
+    bool contains(const std::string& peer)
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        return std::any_of(members.begin(), members.end(), [&](const auto& member) { return member->peer == peer; });
+    }
+
+    void remove_member(const std::string& peer)
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        std::erase_if(members, [&](const auto& member) { return member->peer == peer; });
+    }
+
+    // Installs a member's newly activated pairwise key; frames already queued keep the old one, and an
+    // older key than the member's is ignored
+    void update_key(const std::string& peer, std::shared_ptr<const SessionKey> key)
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        for (auto& member : members)
+            if (member->peer == peer)
+                member->serial.post([member, key]() {
+                    if (key->epoch > member->key->epoch)
+                        member->key = key;
+                });
+    }
+
+    // Queues the message for every member and returns without waiting for any of them
+    void broadcast(const std::string& message)
+    {
+        std::time_t timestamp = clk::to_time_t(clk::now());
+        std::string time_str = std::ctime(&timestamp);
+        time_str.pop_back();
+        LogRecord record = new_message("YOU", message, time_str, group_id);     // Same uid in every member's history
+
+        std::lock_guard<std::mutex> lock(mtx);
+        for (auto& member : members)
+        {
+            member->serial.post([group_id = group_id, member, record]() {
+                if (member->dropped)
+                    return;
+                if (!member->outbound->ok())
+                {
+                    member->dropped = true;
+                    return;
+                }
+
+                try
+                {
+                    if (!member->outbound->try_enqueue(member->seal(group_id, record, *member->key)))
+                    {
+                        std::cerr << "Group: " << member->peer << " is too far behind, dropping it from " << group_id << "\n";
+                        member->dropped = true;
+                        return;
+                    }
+                    insert_message(*member->store, record);
+                } catch (std::exception& e) {
+                    std::cerr << "Group: Error encrypting for " << member->peer << ": " << e.what() << "\n";
+                }
+            });
+        }
+
+        // Forget the members whose connection failed
+        std::erase_if(members, [](const auto& member) { return member->dropped.load(); });
+    }
+};
+
+// The group rooms of this process, by id, created when they are first written to
+class GroupDirectory
+{
+    std::mutex mtx;
+    std::unordered_map<std::string, std::shared_ptr<GroupRoom>> rooms;
+
+public:
+    std::shared_ptr<GroupRoom> room(const std::string& group_id)
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        auto& room = rooms[group_id];
+        if (!room)
+            room = std::make_shared<GroupRoom>(group_id);
+        return room;
+    }
+
+    // Passes a peer's newly activated pairwise key on to every room it is in
+    void update_key(const std::string& peer, std::shared_ptr<const SessionKey> key)
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        for (auto& [group_id, room] : rooms)
+            room->update_key(peer, key);
+    }
+
+    // The peer's session is over
+    void leave(const std::string& peer)
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        for (auto& [group_id, room] : rooms)
+            room->remove_member(peer);
+    }
+};
+
+GroupDirectory group_rooms;
+
+// Lets the user of a session write to group rooms (:g <room> <message>). The session's peer joins a
+// room the first time the user writes there, and the keys the session activates later are passed on
+// to its rooms. The returned sender is handed to write_to_socket; call group_rooms.leave(peer) when
+// the session ends.
+template <class Mode>
+GroupSender group_sender(const std::string& peer, std::shared_ptr<FrameQueue> outbound, std::shared_ptr<LogStore> store, std::shared_ptr<KeyRing> keys)
+{
+    keys->on_activated([peer](std::shared_ptr<const SessionKey> key) { group_rooms.update_key(peer, key); });
+
+    return [peer, outbound, store, keys](const std::string& group_id, const std::string& message) {
+        auto session_key = keys->peek();
+        if (!session_key)
+            return false;
+
+        auto room = group_rooms.room(group_id);
+        if (!room->contains(peer))
+        {
+            room->add_member<Mode>(peer, outbound, session_key, store);
+            room->update_key(peer, keys->peek());       // In case a rekey finished in between
+        }
+        room->broadcast(message);       // Logged in the peer's history with the room's id
+        keys->mark_used();
+        return true;
+    };
+}
+
+#endif
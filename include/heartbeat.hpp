@@ -0,0 +1,197 @@
+#ifndef HEARTBEAT_HPP
+#define HEARTBEAT_HPP
+
+#include <boost/asio.hpp>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include "message.hpp"
+#include "sendqueue.hpp"
+#include "executor.hpp"
+
+#define RTT_INITIAL_RTO std::chrono::milliseconds(1000)     // RFC 6298 starting value, before any sample
+#define RTT_MIN_RTO std::chrono::milliseconds(200)
+#define HANDSHAKE_RTO_FACTOR 8                              // A 3DH handshake is 3 round trips plus the DH work
+#define HANDSHAKE_MIN_TIMEOUT std::chrono::milliseconds(5000)
+#define HANDSHAKE_MAX_TIMEOUT std::chrono::milliseconds(30000)
+
+// Chosen once at startup (DENIM_HEARTBEAT_MS, DENIM_PEER_TIMEOUT_MS)
+std::chrono::milliseconds heartbeat_interval(5000);
+std::chrono::milliseconds peer_timeout(15000);      // Silence after which the peer is considered gone
+
+using steady_clk = std::chrono::steady_clock;
+
+// Smoothed round-trip time as in RFC 6298 (TCP's retransmission timer)
+class RttEstimator
+{
+    std::chrono::microseconds srtt{0};
+    std::chrono::microseconds rttvar{0};
+    std::chrono::microseconds last{0};
+    std::size_t samples = 0;
+
+public:
+    void sample(std::chrono::microseconds rtt)
+    {
+        if (samples++ == 0)
+        {
+            srtt = rtt;
+            rttvar = rtt / 2;
+        } else {
+            auto delta = srtt > rtt ? srtt - rtt : rtt - srtt;
+            rttvar = (3 * rttvar + delta) / 4;
+            srtt = (7 * srtt + rtt) / 8;
+        }
+        last = rtt;
+    }
+
+    std::chrono::microseconds smoothed() const { return srtt; }
+    std::chrono::microseconds variation() const { return rttvar; }
+    std::chrono::microseconds latest() const { return last; }
+    std::size_t count() const { return samples; }
+
+    std::chrono::microseconds rto() const
+    {
+        if (samples == 0)
+            return RTT_INITIAL_RTO;
+        return std::max<std::chrono::microseconds>(srtt + 4 * rttvar, RTT_MIN_RTO);
+    }
+};
+
+// Liveness of one session. Sends a ping every heartbeat_interval, answers the peer's pings, measures
+// the RTT from the pongs, and calls on_dead once nothing at all has been received for peer_timeout,
+// which catches half-open connections that a blocked read would never notice.
+// Control frames are not encrypted or MAC'd: they carry nothing but a timestamp.
+class Heartbeat : public std::enable_shared_from_this<Heartbeat>
+{
+    std::shared_ptr<FrameQueue> outbound;
+    std::function<void()> on_dead;
+    boost::asio::steady_timer timer;
+
+    std::mutex mtx;
+    RttEstimator rtt;
+    steady_clk::time_point last_heard;
+    bool stopped = false;
+
+    static uint64_t now_us()
+    {
+        return std::chrono::duration_cast<std::chrono::microseconds>(steady_clk::now().time_since_epoch()).count();
+    }
+
+    void schedule()
+    {
+        timer.expires_after(heartbeat_interval);
+        timer.async_wait([self = shared_from_this()](const boost::system::error_code& error) {
+            if (!error)
+                self->tick();
+        });
+    }
+
+    void tick()
+    {
+        bool dead;
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            if (stopped)
+                return;
+            auto silence = steady_clk::now() - last_heard;
+            dead = silence > peer_timeout;
+            if (dead)
+            {
+                stopped = true;
+                std::cerr << "Peer silent for " << std::chrono::duration_cast<std::chrono::seconds>(silence).count() << "s, closing the session\n";
+            }
+        }
+        if (dead)
+        {
+            on_dead();
+            return;
+        }
+
+        // A ping that does not fit is skipped; the queue being that full is its own sign of trouble
+        Message ping;
+        ping.set_control(MessageKind::Ping, now_us());
+        outbound->try_enqueue(serialize_packet(ping), SendClass::Unreliable);
+        schedule();
+    }
+
+public:
+    Heartbeat(std::shared_ptr<FrameQueue> outbound, std::function<void()> on_dead)
+        : outbound(std::move(outbound)), on_dead(std::move(on_dead)), timer(executor.io()), last_heard(steady_clk::now())
+    {
+    }
+
+    void start()
+    {
+        schedule();
+    }
+
+    void stop()
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        stopped = true;
+        timer.cancel();
+    }
+
+    bool running()
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        return !stopped;
+    }
+
+    // Called by the reader for every frame received. Returns true if it was a control frame, which is then fully handled.
+    template <class Packet>
+    bool on_frame(const PacketView<Packet>& msg)
+    {
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            last_heard = steady_clk::now();
+            if (msg.get_kind() == MessageKind::Pong)
+            {
+                uint64_t now = now_us();
+                if (msg.get_timestamp() <= now)
+                    rtt.sample(std::chrono::microseconds(now - msg.get_timestamp()));
+                return true;
+            }
+        }
+
+        if (msg.get_kind() == MessageKind::Ping)
+        {
+            Message pong;
+            pong.set_control(MessageKind::Pong, msg.get_timestamp());
+            outbound->try_enqueue(serialize_packet(pong), SendClass::Unreliable);
+            return true;
+        }
+        return false;
+    }
+
+    RttEstimator stats()
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        return rtt;
+    }
+
+    // How long a key exchange may take before the peer is given up on
+    std::chrono::milliseconds handshake_timeout()
+    {
+        auto timeout = std::chrono::duration_cast<std::chrono::milliseconds>(stats().rto() * HANDSHAKE_RTO_FACTOR);
+        return std::clamp(timeout, HANDSHAKE_MIN_TIMEOUT, HANDSHAKE_MAX_TIMEOUT);
+    }
+};
+
+// Prints the measured RTT of a session
+void print_rtt(const RttEstimator& rtt)
+{
+    if (rtt.count() == 0)
+    {
+        std::cout << "RTT: no samples yet\n";
+        return;
+    }
+    std::cout << "RTT: " << rtt.latest().count() / 1000.0 << " ms (smoothed " << rtt.smoothed().count() / 1000.0
+              << " ms, variation " << rtt.variation().count() / 1000.0 << " ms, " << rtt.count() << " samples)\n";
+}
+
+#endif
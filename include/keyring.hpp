@@ -0,0 +1,192 @@
+#ifndef KEYRING_HPP
+#define KEYRING_HPP
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <botan/secmem.h>
+#include "arena.hpp"
+#include "heartbeat.hpp"
+#include "suite.hpp"
+
+#define SESSION_KEY_ARENA_SIZE 4096     // One page: the record key and the signing key password
+
+// Key material of one completed 3DH handshake, kept in a locked page of its own that is zeroed when
+// the last packet that may need the key has let go of it. Epochs count the handshakes of a session
+// from 1, so both sides number them the same way. Each handshake negotiates its own suite.
+struct SessionKey
+{
+    uint64_t epoch = 0;
+    SessionArena arena{SESSION_KEY_ARENA_SIZE};
+    arena_vector<uint8_t> key{ArenaAllocator<uint8_t>(arena)};
+    arena_string ds_pass{ArenaAllocator<char>(arena)};
+    CipherSuite suite;
+    std::string offer;      // The client's suite offer as it was sent or received, covered by the key confirmation
+
+    explicit SessionKey(uint64_t epoch = 0) : epoch(epoch) {}
+};
+
+// The keys of one session. A new key is first added for receiving, since the peer may switch to it
+// as soon as it has confirmed it, and is only activated for sending once this side has confirmed it too.
+//
+// Frames are sealed when they are queued, so the peer's send queue, outbox batch or datagram
+// retransmissions can still deliver packets under a key many rekeys after it was replaced. An older
+// key is therefore kept until peer_timeout has passed both since it was replaced and since the last
+// packet under it arrived: a frame held back longer than that belongs to a connection the heartbeat
+// has given up on.
+class KeyRing
+{
+    using steady_clk = std::chrono::steady_clock;
+
+    struct Retained
+    {
+        std::shared_ptr<const SessionKey> key;
+        steady_clk::time_point last_use;    // Added, replaced, or last received under, whichever is latest
+    };
+
+    std::mutex mtx;
+    std::condition_variable changed;
+    std::deque<Retained> keys;          // Oldest first
+    std::shared_ptr<const SessionKey> active;
+    uint64_t used = 0;                  // Messages protected with the active key
+    bool closed = false;
+    std::function<void(bool)> on_used;  // Waiting for the active key to be used, see when_used
+    std::function<void(std::shared_ptr<const SessionKey>)> on_activate;     // See on_activated
+
+    // Called with the lock held
+    void drop_expired(steady_clk::time_point now)
+    {
+        while (!keys.empty() && active && keys.front().key->epoch < active->epoch && now - keys.front().last_use > peer_timeout)
+            keys.pop_front();
+    }
+
+public:
+    void add(std::shared_ptr<const SessionKey> key)
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        auto now = steady_clk::now();
+        keys.push_back({std::move(key), now});
+        drop_expired(now);
+    }
+
+    // Switches sending to a key previously added
+    void activate(uint64_t epoch)
+    {
+        std::shared_ptr<const SessionKey> activated;
+        std::function<void(std::shared_ptr<const SessionKey>)> callback;
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            auto now = steady_clk::now();
+            for (auto& retained : keys)
+            {
+                if (retained.key == active)
+                    retained.last_use = now;     // Replaced just now; the peer may still receive under it
+                if (retained.key->epoch == epoch)
+                    active = retained.key;
+            }
+            used = 0;
+            drop_expired(now);
+            activated = active;
+            callback = on_activate;
+        }
+        changed.notify_all();
+        if (callback && activated)
+            callback(activated);
+    }
+
+    // Calls back with every key activated from now on, on the thread that activated it
+    void on_activated(std::function<void(std::shared_ptr<const SessionKey>)> callback)
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        on_activate = std::move(callback);
+    }
+
+    // Key to send with; waits for the first handshake of the session
+    std::shared_ptr<const SessionKey> current()
+    {
+        std::unique_lock<std::mutex> lock(mtx);
+        changed.wait(lock, [this]() { return active != nullptr || closed; });
+        return active;
+    }
+
+    // Key to send with, or nullptr before the first handshake; never waits
+    std::shared_ptr<const SessionKey> peek()
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        return active;
+    }
+
+    // Key a received packet was sent under, or nullptr if it is unknown or has been dropped
+    std::shared_ptr<const SessionKey> find(uint64_t epoch)
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        auto now = steady_clk::now();
+        for (auto it = keys.rbegin(); it != keys.rend(); ++it)     // Most packets are under a recent key
+            if (it->key->epoch == epoch)
+            {
+                it->last_use = now;
+                return it->key;
+            }
+        return nullptr;
+    }
+
+    uint64_t next_epoch()
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        return keys.empty() ? 1 : keys.back().key->epoch + 1;
+    }
+
+    // Records that a message was sent or received under the active key
+    void mark_used()
+    {
+        std::function<void(bool)> callback;
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            used++;
+            callback = std::move(on_used);
+            on_used = nullptr;
+        }
+        changed.notify_all();
+        if (callback)
+            callback(true);
+    }
+
+    // Calls back once the active key has protected a message (true) or the ring is closed (false),
+    // right away if that has already happened. The callback runs on the thread that used the key,
+    // so it should only hand the work on.
+    void when_used(std::function<void(bool)> callback)
+    {
+        bool ready, open;
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            ready = used > 0 || closed;
+            open = !closed;
+            if (!ready)
+                on_used = std::move(callback);
+        }
+        if (ready)
+            callback(open);
+    }
+
+    // Wakes everyone waiting; the session is over
+    void close()
+    {
+        std::function<void(bool)> callback;
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            closed = true;
+            callback = std::move(on_used);
+            on_used = nullptr;
+        }
+        changed.notify_all();
+        if (callback)
+            callback(false);
+    }
+};
+
+#endif
@@ -0,0 +1,187 @@
+#ifndef LOGCACHE_HPP
+#define LOGCACHE_HPP
+
+#include <algorithm>
+#include <future>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include <boost/filesystem.hpp>
+#include "sqlitelog.hpp"
+#include "mmaplog.hpp"
+
+#define LOG_PATH std::string("../lib/logs/")
+
+enum class LogBackend { Sqlite, Mmap };
+enum class LogLayout { PerPeer, Consolidated };    // Consolidated only applies to the SQLite backend
+
+// Chosen once at startup (DENIM_LOG_BACKEND, DENIM_LOG_LAYOUT, DENIM_LOG_CACHE)
+LogBackend log_backend = LogBackend::Sqlite;
+LogLayout log_layout = LogLayout::PerPeer;
+std::size_t log_cache_capacity = 16;
+
+// Bounded LRU of open message histories keyed by peer ID, so that reconnecting to a peer reuses the
+// open handle and its prepared statements instead of reopening the file and re-checking the schema.
+// A store evicted while a session still holds it stays registered until that session drops it,
+// so two handles never end up appending to the same history. Stores are opened outside the lock,
+// since opening may convert a legacy history; whoever asks for the same peer meanwhile waits for
+// that open instead of starting a second one, and everyone else goes on.
+class LogStoreCache
+{
+    using Opening = std::shared_future<std::shared_ptr<LogStore>>;
+
+    std::mutex mtx;
+    std::list<std::pair<std::string, std::shared_ptr<LogStore>>> lru;    // Most recently used first
+    std::unordered_map<std::string, decltype(lru)::iterator> entries;
+    std::unordered_map<std::string, std::weak_ptr<LogStore>> in_use;
+    std::unordered_map<std::string, Opening> opening;                    // Stores being opened right now
+    std::once_flag consolidated_opened;
+    std::shared_ptr<SqliteDatabase> consolidated_db;
+
+    std::shared_ptr<LogStore> open(const std::string& peer)
+    {
+        if (log_backend == LogBackend::Mmap)
+            return std::make_shared<MmapLogStore>(LOG_PATH + "msghist_" + peer + ".log");
+        if (log_layout == LogLayout::Consolidated)
+            return std::make_shared<SqliteLogStore>(consolidated(), peer);
+        return std::make_shared<SqliteLogStore>(LOG_PATH + "msghist_" + peer + ".db");
+    }
+
+    // Opened once, by the first caller; a failed open is retried by the next one
+    std::shared_ptr<SqliteDatabase> consolidated()
+    {
+        std::call_once(consolidated_opened, [this]() {
+            consolidated_db = std::make_shared<SqliteDatabase>(LOG_PATH + "msghist.db");
+        });
+        return consolidated_db;
+    }
+
+    // The registered store of a peer, opened with the lock released if there is none. Called and
+    // returns with the lock held.
+    std::shared_ptr<LogStore> registered(std::unique_lock<std::mutex>& lock, const std::string& peer)
+    {
+        if (std::shared_ptr<LogStore> store = in_use[peer].lock())
+            return store;
+
+        auto pending = opening.find(peer);
+        if (pending != opening.end())
+        {
+            Opening other = pending->second;
+            lock.unlock();
+            std::shared_ptr<LogStore> store;
+            try
+            {
+                store = other.get();
+            } catch (...) {
+                lock.lock();
+                throw;
+            }
+            lock.lock();
+            in_use[peer] = store;       // The opener's session may have let go of it already
+            return store;
+        }
+
+        std::promise<std::shared_ptr<LogStore>> promise;
+        opening[peer] = promise.get_future().share();
+        lock.unlock();
+        std::shared_ptr<LogStore> store;
+        try
+        {
+            store = open(peer);
+        } catch (...) {
+            lock.lock();
+            opening.erase(peer);
+            promise.set_exception(std::current_exception());
+            throw;
+        }
+        lock.lock();
+        opening.erase(peer);
+        in_use[peer] = store;
+        promise.set_value(store);
+        return store;
+    }
+
+    // Called with the lock held
+    std::shared_ptr<LogStore> cache(const std::string& peer, std::shared_ptr<LogStore> store)
+    {
+        lru.emplace_front(peer, store);
+        entries[peer] = lru.begin();
+        while (lru.size() > std::max<std::size_t>(log_cache_capacity, 1))
+        {
+            entries.erase(lru.back().first);
+            lru.pop_back();
+        }
+
+        // Forget evicted stores that every session has since let go of
+        if (in_use.size() > 2 * lru.size())
+            std::erase_if(in_use, [](const auto& entry) { return entry.second.expired(); });
+        return store;
+    }
+
+public:
+    std::shared_ptr<LogStore> acquire(const std::string& peer)
+    {
+        std::unique_lock<std::mutex> lock(mtx);
+
+        auto hit = entries.find(peer);
+        if (hit == entries.end())
+        {
+            std::shared_ptr<LogStore> store = registered(lock, peer);
+            hit = entries.find(peer);       // Cached by another session while this one waited for the open
+            if (hit == entries.end())
+                return cache(peer, store);
+        }
+        lru.splice(lru.begin(), lru, hit->second);
+        return hit->second->second;
+    }
+
+    // The history of a peer for a maintenance pass: the open store if there is one, otherwise a new one
+    // that is registered like an evicted store (so a session starting meanwhile shares it) but does
+    // not push a session's store out of the cache
+    std::shared_ptr<LogStore> borrow(const std::string& peer)
+    {
+        std::unique_lock<std::mutex> lock(mtx);
+        auto hit = entries.find(peer);
+        if (hit != entries.end())
+            return hit->second->second;
+        return registered(lock, peer);
+    }
+
+    // Every peer with a history on disk in the configured backend and layout
+    std::vector<std::string> peers()
+    {
+        if (log_backend == LogBackend::Sqlite && log_layout == LogLayout::Consolidated)
+        {
+            if (!boost::filesystem::exists(LOG_PATH + "msghist.db"))
+                return {};
+            return consolidated()->peers();
+        }
+
+        std::vector<std::string> found;
+        if (!boost::filesystem::is_directory(LOG_PATH))
+            return found;
+        const std::string extension = log_backend == LogBackend::Mmap ? ".log" : ".db";
+        for (auto& entry : boost::filesystem::directory_iterator(LOG_PATH))
+        {
+            std::string name = entry.path().filename().string();
+            if (entry.path().extension() != extension || name.rfind("msghist_", 0) != 0)
+                continue;
+            if ((log_backend == LogBackend::Mmap) != boost::filesystem::is_directory(entry.path()))
+                continue;
+            found.push_back(name.substr(8, name.size() - 8 - extension.size()));
+        }
+        return found;
+    }
+};
+
+LogStoreCache log_stores;
+
+// Message history of a peer, shared by all of that peer's sessions
+std::shared_ptr<LogStore> log_store_for(const std::string& peer) {
+    return log_stores.acquire(peer);
+}
+
+#endif
@@ -0,0 +1,152 @@
+#ifndef LOGSTORE_HPP
+#define LOGSTORE_HPP
+
+#include <string>
+#include <cstddef>
+#include <cstdint>
+#include <chrono>
+#include <cstdio>
+#include <random>
+#include <vector>
+#include <optional>
+#include <functional>
+
+#define RETENTION_BATCH 512     // Rows read or dropped per lock of the store by a maintenance pass
+
+// Delivery state of a message written on this side
+enum class DeliveryStatus : uint8_t
+{
+    Sent = 0,       // Handed to the peer's connection (and every received message)
+    Queued = 1      // Written while the peer was offline, waiting in the outbox
+};
+
+// A single row of the message history
+struct LogRecord
+{
+    std::size_t id = 0;
+    std::string person;
+    std::string message;
+    std::string time;
+    std::string group;      // Group room the message belongs to, empty for one-to-one messages
+    DeliveryStatus status = DeliveryStatus::Sent;
+
+    // History sync
+    std::string uid;        // Same on both peers, chosen by the writer; empty for messages logged before sync existed
+    uint64_t change = 0;    // This side's change sequence of its latest insert/edit/delete, 0 if only the peer changed it
+    int64_t modified = 0;   // When the content last changed (microseconds since the epoch); the later change wins
+    bool deleted = false;   // Tombstone, only reported by changes_since
+};
+
+// Retention limits of every peer's history; a limit of 0 is off
+struct RetentionPolicy
+{
+    int64_t max_age = 0;            // Microseconds since the message last changed
+    std::size_t max_rows = 0;       // Messages and tombstones
+    std::size_t max_bytes = 0;      // Their text: person, message, time, group and uid
+
+    bool enabled() const
+    {
+        return max_age > 0 || max_rows > 0 || max_bytes > 0;
+    }
+};
+
+// A message or tombstone as seen by a retention pass
+struct RetentionEntry
+{
+    std::size_t id = 0;
+    int64_t modified = 0;
+    std::size_t bytes = 0;
+    bool pinned = false;    // Still in the outbox: counted, but never removed
+};
+
+// What a maintenance pass of one history did
+struct MaintenanceReport
+{
+    std::size_t removed = 0;            // Messages and tombstones dropped by the retention policy
+    std::size_t removed_bytes = 0;      // Their text
+    std::size_t reclaimed_bytes = 0;    // Disk space given back by vacuum or compaction
+};
+
+// Storage interface behind the MSG_LOGS operations. Every backend must be safe to share
+// between the read and write threads of a session.
+class LogStore
+{
+public:
+    virtual ~LogStore() {}
+
+    virtual void insert(const LogRecord& record) = 0;      // New message written on this side; ignored if its uid is already known
+    virtual bool edit(std::size_t id, const std::string& message) = 0;     // False if no live message has this ID
+    virtual bool remove(std::size_t id) = 0;
+    virtual std::optional<LogRecord> find(std::size_t id) = 0;
+    virtual void scan(const std::function<void(const LogRecord&)>& visit) = 0;  // Live messages in ID order
+
+    // The outbox: queued messages in ID order, and their status update once delivered (all in one batch)
+    virtual void scan_queued(const std::function<void(const LogRecord&)>& visit) = 0;
+    virtual void set_status(const std::vector<std::size_t>& ids, DeliveryStatus status) = 0;
+
+    // History sync: this side's changes after a change sequence, tombstones included, oldest change first;
+    // merging a batch of the peer's messages and changes (in one go, and never recorded as changes of this
+    // side's); and the highest change sequence of the peer's merged so far
+    virtual void changes_since(uint64_t change, const std::function<void(const LogRecord&)>& visit) = 0;
+    virtual void merge(const std::vector<LogRecord>& remote) = 0;
+    virtual uint64_t sync_mark() = 0;
+    virtual void set_sync_mark(uint64_t change) = 0;
+
+    // Background maintenance: drops what the retention policy no longer keeps, in small batches so that
+    // the sessions sharing the store are only held up briefly, then gives the freed space back to the disk.
+    // Dropped messages are forgotten rather than deleted: nothing is synced, the peer keeps its copy, and
+    // the change sequence still never goes back.
+    virtual MaintenanceReport maintain(const RetentionPolicy& policy) = 0;
+};
+
+int64_t now_micros()
+{
+    return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+}
+
+// 128 random bits in hex; only needs to be unique, not secret
+std::string new_message_uid()
+{
+    thread_local std::mt19937_64 gen(std::random_device{}());
+    char uid[33];
+    std::snprintf(uid, sizeof(uid), "%016llx%016llx", static_cast<unsigned long long>(gen()), static_cast<unsigned long long>(gen()));
+    return uid;
+}
+
+// IDs to drop, given a history's entries in ID order: the messages past the age limit (except the ones
+// logged before sync existed, whose age is unknown), and the oldest ones until the row and byte limits are met
+std::vector<std::size_t> select_expired(const std::vector<RetentionEntry>& entries, const RetentionPolicy& policy, int64_t now)
+{
+    std::size_t rows = entries.size();
+    std::size_t bytes = 0;
+    for (const RetentionEntry& entry : entries)
+        bytes += entry.bytes;
+
+    std::vector<std::size_t> expired;
+    for (const RetentionEntry& entry : entries)
+    {
+        bool over = (policy.max_rows > 0 && rows > policy.max_rows) || (policy.max_bytes > 0 && bytes > policy.max_bytes);
+        bool old = policy.max_age > 0 && entry.modified > 0 && entry.modified < now - policy.max_age;
+        if (!over && policy.max_age <= 0)
+            break;
+        if (entry.pinned || !(over || old))
+            continue;
+        expired.push_back(entry.id);
+        rows--;
+        bytes -= entry.bytes;
+    }
+    return expired;
+}
+
+// Whether a change of the peer's supersedes the local state of the same message: deletes are final,
+// and otherwise the later edit wins
+bool remote_wins(const LogRecord& local, const LogRecord& remote)
+{
+    if (local.deleted)
+        return false;
+    if (remote.deleted)
+        return true;
+    return remote.modified > local.modified;
+}
+
+#endif
@@ -1,83 +1,332 @@
 #ifndef MESSAGE_HPP
 #define MESSAGE_HPP
 
-#include <iostream>
-#include <sstream>
-#include <boost/archive/binary_iarchive.hpp>    
-#include <boost/archive/binary_oarchive.hpp>
-#include <boost/serialization/string.hpp>
+#include <boost/endian/conversion.hpp>
+#include <arpa/inet.h>
+#include <array>
+#include <cstdint>
+#include <cstring>
+#include <span>
+#include <string>
+#include <string_view>
+#include <type_traits>
+#include <vector>
 
-// Structure of the message being sent and received
+#define MESSAGE_WIRE_VERSION 7      // Bumped on every layout change; a frame of any other version is rejected as malformed
+#define MESSAGE_WIRE_SIGNED 0x80    // Set in the version byte of the signed layout (SignedMessage)
+
+// Data frames carry a chat message; ping/pong frames only carry a timestamp and are never logged.
+// Sync frames carry history sync (see sync.hpp): a request with the requester's sync mark, a batch
+// of changes encrypted like a message, and a hint that the sender has new changes.
+enum class MessageKind : int
+{
+    Data = 0,
+    Ping = 1,
+    Pong = 2,
+    SyncRequest = 3,
+    SyncBatch = 4,
+    SyncHint = 5
+};
+
+class Message;
+
+template <std::size_t Extra>
+std::string write_frame(const Message& msg, uint8_t version, const std::array<const std::string*, Extra>& extra);
+
+// Structure of the message being sent. Received messages are read through a PacketView instead.
+//
+// Frame: the body size (32 bits), then the body: version (8 bits), kind (8 bits), timestamp, epoch and
+// modified (64 bits each), then enc_msg, mac_tag, group_id and uid, each preceded by its size
+// (32 bits). The signed layout appends signature and serial_pk_key the same way. Integers are big-endian.
 
 class Message
 {
-    friend class boost::serialization::access;
+    template <std::size_t Extra>
+    friend std::string write_frame(const Message& msg, uint8_t version, const std::array<const std::string*, Extra>& extra);
+
     std::string enc_msg;
     std::string mac_tag;
-    std::string signature;
-    std::string serial_pk_key;
+    std::string group_id;       // Empty unless the message was fanned out to a group room
+    int kind = static_cast<int>(MessageKind::Data);
+    uint64_t timestamp = 0;     // Ping: sender's clock, in microseconds. Pong: echoed from the ping. SyncRequest: the sync mark.
+    uint64_t epoch = 0;         // Key exchange the message was encrypted under
+    std::string uid;            // Data: the message's ID in both histories
+    int64_t modified = 0;       // Data: when it was written (see LogRecord)
+
+public:
+    Message() {}
+
+    Message(std::string enc_msg, std::string mac_tag)
+        : enc_msg(std::move(enc_msg)), mac_tag(std::move(mac_tag))
+    {
+    }
+
+    const std::string& get_enc_msg() const
+    {
+        return enc_msg;
+    }
+
+    const std::string& get_mac_tag() const
+    {
+        return mac_tag;
+    }
+
+    const std::string& get_uid() const
+    {
+        return uid;
+    }
+
+    int64_t get_modified() const
+    {
+        return modified;
+    }
+
+    void set_sync_fields(std::string uid, int64_t modified)
+    {
+        this->uid = std::move(uid);
+        this->modified = modified;
+    }
+
+    const std::string& get_group_id() const
+    {
+        return group_id;
+    }
+
+    void set_group_id(std::string group_id)
+    {
+        this->group_id = std::move(group_id);
+    }
+
+    MessageKind get_kind() const
+    {
+        return static_cast<MessageKind>(kind);
+    }
+
+    uint64_t get_timestamp() const
+    {
+        return timestamp;
+    }
+
+    uint64_t get_epoch() const
+    {
+        return epoch;
+    }
+
+    void set_epoch(uint64_t epoch)
+    {
+        this->epoch = epoch;
+    }
+
+    // Turns this into a ping, pong, sync request or sync hint control frame
+    void set_control(MessageKind kind, uint64_t timestamp)
+    {
+        this->kind = static_cast<int>(kind);
+        this->timestamp = timestamp;
+    }
+
+    void set_kind(MessageKind kind)
+    {
+        this->kind = static_cast<int>(kind);
+    }
 
-    template <class Archive>
-    void serialize(Archive& archive, const unsigned int version)
+    void set_enc_msg(std::string enc_msg)
     {
-        archive & enc_msg;
-        archive & mac_tag;
-        archive & signature;
-        archive & serial_pk_key;
+        this->enc_msg = std::move(enc_msg);
     }
 
+    void set_mac_tag(std::string mac_tag)
+    {
+        this->mac_tag = std::move(mac_tag);
+    }
+
+    ~Message() {}
+};
+
+// A message of a non-deniable session: also signed with a fresh ECDSA key, sent along encrypted
+class SignedMessage : public Message
+{
+    std::string signature;      // Raw ECDSA signature
+    std::string serial_pk_key;  // Raw encrypted PKCS#8 signing key
+
 public:
-    Message() {}
-    
-    Message(const std::string& enc_msg, const std::string& mac_tag)
+    SignedMessage(Message msg, const std::vector<uint8_t>& signature, const std::vector<uint8_t>& serial_pk_key)
+        : Message(std::move(msg)), signature(signature.begin(), signature.end()), serial_pk_key(serial_pk_key.begin(), serial_pk_key.end())
+    {
+    }
+
+    friend std::string serialize_packet(const SignedMessage& msg);
+};
+
+// Writes the frame of a message followed by the extra fields of its layout, in place into a single allocation
+template <std::size_t Extra>
+std::string write_frame(const Message& msg, uint8_t version, const std::array<const std::string*, Extra>& extra)
+{
+    std::array<const std::string*, 4 + Extra> fields = {&msg.enc_msg, &msg.mac_tag, &msg.group_id, &msg.uid};
+    std::copy(extra.begin(), extra.end(), fields.begin() + 4);
+    std::size_t body_size = 2 + 3 * sizeof(uint64_t);
+    for (const std::string* field : fields)
+        body_size += sizeof(uint32_t) + field->size();
+
+    std::string frame(sizeof(uint32_t) + body_size, '\0');
+    char* out = frame.data();
+    auto put = [&out](auto value) {
+        boost::endian::native_to_big_inplace(value);
+        std::memcpy(out, &value, sizeof(value));
+        out += sizeof(value);
+    };
+
+    put(static_cast<uint32_t>(body_size));
+    put(version);
+    put(static_cast<uint8_t>(msg.kind));
+    put(msg.timestamp);
+    put(msg.epoch);
+    put(msg.modified);
+    for (const std::string* field : fields)
+    {
+        put(static_cast<uint32_t>(field->size()));
+        std::memcpy(out, field->data(), field->size());
+        out += field->size();
+    }
+    return frame;
+}
+
+// Serialize the message object into a frame
+std::string serialize_packet(const Message& msg)
+{
+    return write_frame<0>(msg, MESSAGE_WIRE_VERSION, {});
+}
+
+std::string serialize_packet(const SignedMessage& msg)
+{
+    return write_frame<2>(msg, MESSAGE_WIRE_VERSION | MESSAGE_WIRE_SIGNED, {&msg.signature, &msg.serial_pk_key});
+}
+
+// A received message, read in place from the buffer holding its frame body. Nothing is copied: the
+// accessors point into the buffer, which must outlive the view and stay unchanged while it is used.
+//
+// Packet is the type the session's mode sends (Message or SignedMessage), and fixes the layout each
+// kind of frame is parsed in: with SignedMessage, data and sync batch frames must be in the signed
+// layout; control frames and every frame of the other modes must be in the plain one.
+template <class Packet>
+class PacketView
+{
+    static constexpr bool signs = std::is_same_v<Packet, SignedMessage>;
+
+    struct Signature
     {
-        this->enc_msg = enc_msg;
-        this->mac_tag = mac_tag;
+        std::string_view signature;
+        std::string_view serial_pk_key;
+    };
+    struct NoSignature
+    {
+    };
+
+    std::string_view enc_msg;
+    std::string_view mac_tag;
+    std::string_view group_id;
+    std::string_view uid;
+    [[no_unique_address]] std::conditional_t<signs, Signature, NoSignature> sig;
+    MessageKind kind = MessageKind::Data;
+    uint64_t timestamp = 0;
+    uint64_t epoch = 0;
+    int64_t modified = 0;
+
+    template <class T>
+    static bool take(std::string_view& rest, T& value)
+    {
+        if (rest.size() < sizeof(value))
+            return false;
+        std::memcpy(&value, rest.data(), sizeof(value));
+        boost::endian::big_to_native_inplace(value);
+        rest.remove_prefix(sizeof(value));
+        return true;
     }
 
-    Message(const std::string& enc_msg, const std::string& mac_tag, const std::vector<uint8_t>& signature, const std::vector<uint8_t>& serial_pk_key)
+    static bool take_field(std::string_view& rest, std::string_view& field)
+    {
+        uint32_t size;
+        if (!take(rest, size) || rest.size() < size)
+            return false;
+        field = rest.substr(0, size);
+        rest.remove_prefix(size);
+        return true;
+    }
+
+    static std::span<const uint8_t> bytes(std::string_view field)
+    {
+        return {reinterpret_cast<const uint8_t*>(field.data()), field.size()};
+    }
+
+public:
+    // Parses a frame body (what follows the body size). Returns false if it is malformed or not in
+    // the layout of its kind.
+    bool parse(std::string_view body)
     {
-        this->enc_msg = enc_msg;
-        this->mac_tag = mac_tag;
-        this->signature = Botan::hex_encode(signature);
-        this->serial_pk_key = Botan::hex_encode(serial_pk_key);
+        uint8_t version, kind_value;
+        if (!take(body, version) || !take(body, kind_value) || kind_value > static_cast<uint8_t>(MessageKind::SyncHint))
+            return false;
+        kind = static_cast<MessageKind>(kind_value);
+        bool is_signed = signs && (kind == MessageKind::Data || kind == MessageKind::SyncBatch);
+        if (version != (is_signed ? MESSAGE_WIRE_VERSION | MESSAGE_WIRE_SIGNED : MESSAGE_WIRE_VERSION))
+            return false;
+        if (!(take(body, timestamp) && take(body, epoch) && take(body, modified) &&
+              take_field(body, enc_msg) && take_field(body, mac_tag) && take_field(body, group_id) && take_field(body, uid)))
+            return false;
+        if constexpr (signs)
+            if (is_signed && !(take_field(body, sig.signature) && take_field(body, sig.serial_pk_key)))
+                return false;
+        return body.empty();
     }
 
-    std::string get_enc_msg() const
+    std::string_view get_enc_msg() const
     {
         return enc_msg;
     }
 
-    std::string get_mac_tag() const
+    std::string_view get_mac_tag() const
     {
         return mac_tag;
     }
 
-    std::vector<uint8_t> get_signature() const
+    std::span<const uint8_t> get_signature() const requires signs
     {
-        std::cout<<signature<<std::endl;
-        return Botan::hex_decode(signature);
+        return bytes(sig.signature);
     }
 
-    std::vector<uint8_t> get_serial_pk_key() const
+    std::span<const uint8_t> get_serial_pk_key() const requires signs
     {
-        std::cout<<serial_pk_key<<std::endl;
-        return Botan::hex_decode(serial_pk_key);
+        return bytes(sig.serial_pk_key);
     }
 
-    void set_enc_msg(const std::string& enc_msg)
+    std::string_view get_group_id() const
     {
-        this->enc_msg = enc_msg;
+        return group_id;
     }
 
-    void set_mac_tag(const std::string& mac_tag)
+    std::string_view get_uid() const
     {
-        this->mac_tag = mac_tag;
+        return uid;
     }
 
-    ~Message() {}
-};
+    int64_t get_modified() const
+    {
+        return modified;
+    }
+
+    MessageKind get_kind() const
+    {
+        return kind;
+    }
 
-BOOST_CLASS_VERSION(Message, 1)
+    uint64_t get_timestamp() const
+    {
+        return timestamp;
+    }
+
+    uint64_t get_epoch() const
+    {
+        return epoch;
+    }
+};
 
 #endif
@@ -4,130 +4,119 @@
 #include <boost/asio.hpp>
 #include <iostream>
 #include <string>
-#include <sqlite3.h>
-
-std::atomic<bool> edit_enabled = false;
-
-std::atomic<bool> command_entered = false;
-
-void execute_sql(sqlite3* DB, const std::string& sql) {
-    char* errmsg;
-    int rc = sqlite3_exec(DB, sql.c_str(), 0, 0, &errmsg);
-    if (rc != SQLITE_OK) {
-        std::cerr << "SQL error: " << errmsg << std::endl;
-        sqlite3_free(errmsg);
-    }
-}
-
-int adjust_indexes(sqlite3* DB) {
-    std::string sql = "WITH RECURSIVE cnt(x) AS ( "
-                      "SELECT 1 UNION ALL SELECT x+1 FROM cnt LIMIT (SELECT COUNT(*) FROM people) "
-                      ") "
-                      "UPDATE people "
-                      "SET id = (SELECT x FROM cnt WHERE cnt.x = (SELECT COUNT(*) FROM people p2 WHERE p2.rowid <= people.rowid));";
-    sqlite3_stmt* stmt;
-    sqlite3_prepare_v2(DB, sql.c_str(), -1, &stmt, NULL);
-    int rc = sqlite3_step(stmt);
-    sqlite3_finalize(stmt);
-    return rc == SQLITE_DONE ? 0 : 1;
-}
-
-void displayMessageHistory(const std::string& dbname) {
-    sqlite3* DB;
-    sqlite3_open(dbname.c_str(), &DB);
-
-    std::string sql = "SELECT * FROM MSG_LOGS;";
-    sqlite3_stmt* stmt;
-    int rc = sqlite3_prepare_v2(DB, sql.c_str(), -1, &stmt, nullptr);
-
-    if (rc == SQLITE_OK) {
-        while (sqlite3_step(stmt) == SQLITE_ROW) {
-            int id = sqlite3_column_int(stmt, 0);
-            const unsigned char* person = sqlite3_column_text(stmt, 1);
-            const unsigned char* message = sqlite3_column_text(stmt, 2);
-            const unsigned char* timestamp = sqlite3_column_text(stmt, 3);
-
-            std::cout << id << " " << person << " " << message << " " << timestamp << "\n";
-        }
+#include <memory>
+#include <algorithm>
+#include <atomic>
+#include "logcache.hpp"
+#include "mode.hpp"
+
+std::atomic<bool> quit_requested = false;     // :q entered or the console closed: the sessions end, then main shuts down
+
+void displayMessageHistory(LogStore& store) {
+    try {
+        store.scan([](const LogRecord& record) {
+            std::cout << record.id << " ";
+            if (!record.group.empty())
+                std::cout << "[" << record.group << "] ";
+            std::cout << record.person << " " << record.message << " " << record.time;
+            if (record.status == DeliveryStatus::Queued)
+                std::cout << " (queued)";
+            std::cout << "\n";
+        });
         std::cout << "-----------------\n";
-    } else {
+    } catch (std::exception& e) {
         std::cerr << "Failed to retrieve data from the database.\n";
     }
-
-    sqlite3_finalize(stmt);
-    sqlite3_close(DB);
 }
 
-void edit_message(const std::string& dbname, std::size_t id) {
+void edit_message(LogStore& store, std::size_t id) {
     std::cout << "New Message: ";
     std::string newmsg;
     std::getline(std::cin, newmsg);
 
-    sqlite3* DB;
-    sqlite3_open(dbname.c_str(), &DB);
-
-    std::string sql = "UPDATE MSG_LOGS SET MESSAGE = '" + newmsg + "' WHERE ID = " + std::to_string(id) + ";";
-    execute_sql(DB, sql);
-
-    sqlite3_close(DB);
+    if (!store.edit(id, newmsg))
+        std::cerr << "No message with index " << id << "\n";
 }
 
-void delete_message(const std::string& dbname, std::size_t id) {
-    sqlite3* DB;
-    sqlite3_open(dbname.c_str(), &DB);
-
-    std::string sql = "DELETE FROM MSG_LOGS WHERE ID = " + std::to_string(id) + ";";
-    execute_sql(DB,sql);
-    adjust_indexes(DB);
-
-    sqlite3_close(DB);
+void delete_message(LogStore& store, std::size_t id) {
+    if (!store.remove(id))
+        std::cerr << "No message with index " << id << "\n";
 }
 
-bool executeCommands(std::string message, const std::string& dbname) {
+template <class Mode>
+bool executeCommands(std::string message, LogStore& store) {
     message.erase(std::remove_if(message.begin(), message.end(), ::isspace), message.end());
     if (message == ":v") 
     {
-        displayMessageHistory(dbname);
+        displayMessageHistory(store);
         return true;
     }
-    else if (edit_enabled && message == ":e") 
+    else if (Mode::editable && message == ":e") 
     {
-        displayMessageHistory(dbname);
+        displayMessageHistory(store);
         std::string id;
         std::cout << "Enter the index of the message you want to edit: ";
         std::getline(std::cin, id);
-        edit_message(dbname, std::stoi(id));
+        edit_message(store, std::stoi(id));
         std::cout << "Updated!\n";
         return true;
     }  
-    else if (edit_enabled && message == ":d")
+    else if (Mode::editable && message == ":d")
     {
-        displayMessageHistory(dbname);
+        displayMessageHistory(store);
         std::string id;
         std::cout << "Enter the index of the message you want to delete: ";
         std::getline(std::cin, id);
-        delete_message(dbname, std::stoi(id));
+        delete_message(store, std::stoi(id));
         std::cout << "Deleted!\n";
         return true;
     }
     else if (message == ":h") 
     {
         std::cout << ":v - View Message History\n";
-        if(edit_enabled)
+        if constexpr (Mode::editable)
         {
         std::cout << ":e - Edit Message\n";
         std::cout << ":d - Delete Message\n";
         }
+        std::cout << ":g <room> <message> - Write to a group room with the peer\n";
         std::cout << ":q - Quit\n";
         return true;
-    } else if (message == ":q")
-        exit(0);
+    } else if (message == ":q") {
+        quit_requested = true;
+        return true;
+    }
     return false;
 }
 
-void insert_message(sqlite3* DB, const std::string& person, const std::string& message, const std::string& timestamp) {
-    std::string sql = "INSERT INTO MSG_LOGS (PERSON, MESSAGE, TIME) VALUES ('" + person + "', '" + message + "', '" + timestamp + "');";
-    execute_sql(DB, sql);
+// A message written on this side, under a fresh uid
+LogRecord new_message(const std::string& person, const std::string& message, const std::string& timestamp, const std::string& group = "", DeliveryStatus status = DeliveryStatus::Sent) {
+    LogRecord record;
+    record.person = person;
+    record.message = message;
+    record.time = timestamp;
+    record.group = group;
+    record.status = status;
+    record.uid = new_message_uid();
+    record.modified = now_micros();
+    return record;
+}
+
+void insert_message(LogStore& store, const LogRecord& record) {
+    store.insert(record);
+}
+
+void insert_message(LogStore& store, const std::string& person, const std::string& message, const std::string& timestamp, const std::string& group = "", DeliveryStatus status = DeliveryStatus::Sent) {
+    store.insert(new_message(person, message, timestamp, group, status));
+}
+
+// A message received from the peer is merged, so that the sync does not log it a second time.
+// Peers without history sync send no uid; their messages are logged like before.
+void log_received(LogStore& store, const LogRecord& record) {
+    if (record.uid.empty())
+        store.insert(record);
+    else
+        store.merge({record});
 }
 
 #endif
@@ -0,0 +1,1021 @@
+#ifndef MMAPLOG_HPP
+#define MMAPLOG_HPP
+
+#include <boost/asio.hpp>
+#include <boost/filesystem.hpp>
+#include <boost/interprocess/file_mapping.hpp>
+#include <boost/interprocess/mapped_region.hpp>
+#include <boost/crc.hpp>
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <stdexcept>
+#include <unordered_map>
+#include <vector>
+#include "logstore.hpp"
+#include "executor.hpp"
+
+#define MMAP_SEGMENT_SIZE (4u << 20)            // Bytes preallocated per segment file
+#define MMAP_INDEX_STRIDE 64                    // One sparse index entry per this many inserted messages
+#define MMAP_COMPACT_MIN_BYTES (1u << 20)       // Garbage left by edits/deletes before compaction is considered
+#define MMAP_FLUSH_RECORDS 64                   // Appended records flushed to disk together by the writer
+#define MMAP_FLUSH_INTERVAL std::chrono::milliseconds(200)  // Longest an appended record waits for its flush
+
+namespace bip = boost::interprocess;
+
+enum MmapRecordType : uint8_t
+{
+    MMAP_INSERT = 1,    // A new message
+    MMAP_EDIT = 2,      // Full replacement of an earlier message, superseding it
+    MMAP_DELETE = 3,    // Tombstone for an earlier message
+    MMAP_STATUS = 4,    // New delivery status of an earlier message, no payload
+    MMAP_PRUNE = 5      // An earlier message or tombstone dropped by retention, forgotten without a trace
+};
+
+#define MMAP_FLAG_SYNC 0x01     // An MmapSyncFields block follows the header, and the uid follows the group
+
+// On-disk record header, followed by the person, message, time and group bytes and padded to 8 bytes.
+// A record counts only once its size is non-zero and the CRC matches, and size is stored last,
+// so a write torn by a crash is dropped on the next open.
+struct MmapRecordHeader
+{
+    uint32_t size;
+    uint32_t crc;           // CRC-32 over everything after this field
+    uint64_t id;
+    uint32_t person_len;
+    uint32_t message_len;
+    uint32_t time_len;
+    uint8_t type;
+    uint8_t group_len;      // Zero for one-to-one messages
+    uint8_t status;         // DeliveryStatus, for inserts, edits and status records
+    uint8_t flags;          // Zero in logs written before history sync existed
+};
+static_assert(sizeof(MmapRecordHeader) == 32, "MmapRecordHeader must stay packed");
+
+// History sync fields of an insert, edit or delete record (see LogRecord)
+struct MmapSyncFields
+{
+    uint64_t change;
+    int64_t modified;
+    uint32_t uid_len;
+    uint32_t reserved;
+};
+static_assert(sizeof(MmapSyncFields) == 24, "MmapSyncFields must stay packed");
+
+struct MmapSegment
+{
+    boost::filesystem::path path;
+    bip::file_mapping file;
+    bip::mapped_region region;
+    std::size_t used = 0;
+
+    char* data() { return static_cast<char*>(region.get_address()); }
+    std::size_t capacity() const { return region.get_size(); }
+};
+
+class MmapLogStore;
+
+// Flushes what the writers of the open mmap logs have appended but not flushed yet, so the last records
+// before the traffic stops reach the disk too: while any log is open, a timer on the executor starts a
+// pass on the blocking pool every MMAP_FLUSH_INTERVAL. The lock is only held to pick the next store, so
+// opening and closing logs never waits for the disk, except to close the store being flushed.
+class MmapFlusher
+{
+    std::mutex mtx;
+    std::mutex pass_mtx;                // One pass at a time, the last one at exit included
+    std::condition_variable flushed;
+    std::set<MmapLogStore*> stores;
+    MmapLogStore* flushing = nullptr;   // Store the current pass is flushing
+    boost::asio::steady_timer timer;
+    bool armed = false;
+    bool stopped = false;
+
+    // Called with the lock held
+    void schedule()
+    {
+        if (armed || stopped || stores.empty())
+            return;
+        armed = true;
+        boost::asio::post(timer.get_executor(), [this]() {
+            timer.expires_after(MMAP_FLUSH_INTERVAL);
+            timer.async_wait([this](const boost::system::error_code& error) {
+                if (error)
+                    return;
+                executor.blocking().post([this]() {
+                    flush_all();
+                    std::lock_guard<std::mutex> lock(mtx);
+                    armed = false;
+                    schedule();
+                });
+            });
+        });
+    }
+
+    void flush_all();
+
+public:
+    MmapFlusher() : timer(executor.io()) {}
+
+    void add(MmapLogStore* store)
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        stores.insert(store);
+        schedule();
+    }
+
+    void remove(MmapLogStore* store)
+    {
+        std::unique_lock<std::mutex> lock(mtx);
+        stores.erase(store);
+        flushed.wait(lock, [&]() { return flushing != store; });
+    }
+
+    // At exit, before the executor shuts down: no pass starts after this one
+    void stop()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            stopped = true;
+        }
+        boost::asio::post(timer.get_executor(), [this]() { timer.cancel(); });
+        flush_all();
+    }
+};
+
+// Never destroyed, so that stores closed during static destruction can still leave it
+MmapFlusher& mmap_flusher()
+{
+    static MmapFlusher* flusher = new MmapFlusher;
+    return *flusher;
+}
+
+// Append-only message log split into memory-mapped segment files under <dbname>.log/.
+// Edits and deletes append new records instead of rewriting old ones; once they leave enough
+// garbage behind, the live messages are rewritten into fresh segments. Deletes of messages with
+// a uid are kept through compaction as tombstones so that they can be synced; the sync mark lives
+// next to the log in <dbname>.log.sync. Messages dropped by retention leave no tombstone, so the
+// change sequence they may have held is saved in <dbname>.log.change.
+//
+// Appends are flushed in groups: by the writer once MMAP_FLUSH_RECORDS are waiting, and otherwise by
+// the flusher within MMAP_FLUSH_INTERVAL. A crash of the process loses nothing, since the
+// mapped pages belong to the kernel; a power loss can lose the last interval, as with SQLite's
+// synchronous=NORMAL.
+class MmapLogStore : public LogStore
+{
+    struct Location
+    {
+        std::size_t segment;
+        std::size_t offset;
+    };
+
+    struct SyncState
+    {
+        std::string uid;
+        uint64_t change = 0;
+        int64_t modified = 0;
+    };
+
+    boost::filesystem::path dir;
+    boost::filesystem::path write_dir;      // Differs from dir only while compacting
+    std::vector<std::unique_ptr<MmapSegment>> segments;
+    std::map<uint64_t, Location> sparse_index;          // Every MMAP_INDEX_STRIDE-th insert
+    std::unordered_map<uint64_t, Location> patched;     // Latest edit of a message, if any
+    std::set<uint64_t> dead;
+    std::set<uint64_t> queued;                          // The outbox
+    std::unordered_map<uint64_t, SyncState> synced;     // Messages with a uid, tombstones included
+    std::unordered_map<std::string, uint64_t> by_uid;
+    std::map<uint64_t, uint64_t> by_change;             // Latest local change of each message, to its ID
+    uint64_t last_change = 0;
+    uint64_t saved_change = 0;      // From <dbname>.log.change
+    uint64_t mark = 0;
+    uint64_t next_id = 1;
+    uint64_t inserts = 0;
+    std::size_t total_bytes = 0;
+    std::size_t garbage_bytes = 0;
+    std::size_t unflushed = 0;      // Records appended since the last flush, from flush_from on
+    Location flush_from{0, 0};
+    std::mutex mtx;
+
+    static std::size_t align8(std::size_t n) { return (n + 7) & ~std::size_t(7); }
+
+    static uint32_t record_crc(const char* record, std::size_t size)
+    {
+        boost::crc_32_type crc;
+        crc.process_bytes(record + 2 * sizeof(uint32_t), size - 2 * sizeof(uint32_t));
+        return crc.checksum();
+    }
+
+    void add_segment()
+    {
+        char name[32];
+        std::snprintf(name, sizeof(name), "%08zu.seg", segments.size());
+        boost::filesystem::path path = write_dir / name;
+
+        std::ofstream(path.string(), std::ios::binary).close();
+        boost::filesystem::resize_file(path, MMAP_SEGMENT_SIZE);   // Zero-filled
+        map_segment(path);
+    }
+
+    MmapSegment& map_segment(const boost::filesystem::path& path)
+    {
+        auto segment = std::make_unique<MmapSegment>();
+        segment->path = path;
+        segment->file = bip::file_mapping(path.string().c_str(), bip::read_write);
+        segment->region = bip::mapped_region(segment->file, bip::read_write);
+        segments.push_back(std::move(segment));
+        return *segments.back();
+    }
+
+    // Reads the header at loc, stepping over the end of a segment into the next one
+    bool header_at(Location& loc, MmapRecordHeader& header)
+    {
+        while (loc.segment < segments.size() && loc.offset >= segments[loc.segment]->used)
+            loc = {loc.segment + 1, 0};
+        if (loc.segment >= segments.size())
+            return false;
+        std::memcpy(&header, segments[loc.segment]->data() + loc.offset, sizeof(header));
+        return true;
+    }
+
+    // Start of the person bytes of the record at loc; fields are zero for records without them
+    const char* payload_at(Location loc, const MmapRecordHeader& header, MmapSyncFields& fields)
+    {
+        const char* p = segments[loc.segment]->data() + loc.offset + sizeof(header);
+        fields = {};
+        if (header.flags & MMAP_FLAG_SYNC)
+        {
+            std::memcpy(&fields, p, sizeof(fields));
+            p += sizeof(fields);
+        }
+        return p;
+    }
+
+    static std::string uid_of(const char* payload, const MmapRecordHeader& header, const MmapSyncFields& fields)
+    {
+        std::size_t offset = std::size_t(header.person_len) + header.message_len + header.time_len + header.group_len;
+        return std::string(payload + offset, fields.uid_len);
+    }
+
+    LogRecord read_record(Location loc)
+    {
+        MmapRecordHeader header;
+        header_at(loc, header);
+        MmapSyncFields fields;
+        const char* p = payload_at(loc, header, fields);
+
+        LogRecord record;
+        record.id = header.id;
+        record.person.assign(p, header.person_len);
+        record.message.assign(p + header.person_len, header.message_len);
+        record.time.assign(p + header.person_len + header.message_len, header.time_len);
+        record.group.assign(p + header.person_len + header.message_len + header.time_len, header.group_len);
+        record.status = queued.count(header.id) ? DeliveryStatus::Queued : DeliveryStatus::Sent;
+        record.uid = uid_of(p, header, fields);
+        record.change = fields.change;
+        record.modified = fields.modified;
+        return record;
+    }
+
+    // Records the sync state of a message whose insert, edit or delete was just appended or replayed
+    void track(uint64_t id, const std::string& uid, uint64_t change, int64_t modified)
+    {
+        last_change = std::max(last_change, change);
+        if (uid.empty())
+            return;
+        SyncState& state = synced[id];
+        if (state.change)
+            by_change.erase(state.change);
+        state = {uid, change, modified};
+        by_uid[uid] = id;
+        if (change)
+            by_change[change] = id;
+    }
+
+    // Drops the sync state of a message. Returns the size of its tombstone if it had one, which then
+    // becomes garbage; the tombstone's location is not kept, so this is its size without a group.
+    std::size_t forget_sync(uint64_t id)
+    {
+        auto state = synced.find(id);
+        if (state == synced.end())
+            return 0;
+        std::size_t tombstone = dead.count(id) ? align8(sizeof(MmapRecordHeader) + sizeof(MmapSyncFields) + state->second.uid.size()) : 0;
+        if (state->second.change)
+            by_change.erase(state->second.change);
+        by_uid.erase(state->second.uid);
+        synced.erase(state);
+        return tombstone;
+    }
+
+    std::size_t record_size(Location loc)
+    {
+        MmapRecordHeader header;
+        header_at(loc, header);
+        return header.size;
+    }
+
+    // Finds the live version of a message: the latest edit, or else the insert reached by walking
+    // forward from the closest sparse index entry
+    std::optional<Location> locate(uint64_t id)
+    {
+        if (id >= next_id || dead.count(id))
+            return std::nullopt;
+        auto edit = patched.find(id);
+        if (edit != patched.end())
+            return edit->second;
+
+        auto it = sparse_index.upper_bound(id);
+        if (it == sparse_index.begin())
+            return std::nullopt;
+        Location loc = std::prev(it)->second;
+
+        MmapRecordHeader header;
+        while (header_at(loc, header))
+        {
+            if (header.type == MMAP_INSERT)
+            {
+                if (header.id == id)
+                    return loc;
+                if (header.id > id)
+                    break;
+            }
+            loc.offset += header.size;
+        }
+        return std::nullopt;
+    }
+
+    // Writes a record to the mapped segment; it reaches the disk with the next flush
+    Location append(MmapRecordType type, const LogRecord& fields)
+    {
+        const std::string& person = fields.person;
+        const std::string& message = fields.message;
+        const std::string& time = fields.time;
+        const std::string& group = fields.group;
+        const std::string& uid = fields.uid;
+        std::size_t size = align8(sizeof(MmapRecordHeader) + sizeof(MmapSyncFields) + person.size() + message.size() + time.size() + group.size() + uid.size());
+        if (size > MMAP_SEGMENT_SIZE)
+            throw std::runtime_error("Message too large for the log segment");
+        if (group.size() > UINT8_MAX)
+            throw std::runtime_error("Group ID too long for the log");
+        if (segments.empty() || segments.back()->used + size > segments.back()->capacity())
+            add_segment();
+
+        MmapSegment& segment = *segments.back();
+        char* record = segment.data() + segment.used;
+
+        MmapRecordHeader header{};
+        header.id = fields.id;
+        header.person_len = person.size();
+        header.message_len = message.size();
+        header.time_len = time.size();
+        header.type = type;
+        header.group_len = group.size();
+        header.status = static_cast<uint8_t>(fields.status);
+        header.flags = MMAP_FLAG_SYNC;
+        std::memcpy(record, &header, sizeof(header));
+
+        MmapSyncFields sync_fields{};
+        sync_fields.change = fields.change;
+        sync_fields.modified = fields.modified;
+        sync_fields.uid_len = uid.size();
+        std::memcpy(record + sizeof(header), &sync_fields, sizeof(sync_fields));
+
+        char* p = record + sizeof(header) + sizeof(sync_fields);
+        std::memcpy(p, person.data(), person.size());
+        std::memcpy(p + person.size(), message.data(), message.size());
+        std::memcpy(p + person.size() + message.size(), time.data(), time.size());
+        std::memcpy(p + person.size() + message.size() + time.size(), group.data(), group.size());
+        std::memcpy(p + person.size() + message.size() + time.size() + group.size(), uid.data(), uid.size());
+
+        // Commit the record by publishing its size last
+        header.size = size;
+        header.crc = record_crc(record, size);
+        std::memcpy(record + sizeof(uint32_t), &header.crc, sizeof(header.crc));
+        std::memcpy(record, &header.size, sizeof(header.size));
+
+        Location loc{segments.size() - 1, segment.used};
+        if (unflushed++ == 0)
+            flush_from = loc;
+        segment.used += size;
+        total_bytes += size;
+        return loc;
+    }
+
+    // Writes the records appended since the last flush through to disk
+    void flush_locked()
+    {
+        if (unflushed == 0)
+            return;
+        for (std::size_t i = flush_from.segment; i < segments.size(); i++)
+        {
+            std::size_t start = i == flush_from.segment ? flush_from.offset : 0;
+            if (segments[i]->used > start)
+                segments[i]->region.flush(start, segments[i]->used - start, false);
+        }
+        unflushed = 0;
+    }
+
+    // Group commit: the writer only pays for a flush once every MMAP_FLUSH_RECORDS records
+    void commit_locked()
+    {
+        if (unflushed >= MMAP_FLUSH_RECORDS)
+            flush_locked();
+    }
+
+    // Updates the in-memory indexes for a record that is on disk at loc
+    void apply(const MmapRecordHeader& header, Location loc)
+    {
+        total_bytes += header.size;
+        if (header.type == MMAP_STATUS)
+        {
+            garbage_bytes += header.size;   // Folded into the insert by the next compaction
+            set_queued(header.id, static_cast<DeliveryStatus>(header.status));
+            return;
+        }
+
+        MmapSyncFields fields;
+        std::string uid = uid_of(payload_at(loc, header, fields), header, fields);
+        if (header.type == MMAP_INSERT)
+        {
+            if (inserts++ % MMAP_INDEX_STRIDE == 0)
+                sparse_index[header.id] = loc;
+            next_id = std::max<uint64_t>(next_id, header.id + 1);
+            if (header.status == static_cast<uint8_t>(DeliveryStatus::Queued))
+                queued.insert(header.id);
+            track(header.id, uid, fields.change, fields.modified);
+            return;
+        }
+
+        auto old = locate(header.id);
+        if (old)
+            garbage_bytes += record_size(*old);
+        next_id = std::max<uint64_t>(next_id, header.id + 1);
+
+        if (header.type == MMAP_PRUNE)
+        {
+            garbage_bytes += header.size + forget_sync(header.id);
+            patched.erase(header.id);
+            dead.insert(header.id);
+            queued.erase(header.id);
+            return;
+        }
+        if (header.type == MMAP_EDIT)
+        {
+            patched[header.id] = loc;
+        } else {
+            if (uid.empty())
+                garbage_bytes += header.size;   // A tombstone with a uid is kept by compaction
+            patched.erase(header.id);
+            dead.insert(header.id);
+            queued.erase(header.id);
+        }
+        track(header.id, uid, fields.change, fields.modified);
+    }
+
+    // Appends the delete record of a live message
+    void delete_locked(uint64_t id, Location old, uint64_t change, int64_t modified)
+    {
+        LogRecord tombstone;
+        tombstone.id = id;
+        auto state = synced.find(id);
+        if (state != synced.end())
+            tombstone.uid = state->second.uid;
+        tombstone.change = change;
+        tombstone.modified = modified;
+
+        garbage_bytes += record_size(old);
+        Location loc = append(MMAP_DELETE, tombstone);
+        if (tombstone.uid.empty())
+            garbage_bytes += record_size(loc);
+        patched.erase(id);
+        dead.insert(id);
+        queued.erase(id);
+        track(id, tombstone.uid, change, modified);
+    }
+
+    // Appends a message that is new to this log
+    void insert_locked(LogRecord record)
+    {
+        record.id = next_id++;
+        if (record.deleted)
+        {
+            // The peer deleted it before this side ever saw it: only the tombstone is needed
+            record.message.clear();
+            append(MMAP_DELETE, record);
+            dead.insert(record.id);
+        } else {
+            Location loc = append(MMAP_INSERT, record);
+            if (inserts++ % MMAP_INDEX_STRIDE == 0)
+                sparse_index[record.id] = loc;
+            if (record.status == DeliveryStatus::Queued)
+                queued.insert(record.id);
+        }
+        track(record.id, record.uid, record.change, record.modified);
+    }
+
+    // Appends the prune record of a message or tombstone
+    void prune_locked(uint64_t id)
+    {
+        auto old = locate(id);
+        if (old)
+            garbage_bytes += record_size(*old);
+        garbage_bytes += forget_sync(id);
+
+        LogRecord record;
+        record.id = id;
+        Location loc = append(MMAP_PRUNE, record);
+        garbage_bytes += record_size(loc);
+        patched.erase(id);
+        dead.insert(id);
+        queued.erase(id);
+    }
+
+    // Written aside and renamed over the old file, like the sync mark
+    void save_change()
+    {
+        if (last_change == saved_change)
+            return;
+        std::string path = dir.string() + ".change";
+        {
+            std::ofstream file(path + ".tmp", std::ios::trunc);
+            file << last_change;
+        }
+        boost::filesystem::rename(path + ".tmp", path);
+        saved_change = last_change;
+    }
+
+    void set_queued(uint64_t id, DeliveryStatus status)
+    {
+        if (status == DeliveryStatus::Queued && !dead.count(id) && id < next_id)
+            queued.insert(id);
+        else
+            queued.erase(id);
+    }
+
+    // Scans a freshly mapped segment, stopping at the first record that is missing or torn
+    void replay(std::size_t index, bool last)
+    {
+        MmapSegment& segment = *segments[index];
+        std::size_t offset = 0;
+        while (offset + sizeof(MmapRecordHeader) <= segment.capacity())
+        {
+            MmapRecordHeader header;
+            std::memcpy(&header, segment.data() + offset, sizeof(header));
+            if (header.size < sizeof(header) || header.size % 8 != 0 || offset + header.size > segment.capacity()
+                || record_crc(segment.data() + offset, header.size) != header.crc)
+                break;
+
+            std::size_t payload = std::size_t(header.person_len) + header.message_len + header.time_len + header.group_len;
+            if (header.flags & MMAP_FLAG_SYNC)
+            {
+                MmapSyncFields fields;
+                if (sizeof(header) + sizeof(fields) > header.size)
+                    break;
+                std::memcpy(&fields, segment.data() + offset + sizeof(header), sizeof(fields));
+                payload += sizeof(fields) + fields.uid_len;
+            }
+            if (sizeof(header) + payload > header.size)
+                break;
+
+            segment.used = offset + header.size;
+            apply(header, {index, offset});
+            offset += header.size;
+        }
+
+        // Wipe whatever a crash left behind the tail so that later appends start from zeroes
+        if (last && segment.used < segment.capacity())
+        {
+            std::memset(segment.data() + segment.used, 0, segment.capacity() - segment.used);
+            segment.region.flush(segment.used, segment.capacity() - segment.used, false);
+        }
+    }
+
+    void reset()
+    {
+        segments.clear();
+        sparse_index.clear();
+        patched.clear();
+        dead.clear();
+        queued.clear();
+        synced.clear();
+        by_uid.clear();
+        by_change.clear();
+        last_change = 0;
+        next_id = 1;
+        inserts = 0;
+        total_bytes = 0;
+        garbage_bytes = 0;
+        unflushed = 0;
+    }
+
+    void load()
+    {
+        reset();
+        write_dir = dir;
+
+        std::vector<boost::filesystem::path> files;
+        for (auto& entry : boost::filesystem::directory_iterator(dir))
+            if (entry.path().extension() == ".seg")
+                files.push_back(entry.path());
+        std::sort(files.begin(), files.end());
+
+        for (std::size_t i = 0; i < files.size(); i++)
+        {
+            map_segment(files[i]);
+            replay(i, i + 1 == files.size());
+        }
+        if (segments.empty())
+            add_segment();
+        last_change = std::max(last_change, saved_change);
+    }
+
+    // Finishes or rolls back a compaction that was interrupted by a crash
+    void recover_compaction()
+    {
+        boost::filesystem::path old_dir = dir.string() + ".old";
+        boost::filesystem::path new_dir = dir.string() + ".compact";
+        if (!boost::filesystem::exists(dir) && boost::filesystem::exists(old_dir))
+            boost::filesystem::rename(boost::filesystem::exists(new_dir) ? new_dir : old_dir, dir);
+        boost::filesystem::remove_all(new_dir);
+        boost::filesystem::remove_all(old_dir);
+    }
+
+    // Rewrites the live messages into <dir>.compact and swaps it in. The records are appended unflushed
+    // and the new directory is synced once before the swap; recover_compaction() completes the swap
+    // after a crash.
+    void compact()
+    {
+        std::vector<LogRecord> live;
+        scan_locked([&](const LogRecord& record) { live.push_back(record); });
+        std::vector<LogRecord> tombstones;
+        for (uint64_t id : dead)
+        {
+            auto state = synced.find(id);
+            if (state == synced.end())
+                continue;
+            LogRecord tombstone;
+            tombstone.id = id;
+            tombstone.uid = state->second.uid;
+            tombstone.change = state->second.change;
+            tombstone.modified = state->second.modified;
+            tombstones.push_back(tombstone);
+        }
+        uint64_t last_id = next_id - 1;
+
+        boost::filesystem::path old_dir = dir.string() + ".old";
+        boost::filesystem::path new_dir = dir.string() + ".compact";
+        boost::filesystem::remove_all(new_dir);
+        boost::filesystem::create_directories(new_dir);
+
+        reset();
+        write_dir = new_dir;
+        for (auto& record : live)
+            append(MMAP_INSERT, record);
+        for (auto& tombstone : tombstones)
+            append(MMAP_DELETE, tombstone);
+        if (last_id && (live.empty() || live.back().id != last_id))
+        {
+            LogRecord last;
+            last.id = last_id;
+            append(MMAP_DELETE, last);      // Keeps IDs from being reused after the swap
+        }
+        flush_locked();
+        segments.clear();
+
+        boost::filesystem::rename(dir, old_dir);
+        boost::filesystem::rename(new_dir, dir);
+        boost::filesystem::remove_all(old_dir);
+        load();
+    }
+
+    void maybe_compact()
+    {
+        if (garbage_bytes >= MMAP_COMPACT_MIN_BYTES && 2 * garbage_bytes >= total_bytes)
+            compact();
+    }
+
+    void scan_locked(const std::function<void(const LogRecord&)>& visit)
+    {
+        Location loc{0, 0};
+        MmapRecordHeader header;
+        while (header_at(loc, header))
+        {
+            if (header.type == MMAP_INSERT && !dead.count(header.id))
+            {
+                auto edit = patched.find(header.id);
+                visit(read_record(edit != patched.end() ? edit->second : loc));
+            }
+            loc.offset += header.size;
+        }
+    }
+
+public:
+    explicit MmapLogStore(const std::string& path) : dir(path)
+    {
+        recover_compaction();
+        boost::filesystem::create_directories(dir);
+        std::ifstream(dir.string() + ".change") >> saved_change;
+        load();
+        std::ifstream(dir.string() + ".sync") >> mark;
+        mmap_flusher().add(this);
+    }
+
+    MmapLogStore(const MmapLogStore&) = delete;
+    MmapLogStore& operator=(const MmapLogStore&) = delete;
+
+    ~MmapLogStore()
+    {
+        mmap_flusher().remove(this);
+        flush_locked();
+    }
+
+    // Called by the flusher
+    void flush()
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        flush_locked();
+    }
+
+    void insert(const LogRecord& record) override
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        if (!record.uid.empty() && by_uid.count(record.uid))
+            return;
+        LogRecord local = record;
+        local.change = ++last_change;
+        local.deleted = false;
+        insert_locked(local);
+        commit_locked();
+    }
+
+    bool edit(std::size_t id, const std::string& message) override
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        auto old = locate(id);
+        if (!old)
+            return false;
+
+        LogRecord record = read_record(*old);
+        garbage_bytes += record_size(*old);
+        record.message = message;
+        record.change = ++last_change;
+        record.modified = now_micros();
+        patched[id] = append(MMAP_EDIT, record);
+        track(id, record.uid, record.change, record.modified);
+        commit_locked();
+        maybe_compact();
+        return true;
+    }
+
+    bool remove(std::size_t id) override
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        auto old = locate(id);
+        if (!old)
+            return false;
+
+        delete_locked(id, *old, ++last_change, now_micros());
+        commit_locked();
+        maybe_compact();
+        return true;
+    }
+
+    std::optional<LogRecord> find(std::size_t id) override
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        auto loc = locate(id);
+        if (!loc)
+            return std::nullopt;
+        return read_record(*loc);
+    }
+
+    void scan(const std::function<void(const LogRecord&)>& visit) override
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        scan_locked(visit);
+    }
+
+    void scan_queued(const std::function<void(const LogRecord&)>& visit) override
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        for (uint64_t id : queued)
+        {
+            auto loc = locate(id);
+            if (loc)
+                visit(read_record(*loc));
+        }
+    }
+
+    // Appends one status record per message and flushes them together at the end
+    void set_status(const std::vector<std::size_t>& ids, DeliveryStatus status) override
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        bool appended = false;
+        for (std::size_t id : ids)
+        {
+            if (!locate(id))
+                continue;
+            LogRecord record;
+            record.id = id;
+            record.status = status;
+            Location loc = append(MMAP_STATUS, record);
+            garbage_bytes += record_size(loc);
+            set_queued(id, status);
+            appended = true;
+        }
+        if (!appended)
+            return;
+
+        flush_locked();
+        maybe_compact();
+    }
+
+    void changes_since(uint64_t change, const std::function<void(const LogRecord&)>& visit) override
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        for (auto it = by_change.upper_bound(change); it != by_change.end(); ++it)
+        {
+            uint64_t id = it->second;
+            if (dead.count(id))
+            {
+                const SyncState& state = synced[id];
+                LogRecord tombstone;
+                tombstone.id = id;
+                tombstone.uid = state.uid;
+                tombstone.change = state.change;
+                tombstone.modified = state.modified;
+                tombstone.deleted = true;
+                visit(tombstone);
+                continue;
+            }
+            auto loc = locate(id);
+            if (loc)
+                visit(read_record(*loc));
+        }
+    }
+
+    // Appends the whole batch unsynced and flushes it once, like set_status. A message keeps its
+    // change sequence when the peer's change wins, so the sequence never goes back.
+    void merge(const std::vector<LogRecord>& remote) override
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        bool appended = false;
+        for (const LogRecord& change : remote)
+        {
+            if (change.uid.empty())
+                continue;
+
+            auto known = by_uid.find(change.uid);
+            if (known == by_uid.end())
+            {
+                LogRecord record = change;
+                record.change = 0;
+                record.status = DeliveryStatus::Sent;
+                insert_locked(record);
+                appended = true;
+                continue;
+            }
+
+            uint64_t id = known->second;
+            const SyncState& state = synced[id];
+            LogRecord local;
+            local.modified = state.modified;
+            local.deleted = dead.count(id) > 0;
+            if (!remote_wins(local, change))
+                continue;
+            auto old = locate(id);
+            if (!old)
+                continue;
+
+            uint64_t kept = state.change;
+            if (change.deleted)
+            {
+                delete_locked(id, *old, kept, change.modified);
+            } else {
+                LogRecord record = read_record(*old);
+                garbage_bytes += record_size(*old);
+                record.message = change.message;
+                record.change = kept;
+                record.modified = change.modified;
+                patched[id] = append(MMAP_EDIT, record);
+                track(id, record.uid, kept, change.modified);
+            }
+            appended = true;
+        }
+        if (!appended)
+            return;
+
+        flush_locked();
+        maybe_compact();
+    }
+
+    uint64_t sync_mark() override
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        return mark;
+    }
+
+    // Written aside and renamed over the old mark, so a crash leaves either one
+    void set_sync_mark(uint64_t change) override
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        std::string path = dir.string() + ".sync";
+        {
+            std::ofstream file(path + ".tmp", std::ios::trunc);
+            file << change;
+        }
+        boost::filesystem::rename(path + ".tmp", path);
+        mark = change;
+    }
+
+    // Collects the messages and tombstones in one scan of the mapped segments, drops the expired ones
+    // RETENTION_BATCH per lock with one flush each, and leaves it to compaction to give the space back
+    MaintenanceReport maintain(const RetentionPolicy& policy) override
+    {
+        MaintenanceReport report;
+        std::size_t before;
+        std::vector<RetentionEntry> entries;
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            before = segments.size() * MMAP_SEGMENT_SIZE;
+            if (policy.enabled())
+            {
+                scan_locked([&](const LogRecord& record) {
+                    std::size_t bytes = record.person.size() + record.message.size() + record.time.size() + record.group.size() + record.uid.size();
+                    entries.push_back({record.id, record.modified, bytes, record.status == DeliveryStatus::Queued});
+                });
+                for (uint64_t id : dead)
+                {
+                    auto state = synced.find(id);
+                    if (state != synced.end())
+                        entries.push_back({id, state->second.modified, state->second.uid.size(), false});
+                }
+                std::sort(entries.begin(), entries.end(), [](const RetentionEntry& a, const RetentionEntry& b) { return a.id < b.id; });
+            }
+        }
+
+        std::vector<std::size_t> expired = select_expired(entries, policy, now_micros());
+        for (std::size_t first = 0; first < expired.size(); first += RETENTION_BATCH)
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            save_change();
+            for (std::size_t i = first; i < std::min(expired.size(), first + RETENTION_BATCH); i++)
+            {
+                uint64_t id = expired[i];
+                if (queued.count(id) || (dead.count(id) && !synced.count(id)))
+                    continue;       // Queued or already gone in the meantime
+                prune_locked(id);
+                report.removed++;
+            }
+            flush_locked();
+        }
+
+        std::size_t next = 0;
+        for (const RetentionEntry& entry : entries)
+            if (next < expired.size() && entry.id == expired[next])
+            {
+                report.removed_bytes += entry.bytes;
+                next++;
+            }
+
+        std::lock_guard<std::mutex> lock(mtx);
+        maybe_compact();
+        std::size_t after = segments.size() * MMAP_SEGMENT_SIZE;
+        report.reclaimed_bytes = before > after ? before - after : 0;
+        return report;
+    }
+};
+
+void MmapFlusher::flush_all()
+{
+    std::lock_guard<std::mutex> pass_lock(pass_mtx);
+    std::vector<MmapLogStore*> pass;
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        pass.assign(stores.begin(), stores.end());
+    }
+    for (MmapLogStore* store : pass)
+    {
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            if (!stores.count(store))
+                continue;       // Closed since the pass started
+            flushing = store;
+        }
+        store->flush();
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            flushing = nullptr;
+        }
+        flushed.notify_all();
+    }
+}
+
+#endif
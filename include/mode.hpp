@@ -0,0 +1,63 @@
+#ifndef MODE_HPP
+#define MODE_HPP
+
+#include <atomic>
+#include <type_traits>
+#include "message.hpp"
+
+enum class SecurityMode
+{
+    Deniable,
+    UltraDeniable,
+    NonDeniable
+};
+
+// Mode of the sessions started from now on, chosen at startup (setup_mode)
+std::atomic<SecurityMode> security_mode = SecurityMode::Deniable;
+
+// Mode policies. A session's send and receive pipelines are instantiated for one of them, so they
+// carry no mode checks and a process can run sessions in different modes side by side.
+
+// Deniability from the 3DH key exchange; messages are encrypted and MAC'd
+struct DeniableMode
+{
+    static constexpr SecurityMode mode = SecurityMode::Deniable;
+    static constexpr bool editable = false;
+    using Packet = Message;
+};
+
+// Also lets both sides edit (:e) and delete (:d) the history, which the peer syncs
+struct UltraDeniableMode
+{
+    static constexpr SecurityMode mode = SecurityMode::UltraDeniable;
+    static constexpr bool editable = true;
+    using Packet = Message;
+};
+
+// Messages are also signed (ECDSA), in the signed packet layout
+struct NonDeniableMode
+{
+    static constexpr SecurityMode mode = SecurityMode::NonDeniable;
+    static constexpr bool editable = false;
+    using Packet = SignedMessage;
+};
+
+template <class Mode>
+constexpr bool signs_packets = std::is_same_v<typename Mode::Packet, SignedMessage>;
+
+// Calls f with the policy of the given mode: the only run-time look at a session's mode
+template <class F>
+decltype(auto) with_mode(SecurityMode mode, F&& f)
+{
+    switch (mode)
+    {
+    case SecurityMode::UltraDeniable:
+        return f(UltraDeniableMode{});
+    case SecurityMode::NonDeniable:
+        return f(NonDeniableMode{});
+    default:
+        return f(DeniableMode{});
+    }
+}
+
+#endif
@@ -0,0 +1,70 @@
+#ifndef PACKET_HPP
+#define PACKET_HPP
+
+#include <botan/ecdsa.h>
+#include <botan/pkcs8.h>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include "crypt.hpp"
+#include "message.hpp"
+#include "keyring.hpp"
+#include "mode.hpp"
+
+// Encrypts, MACs and (in non-deniable mode) signs a payload under the given key
+template <class Mode>
+typename Mode::Packet seal_packet(const std::string& message, const SessionKey& session_key)
+{
+    const auto& key = session_key.key;
+
+    // Encrypt the message with the key before sending and compute MAC tag
+    Message msg_pkt(crypto::encrypt_message(session_key.suite.cipher, key, message), crypto::compute_mac(message,key));
+    msg_pkt.set_epoch(session_key.epoch);
+    if constexpr (signs_packets<Mode>)
+    {
+        // Sign using ECDSA Private Key
+        Botan::AutoSeeded_RNG rng;
+        Botan::ECDSA_PrivateKey ds_key(rng, Botan::EC_Group("secp521r1"));
+        Botan::PK_Signer signer(ds_key, rng, "SHA-256");
+        signer.update(message);
+        std::vector<uint8_t> signature = signer.signature(rng);
+        std::vector<uint8_t> serial_pk_key = Botan::PKCS8::BER_encode(ds_key, rng, session_key.ds_pass);
+
+        // Bind the encrypted message and MAC tag along with the signature in a packet
+        return SignedMessage(std::move(msg_pkt), signature, serial_pk_key);
+    } else
+        return msg_pkt;
+}
+
+// Decrypts a packet sealed under the given key and verifies its MAC tag (and signature). A packet
+// that fails verification terminates the program.
+template <class Mode>
+std::string open_packet(const PacketView<typename Mode::Packet>& msg_pkt, const SessionKey& session_key)
+{
+    const auto& key = session_key.key;
+
+    std::string message = crypto::decrypt_message(session_key.suite.cipher, key, msg_pkt.get_enc_msg());  // Decrypt the message using shared key
+
+    // Compute MAC tag and verify
+    if(!crypto::verify_mac(message, key, msg_pkt.get_mac_tag()))
+    {
+        std::cout<<"MAC TAGS MISMATCH!"<<std::endl<<"TERMINATING.."<<std::endl;
+        exit(0);
+    }
+
+    if constexpr (signs_packets<Mode>)
+    {
+        // Verify the digital signature; the view only parses a message in the signed layout
+        auto ds_key = Botan::PKCS8::load_key(msg_pkt.get_serial_pk_key(), session_key.ds_pass);
+        Botan::PK_Verifier verifier(*ds_key, "SHA-256");
+        verifier.update(message);
+        if(!verifier.check_signature(msg_pkt.get_signature()))
+        {
+            std::cout<<"SIGNATURE VERIFICATION FAILED!"<<std::endl<<"TERMINATING.."<<std::endl;
+            exit(0);
+        }
+    }
+    return message;
+}
+
+#endif
@@ -2,179 +2,405 @@
 #define READWRITE_HPP
 
 #include <boost/asio.hpp>
-#include <boost/archive/text_oarchive.hpp>  // boost::archive::text_oarchive
-#include <boost/archive/text_iarchive.hpp>  // boost::archive::text_iarchive
 #include <iostream>
 #include <string>
 #include <chrono>
 #include <atomic>
+#include <cstring>
+#include <functional>
+#include <memory>
+#include <optional>
+#include <semaphore>
+#include <string_view>
 #include "messageops.hpp"
 // #include "keyex.hpp"
 #include "tdh.hpp"
 #include "message.hpp"
+#include "uring.hpp"
+#include "sendqueue.hpp"
+#include "heartbeat.hpp"
+#include "keyring.hpp"
+#include "packet.hpp"
+#include "sync.hpp"
+#include "datagram.hpp"
+#include "transport.hpp"
 
 using clk = std::chrono::system_clock;
 using tcp = boost::asio::ip::tcp;
 using msg = std::vector<std::pair<std::chrono::time_point<clk>, std::string>>;
 namespace asio = boost::asio;
 
-std::atomic<bool> ds_enabled = false;
+// A reader's buffer for the frame it is handling, reused from frame to frame
+struct FrameBuffer
+{
+    std::string body;       // Keeps its capacity between frames
+#ifdef DENIM_IO_URING
+    std::optional<RegisteredFramePool::Lease> frame;    // Registered buffer the last frame was read into, held until the next read
+#endif
+};
 
-void read_data_packet(tcp::socket& socket, Message& msg)
-{   
-    // Read the size of the buffer vector in the socket
+// Reads the size of the next frame
+template <ByteStream Stream>
+uint32_t read_frame_size(Stream& socket)
+{
     uint32_t data_size;
     boost::asio::read(socket, boost::asio::buffer(&data_size, sizeof(data_size)));  
-    data_size = ntohl(data_size);   // Convert data size from network byte back to normal byte order
+    return ntohl(data_size);   // Convert data size from network byte back to normal byte order
+}
 
-    // Read the serialized string from the socket
-    std::vector<char> serialized_data(data_size);
-    boost::asio::read(socket, boost::asio::buffer(serialized_data.data(), data_size));
+// Reads the body of the next frame into the reader's buffer, the only copy the packet gets. The
+// returned view stays valid until the next read into the same buffer.
+template <ByteStream Stream>
+std::string_view read_data_packet(Stream& socket, FrameBuffer& buffer)
+{   
+    uint32_t data_size = read_frame_size(socket);
 
-    // Deserialize the received string back to the message object
-    std::istringstream archive_stream(std::string(serialized_data.begin(), serialized_data.end()));
-    boost::archive::text_iarchive archive(archive_stream);
-    archive >> msg;
+    // Read the serialized message from the socket
+    buffer.body.resize(data_size);
+    boost::asio::read(socket, boost::asio::buffer(buffer.body.data(), data_size));
+    return buffer.body;
 }
 
-void send_data_packet(tcp::socket& socket, const Message& msg)
-{   
-    // Serialize the message object to a message string to be sent over the socket
-    std::ostringstream archive_stream;
-    boost::archive::text_oarchive archive(archive_stream);
-    archive << msg;
-    std::string serialized_data = archive_stream.str();     // Serialized string containing the object
-
-    uint32_t data_size = static_cast<uint32_t>(serialized_data.size());
-    data_size = htonl(data_size);   // Convert the data size to a network byte
-
-    // Push the serialized string and data size to buffers
-    std::vector<boost::asio::const_buffer> buffers;
-    buffers.push_back(boost::asio::buffer(&data_size, sizeof(data_size)));  // Buffer to hold the data size
-    buffers.push_back(boost::asio::buffer(serialized_data));    // Buffer to hold the serialized data
-
-    // Write buffers to the socket
-    boost::asio::write(socket, buffers);
+#ifdef DENIM_IO_URING
+
+// Starts an async operation and waits on this thread until the socket's I/O shard completes it
+template <class Operation>
+void await_on_shard(Operation&& start)
+{
+    std::binary_semaphore done{0};
+    boost::system::error_code error;
+    start([&](const boost::system::error_code& ec, std::size_t) {
+        error = ec;
+        done.release();
+    });
+    done.acquire();
+    if (error)
+        throw boost::system::system_error(error);
 }
 
-void read_from_socket(tcp::socket& socket, const std::string& dbname, const Botan::secure_vector<uint8_t>& key, const std::string& ds_pass) {
-    try 
+// io_uring build: the body of a TCP frame is read straight into a registered buffer with an async
+// operation, since only those are submitted to the ring, and parsed from there. Outgoing frames are
+// already async writes through the connection's SendQueue.
+std::string_view read_data_packet(tcp::socket& socket, FrameBuffer& buffer)
+{
+    // An idle reader waits here in a plain read, so it does not hold a registered buffer
+    buffer.frame.reset();
+    uint32_t data_size = read_frame_size(socket);
+
+    if (data_size > URING_FRAME_BUFFER_SIZE)
     {
-        // Create a DB pointer and load the message DB for logging 
-        sqlite3* DB;
-        sqlite3_open(dbname.c_str(), &DB);
-
-        char data[2048];
-        boost::system::error_code error;
-        if (error == boost::asio::error::eof) {
-            return; // Connection closed by peer
-        } else if (error) {
-            throw boost::system::system_error(error); // Some other error
-        }
+        buffer.body.resize(data_size);
+        await_on_shard([&](auto handler) {
+            boost::asio::async_read(socket, boost::asio::buffer(buffer.body.data(), data_size), std::move(handler));
+        });
+        return buffer.body;
+    }
 
-        // Read message packet from the socket
-        Message msg_pkt;
-        read_data_packet(socket, msg_pkt);
+    auto& ring = static_cast<boost::asio::io_context&>(boost::asio::query(socket.get_executor(), boost::asio::execution::context));
+    buffer.frame.emplace(registered_frames(ring).acquire());
+    await_on_shard([&](auto handler) {
+        boost::asio::async_read(socket, buffer.frame->buffer(data_size), std::move(handler));
+    });
+    return std::string_view(buffer.frame->data(), data_size);
+}
 
-        std::string message = crypto::decrypt_message(key, msg_pkt.get_enc_msg());  // Decrypt the message using shared key
+#endif
 
-        // Compute MAC tag and verify
-        std::string hmac_tag = crypto::compute_mac(message,key);
-        if(hmac_tag != msg_pkt.get_mac_tag())
-        {
-            std::cout<<"MAC TAGS MISMATCH!"<<std::endl<<"TERMINATING.."<<std::endl;
-            exit(0);
-        }
+// Verify and log one received packet
+template <class Mode>
+void receive_packet(const PacketView<typename Mode::Packet>& msg_pkt, LogStore& store, KeyRing& keys, Heartbeat& heartbeat, HistorySync<Mode>& sync) {
+    if(heartbeat.on_frame(msg_pkt))     // Ping or pong, nothing to decrypt
+        return;
+    if(sync.on_frame(msg_pkt))
+        return;
+
+    // Use the key the message was sent under; it may be older or newer than the one this side sends with
+    auto session_key = keys.find(msg_pkt.get_epoch());
+    if(!session_key)
+    {
+        std::cerr << "Dropping a message sent under unknown key epoch " << msg_pkt.get_epoch() << "\n";
+        return;
+    }
+
+    std::string message = open_packet<Mode>(msg_pkt, *session_key);     // Terminates on a bad MAC tag or signature
 
-        if(ds_enabled)
+    // Log the message if MAC tag is verified and signature is verified
+    std::time_t timestamp = clk::to_time_t(clk::now());
+    if (!(message == ":e" || message == ":v" || message == ":h" || message == ":d" || message == ":q"))
+    {
+        std::string time_str = std::ctime(&timestamp);
+        time_str.pop_back();
+
+        LogRecord record;
+        record.person = "USER";
+        record.message = message;
+        record.time = time_str;
+        record.group = std::string(msg_pkt.get_group_id());
+        record.uid = std::string(msg_pkt.get_uid());
+        record.modified = msg_pkt.get_modified();
+        log_received(store, record);
+
+        if(!msg_pkt.get_group_id().empty())
+            std::cout << "[" << msg_pkt.get_group_id() << "] ";
+        std::cout << "Message received: " << message << "\n";
+        keys.mark_used();
+    }
+}
+
+// Reads the frames of a session's TCP connection with async operations on the socket's I/O shard, and
+// verifies and logs each one there before the next read starts, so the frame buffer is reused and no
+// thread waits on the connection. on_end runs once the connection is unusable.
+template <class Mode>
+class SocketReader : public std::enable_shared_from_this<SocketReader<Mode>>
+{
+    std::shared_ptr<tcp::socket> socket;
+    std::shared_ptr<LogStore> store;
+    std::shared_ptr<KeyRing> keys;
+    std::shared_ptr<Heartbeat> heartbeat;
+    std::shared_ptr<HistorySync<Mode>> sync;
+    std::function<void()> on_end;
+    uint32_t data_size = 0;
+    FrameBuffer buffer;
+
+    void read_size()
+    {
+        boost::asio::async_read(*socket, boost::asio::buffer(&data_size, sizeof(data_size)),
+            [self = this->shared_from_this()](const boost::system::error_code& error, std::size_t) {
+                if (error)
+                    return self->end(error.message());
+                self->data_size = ntohl(self->data_size);
+                self->read_body();
+            });
+    }
+
+    void read_body()
+    {
+        auto on_body = [self = this->shared_from_this()](const boost::system::error_code& error, std::size_t) {
+            if (error)
+                return self->end(error.message());
+            self->handle();
+        };
+
+#ifdef DENIM_IO_URING
+        // Read straight into a registered buffer, unless the frame is too large or the shard has none left
+        if (data_size <= URING_FRAME_BUFFER_SIZE)
         {
-            // Verify the digital signature
-            auto ds_key = Botan::PKCS8::load_key(msg_pkt.get_serial_pk_key(), ds_pass);
-            Botan::PK_Verifier verifier(*ds_key, "SHA-256");
-            verifier.update(message);
-            if(!verifier.check_signature(msg_pkt.get_signature()))
+            auto& ring = static_cast<boost::asio::io_context&>(boost::asio::query(socket->get_executor(), boost::asio::execution::context));
+            if (auto lease = registered_frames(ring).try_acquire())
             {
-                std::cout<<"SIGNATURE VERIFICATION FAILED!"<<std::endl<<"TERMINATING.."<<std::endl;
-                exit(0);
+                buffer.frame.emplace(std::move(*lease));
+                boost::asio::async_read(*socket, buffer.frame->buffer(data_size), std::move(on_body));
+                return;
             }
         }
+#endif
+        buffer.body.resize(data_size);
+        boost::asio::async_read(*socket, boost::asio::buffer(buffer.body.data(), data_size), std::move(on_body));
+    }
 
-        // Log the message if MAC tag is verified and signature is verified
-        std::time_t timestamp = clk::to_time_t(clk::now());
-        if (!(message == ":e" || message == ":v" || message == ":h" || message == ":d" || message == ":q"))
+    void handle()
+    {
+        std::string_view body = buffer.body;
+#ifdef DENIM_IO_URING
+        if (buffer.frame)
+            body = std::string_view(buffer.frame->data(), data_size);
+#endif
+        try
         {
-            std::string person = "USER";
-            std::string time_str = std::ctime(&timestamp);
-            time_str.pop_back();
+            PacketView<typename Mode::Packet> msg_pkt;
+            if(!msg_pkt.parse(body))
+                throw std::runtime_error("Malformed packet");
+            receive_packet<Mode>(msg_pkt, *store, *keys, *heartbeat, *sync);
+        } catch (std::exception& e) {
+            return end(e.what());
+        }
+#ifdef DENIM_IO_URING
+        buffer.frame.reset();       // An idle reader holds no registered buffer
+#endif
+        read_size();
+    }
+
+    void end(const std::string& reason)
+    {
+        std::cerr << "READ ERROR: " << reason << "\n";
+        on_end();
+    }
 
-            insert_message(DB, person, message, time_str);
+public:
+    SocketReader(std::shared_ptr<tcp::socket> socket, std::shared_ptr<LogStore> store, std::shared_ptr<KeyRing> keys,
+                 std::shared_ptr<Heartbeat> heartbeat, std::shared_ptr<HistorySync<Mode>> sync, std::function<void()> on_end)
+        : socket(std::move(socket)), store(std::move(store)), keys(std::move(keys)), heartbeat(std::move(heartbeat)), sync(std::move(sync)), on_end(std::move(on_end))
+    {
+    }
+
+    void start()
+    {
+        boost::asio::post(socket->get_executor(), [self = this->shared_from_this()]() { self->read_size(); });
+    }
+};
 
-            std::cout << "Message received: " << message << "\n";
+// Verify and log one frame of the datagram transport, where frames arrive whole and in any order.
+// Returns false once the session is unusable.
+template <class Mode>
+bool receive_link_frame(const std::string& frame, LogStore& store, KeyRing& keys, Heartbeat& heartbeat, HistorySync<Mode>& sync) {
+    try 
+    {
+        PacketView<typename Mode::Packet> msg_pkt;
+        if(!msg_pkt.parse(std::string_view(frame).substr(std::min(frame.size(), sizeof(uint32_t)))))
+        {
+            std::cerr << "Dropping a malformed datagram frame\n";
+            return true;
         }
-        
-        sqlite3_close(DB);
+        receive_packet<Mode>(msg_pkt, store, keys, heartbeat, sync);
     } catch (std::exception& e) {
         std::cerr << "READ ERROR: " << e.what() << "\n";
+        return false;
     }
+    return true;
 }
 
-void write_to_socket(tcp::socket& socket, const std::string& dbname, const Botan::secure_vector<uint8_t>& key, const std::string& ds_pass) {
-    try 
+// Starts the one reader of a session, which looks up the key of every packet by its epoch: async reads
+// on the TCP connection, or the frames of the datagram link as they are reassembled. on_end runs once
+// the transport is unusable.
+template <class Mode>
+void start_reader(std::shared_ptr<tcp::socket> socket, std::shared_ptr<DatagramLink> link, std::shared_ptr<LogStore> store, std::shared_ptr<KeyRing> keys,
+                  std::shared_ptr<Heartbeat> heartbeat, std::shared_ptr<HistorySync<Mode>> sync, std::function<void()> on_end)
+{
+    if(!link)
+        return std::make_shared<SocketReader<Mode>>(socket, store, keys, heartbeat, sync, on_end)->start();
+
+    link->start_reading([link, store, keys, heartbeat, sync](const std::string& frame) {
+        if(!receive_link_frame<Mode>(frame, *store, *keys, *heartbeat, *sync))
+            link->close();
+    }, on_end);
+
+    // Over UDP the TCP connection only carries the end of the session
+    auto byte = std::make_shared<char>();
+    socket->async_read_some(boost::asio::buffer(byte.get(), 1), [link, byte](const boost::system::error_code&, std::size_t) {
+        link->close();
+    });
+}
+
+// Frames a message written on this side, sealed under the given key and tagged with its sync fields
+template <class Mode>
+std::string seal_message(const LogRecord& record, const SessionKey& session_key)
+{
+    auto msg_pkt = seal_packet<Mode>(record.message, session_key);
+    msg_pkt.set_sync_fields(record.uid, record.modified);
+    return serialize_packet(msg_pkt);
+}
+
+// Sends the messages written while the peer was offline, oldest first, as one pipelined batch under
+// the session's first key, and marks them sent once the batch is written. Runs before anything else is sent.
+template <class Mode>
+bool flush_outbox(FrameQueue& outbound, LogStore& store, KeyRing& keys)
+{
+    std::vector<LogRecord> messages;
+    std::vector<std::size_t> ids;
+    store.scan_queued([&](const LogRecord& record) {
+        messages.push_back(record);
+        ids.push_back(record.id);
+    });
+    if(ids.empty())
+        return true;
+
+    auto session_key = keys.current();
+    if(!session_key)
+        return false;
+
+    try
     {
-        sqlite3* DB;
-        sqlite3_open(dbname.c_str(), &DB);
+        for(const auto& record : messages)
+            if(!outbound.enqueue(seal_message<Mode>(record, *session_key), SendClass::Bulk))
+                return false;
+    } catch (std::exception& e) {
+        std::cerr << "Outbox exception: " << e.what() << "\n";
+        return false;
+    }
+    if(!outbound.wait_drained())
+    {
+        std::cerr << "Connection lost while delivering queued messages, they stay queued\n";
+        return false;
+    }
 
+    store.set_status(ids, DeliveryStatus::Sent);
+    keys.mark_used();
+    std::cout << ids.size() << " queued message(s) delivered\n";
+    return true;
+}
+
+// Writes a message to a group room over the session (see group_sender); returns false if it was not sent
+using GroupSender = std::function<bool(const std::string& group_id, const std::string& message)>;
+
+// Returns false once the connection is lost or the user quits
+template <class Mode>
+bool write_to_socket(FrameQueue& outbound, LogStore& store, KeyRing& keys, HistorySync<Mode>& sync, const GroupSender& to_group) {
+    try 
+    {
         // Take the user message input
         std::string message;
         std::cout << "Enter the message: (Enter :h for help)\n";
-        std::getline(std::cin, message);
+        if (!std::getline(std::cin, message))
+            message = ":q";     // The console is closed
 
-        // Set the command entered status as false so that key exchange in next iteration is not disturbed after handling the command operation
-        command_entered = false;
+        // :g <room> <message> goes to a group room instead of the peer alone
+        if (message.starts_with(":g "))
+        {
+            std::size_t room_end = message.find(' ', 3);
+            if (room_end == std::string::npos || room_end == 3)
+                std::cerr << "Usage: :g <room> <message>\n";
+            else if (!to_group(message.substr(3, room_end - 3), message.substr(room_end + 1)))
+                std::cerr << "Session closed, message not sent\n";
+            else
+            {
+                std::cout << "Message Sent!\n";
+                std::cout << "-----------------\n";
+            }
+            return true;
+        }
+
+        std::time_t timestamp = clk::to_time_t(clk::now());
+        std::string time_str = std::ctime(&timestamp);
+        time_str.pop_back(); // remove the newline character
+        LogRecord record = new_message("YOU", message, time_str);
 
         if (!(message == ":e" || message == ":v" || message == ":h" || message == ":d" || message == ":q")) // No commands have been entered
         {
-            // Encrypt the message with the key before sending and compute MAC tag
-            std::string enc_msg = crypto::encrypt_message(key, message);
-            std::string mac_tag = crypto::compute_mac(message,key);
-            Message msg_pkt(enc_msg,mac_tag);
-            if(ds_enabled)
+            // Send under the active key; the next one is negotiated in the background
+            auto session_key = keys.current();
+            if(!session_key)
+            {
+                std::cerr << "Session closed, message not sent\n";
+                return false;
+            }
+
+            if(!outbound.enqueue(seal_message<Mode>(record, *session_key)))
             {
-                // Sign using ECDSA Private Key
-                Botan::AutoSeeded_RNG rng;
-                Botan::ECDSA_PrivateKey ds_key(rng, Botan::EC_Group("secp521r1"));
-                Botan::PK_Signer signer(ds_key, rng, "SHA-256");
-                signer.update(message);
-                std::vector<uint8_t> signature = signer.signature(rng);
-                std::vector<uint8_t> serial_pk_key = Botan::PKCS8::BER_encode(ds_key, rng, ds_pass);
-
-                // Bind the encrypted message and MAC tag along with the signature in a packet and send it over the socket
-                Message msg_pkt_ds(enc_msg, mac_tag, signature, serial_pk_key);
-                msg_pkt = msg_pkt_ds;
+                std::cerr << "Connection lost, message not sent\n";
+                return false;
             }
-            send_data_packet(socket, msg_pkt);
-        } else command_entered = true;
+            keys.mark_used();
+        }
 
 
         // Log the sent message
-        std::time_t timestamp = clk::to_time_t(clk::now());
-        if (!executeCommands(message, dbname))       // Execute the function for respective command (if entered)
+        if (!executeCommands<Mode>(message, store))       // Execute the function for respective command (if entered)
         {        
-            std::string person = "YOU";
-            std::string time_str = std::ctime(&timestamp);
-            time_str.pop_back(); // remove the newline character
-
-            insert_message(DB, person, message, time_str);
+            insert_message(store, record);
 
             std::cout << "Message Sent!\n";
             std::cout << "-----------------\n";
+        } else if constexpr (Mode::editable) {
+            if (message == ":e" || message == ":d")
+                sync.hint();        // The peer pulls the edit or delete
         }
-
-        sqlite3_close(DB);
+        if (quit_requested)
+            return false;
 
     } catch (std::exception& e) {
         std::cerr << "Write exception: " << e.what() << "\n";
     }
+    return true;
 }
 
 
@@ -0,0 +1,115 @@
+#ifndef REKEY_HPP
+#define REKEY_HPP
+
+#include <boost/asio.hpp>
+#include <atomic>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include "tdh.hpp"
+#include "keyring.hpp"
+#include "heartbeat.hpp"
+#include "deadline.hpp"
+#include "arena.hpp"
+#include "executor.hpp"
+
+enum class KeyexRole { Client, Server };
+
+// Runs the key exchanges of one session on the key exchange socket, in the background, while messages
+// keep flowing under the active key. The client starts a new 3DH as soon as the active key has protected
+// a message (sent or received); the server answers every exchange the client starts. Each new key
+// is confirmed by both sides before it is used for sending, and packets carry the epoch they were sent
+// under, so the switch needs no pause in the conversation. Between exchanges nothing waits on a thread:
+// each exchange is a task on the blocking pool, started by the key's first use or the client's request.
+class Rekeyer : public std::enable_shared_from_this<Rekeyer>
+{
+    KeyexRole role;
+    std::shared_ptr<tcp::socket> keyex_socket;
+    std::shared_ptr<KeyRing> keys;
+    std::shared_ptr<Heartbeat> heartbeat;
+    std::function<void()> on_failure;
+    SessionArena arena;
+    HandshakeBucket bucket;     // Server: how often the client may start an exchange
+    std::atomic<bool> stopped = false;
+
+    // One exchange on a blocking worker, then back to waiting for the next one
+    void rekey()
+    {
+        executor.blocking().post([self = shared_from_this()]() {
+            bool exchanged = false;
+            try
+            {
+                exchanged = !self->stopped && self->handshake();
+            } catch (std::exception& e) {
+                std::cerr << "Rekey exception: " << e.what() << "\n";
+            }
+
+            if (self->stopped)
+                return;
+            if (exchanged)
+                return self->start();
+            std::cerr << "Rekeying failed, closing the session\n";
+            self->keys->close();
+            self->on_failure();
+        });
+    }
+
+public:
+    Rekeyer(KeyexRole role, std::shared_ptr<tcp::socket> keyex_socket, std::shared_ptr<KeyRing> keys, std::shared_ptr<Heartbeat> heartbeat, std::function<void()> on_failure)
+        : role(role), keyex_socket(std::move(keyex_socket)), keys(std::move(keys)), heartbeat(std::move(heartbeat)), on_failure(std::move(on_failure))
+    {
+    }
+
+    // One key exchange and confirmation. The new key is active for sending when this returns true.
+    bool handshake()
+    {
+        auto next = std::make_shared<SessionKey>(keys->next_epoch());
+
+        bool exchanged = role == KeyexRole::Client
+            ? key_exchange_client(*keyex_socket, *next, arena, heartbeat->handshake_timeout())
+            : key_exchange_server(*keyex_socket, *next, bucket, arena, heartbeat->handshake_timeout());
+        if (!exchanged)
+            return false;
+
+        // The peer may start sending under the new key as soon as it has confirmed it
+        keys->add(next);
+
+        Deadline deadline(*keyex_socket, heartbeat->handshake_timeout());
+        bool confirmed = role == KeyexRole::Client
+            ? confirm_key_client(*keyex_socket, *next)
+            : confirm_key_server(*keyex_socket, *next);
+        if (!confirmed)
+        {
+            std::cerr << "Key confirmation failed for epoch " << next->epoch << "\n";
+            return false;
+        }
+
+        keys->activate(next->epoch);
+        return true;
+    }
+
+    // Keeps the session's key fresh until the session ends, once the first handshake is done
+    void start()
+    {
+        if (role == KeyexRole::Client)
+            keys->when_used([self = shared_from_this()](bool used) {
+                if (used)
+                    self->rekey();
+            });
+        else
+            keyex_socket->async_wait(tcp::socket::wait_read, [self = shared_from_this()](const boost::system::error_code& error) {
+                if (!error)
+                    self->rekey();
+            });
+    }
+
+    void stop()
+    {
+        stopped = true;
+        keys->close();
+        boost::system::error_code ignored;
+        keyex_socket->shutdown(tcp::socket::shutdown_both, ignored);     // Wakes a server waiting for the next exchange
+    }
+};
+
+#endif
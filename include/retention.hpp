@@ -0,0 +1,87 @@
+#ifndef RETENTION_HPP
+#define RETENTION_HPP
+
+#include <boost/asio.hpp>
+#include <atomic>
+#include <chrono>
+#include <exception>
+#include <iostream>
+#include <string>
+#include "logcache.hpp"
+#include "executor.hpp"
+
+#define MAINTENANCE_FIRST_DELAY std::chrono::seconds(60)    // From startup to the first pass, out of the way of the first sessions
+
+// Chosen once at startup (DENIM_RETAIN_DAYS, DENIM_RETAIN_ROWS, DENIM_RETAIN_BYTES, DENIM_MAINTENANCE_S)
+RetentionPolicy retention_policy;
+std::chrono::seconds maintenance_interval{3600};
+
+// Background upkeep of the message histories: every maintenance_interval, a pass on the blocking pool
+// applies the retention policy to each peer's history in turn and compacts it, then reports what was
+// removed and reclaimed and how long it took. The stores lock only around each batch, so sessions keep
+// reading and writing their histories while a pass runs.
+class HistoryMaintenance
+{
+    boost::asio::steady_timer timer;
+    std::atomic<bool> stopped = false;
+
+    void schedule(std::chrono::seconds delay)
+    {
+        boost::asio::post(timer.get_executor(), [this, delay]() {
+            if (stopped)
+                return;
+            timer.expires_after(delay);
+            timer.async_wait([this](const boost::system::error_code& error) {
+                if (!error && !stopped)
+                    executor.blocking().post([this]() {
+                        run();
+                        schedule(maintenance_interval);
+                    });
+            });
+        });
+    }
+
+public:
+    HistoryMaintenance() : timer(executor.io()) {}
+
+    void start()
+    {
+        schedule(MAINTENANCE_FIRST_DELAY);
+    }
+
+    // No pass starts after this; one already running finishes on the blocking pool
+    void stop()
+    {
+        stopped = true;
+        boost::asio::post(timer.get_executor(), [this]() { timer.cancel(); });
+    }
+
+    // One pass over every history on disk
+    MaintenanceReport run()
+    {
+        auto start = std::chrono::steady_clock::now();
+        MaintenanceReport total;
+        for (const std::string& peer : log_stores.peers())
+        {
+            try
+            {
+                MaintenanceReport report = log_stores.borrow(peer)->maintain(retention_policy);
+                total.removed += report.removed;
+                total.removed_bytes += report.removed_bytes;
+                total.reclaimed_bytes += report.reclaimed_bytes;
+            } catch (std::exception& e) {
+                std::cerr << "History maintenance of " << peer << " failed: " << e.what() << "\n";
+            }
+        }
+
+        auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start);
+        if (total.removed > 0 || total.reclaimed_bytes > 0)
+            std::cout << "History maintenance: " << total.removed << " message(s) dropped (" << total.removed_bytes << " bytes of text), "
+                      << total.reclaimed_bytes << " bytes of disk reclaimed in " << elapsed.count() << " ms\n";
+        return total;
+    }
+};
+
+HistoryMaintenance history_maintenance;
+
+#endif
@@ -0,0 +1,226 @@
+#ifndef SENDQUEUE_HPP
+#define SENDQUEUE_HPP
+
+#include <boost/asio.hpp>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#define SEND_QUEUE_MAX_BATCH 64     // Frames gathered into a single write
+
+// Backpressure thresholds in bytes, chosen once at startup (DENIM_SEND_HIGH_WATER, DENIM_SEND_LOW_WATER)
+std::size_t send_high_water = 1u << 20;
+std::size_t send_low_water = 256u << 10;
+
+enum class SendClass
+{
+    Interactive,    // Typed messages: sent as soon as possible
+    Bulk,           // Backlogs and history: may be held back (corked) to fill whole segments
+    Unreliable      // Liveness probes: sent as soon as possible, never retransmitted by the datagram transport
+};
+
+// Where the outgoing frames of a session go: the TCP connection's SendQueue or the DatagramLink
+class FrameQueue
+{
+public:
+    virtual ~FrameQueue() {}
+
+    // Queues a frame, waiting for room. Returns false once the connection failed.
+    virtual bool enqueue(std::string frame, SendClass type = SendClass::Interactive) = 0;
+    // Queues a frame only if there is room; never waits
+    virtual bool try_enqueue(std::string frame, SendClass type = SendClass::Interactive) = 0;
+    // Waits until every queued frame has been delivered. Returns false if the connection failed first.
+    virtual bool wait_drained() = 0;
+    virtual bool ok() = 0;
+};
+
+// Outbound queue of one connection. Frames queued while a write is in flight are coalesced into the
+// next write as one scatter/gather batch, so a burst costs one syscall instead of one per frame.
+// The socket must belong to a running io_context; the writes are completed on its threads.
+class SendQueue : public FrameQueue, public std::enable_shared_from_this<SendQueue>
+{
+    struct Frame
+    {
+        std::string data;
+        SendClass type;
+    };
+
+    std::shared_ptr<boost::asio::ip::tcp::socket> socket;
+    std::size_t high_water;
+    std::size_t low_water;
+
+    std::mutex mtx;
+    std::condition_variable drained;
+    std::deque<Frame> pending;
+    std::vector<Frame> in_flight;
+    std::size_t queued_bytes = 0;       // Pending and in flight
+    std::size_t max_depth = 0;          // Highest depth() and bytes() so far
+    std::size_t max_bytes = 0;
+    bool writing = false;
+    bool corked = false;
+    bool throttled = false;             // Above the high water mark, waiting to get back under the low one
+    bool failed = false;
+
+    void set_cork(bool on)
+    {
+#ifdef TCP_CORK
+        if (on == corked)
+            return;
+        boost::system::error_code error;
+        socket->set_option(boost::asio::detail::socket_option::boolean<IPPROTO_TCP, TCP_CORK>(on), error);
+        corked = on;
+#endif
+    }
+
+    // Called with the lock held
+    void write_next()
+    {
+        if (writing || failed || pending.empty())
+            return;
+
+        bool interactive = false;
+        while (!pending.empty() && in_flight.size() < SEND_QUEUE_MAX_BATCH)
+        {
+            interactive = interactive || pending.front().type != SendClass::Bulk;
+            in_flight.push_back(std::move(pending.front()));
+            pending.pop_front();
+        }
+
+        // Keep the socket corked while bulk frames keep coming; an interactive frame or the end of
+        // the backlog uncorks it, which pushes out the partial segment
+        set_cork(!interactive && !pending.empty());
+
+        std::vector<boost::asio::const_buffer> buffers;
+        buffers.reserve(in_flight.size());
+        for (const auto& frame : in_flight)
+            buffers.push_back(boost::asio::buffer(frame.data));
+
+        writing = true;
+        boost::asio::async_write(*socket, buffers,
+            [self = shared_from_this()](const boost::system::error_code& error, std::size_t written) {
+                self->on_written(error, written);
+            });
+    }
+
+    // Called with the lock held
+    bool push(std::string frame, SendClass type)
+    {
+        if (failed)
+            return false;
+        queued_bytes += frame.size();
+        if (queued_bytes >= high_water)
+            throttled = true;
+        pending.push_back(Frame{std::move(frame), type});
+        max_depth = std::max(max_depth, pending.size() + in_flight.size());
+        max_bytes = std::max(max_bytes, queued_bytes);
+        write_next();
+        return true;
+    }
+
+    void on_written(const boost::system::error_code& error, std::size_t written)
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        writing = false;
+        in_flight.clear();
+        queued_bytes -= written;
+
+        if (error)
+        {
+            std::cerr << "Send error: " << error.message() << "\n";
+            failed = true;
+            pending.clear();
+            queued_bytes = 0;
+        }
+
+        if (queued_bytes <= low_water)
+            throttled = false;
+        drained.notify_all();
+        write_next();
+    }
+
+public:
+    SendQueue(std::shared_ptr<boost::asio::ip::tcp::socket> socket, std::size_t high_water = send_high_water, std::size_t low_water = send_low_water)
+        : socket(std::move(socket)), high_water(high_water), low_water(std::min(low_water, high_water))
+    {
+        // Chat frames are small and latency bound, so do not let Nagle hold them back
+        boost::system::error_code error;
+        this->socket->set_option(boost::asio::ip::tcp::no_delay(true), error);
+    }
+
+    SendQueue(const SendQueue&) = delete;
+    SendQueue& operator=(const SendQueue&) = delete;
+
+    // Waits while the queue is above the high water mark
+    bool enqueue(std::string frame, SendClass type = SendClass::Interactive) override
+    {
+        std::unique_lock<std::mutex> lock(mtx);
+        if (throttled)
+            std::cerr << "Send queue full (" << pending.size() + in_flight.size() << " frames, " << queued_bytes << " bytes), waiting for the peer\n";
+        drained.wait(lock, [this]() { return !throttled || failed; });
+        return push(std::move(frame), type);
+    }
+
+    // Queues a frame only if the queue is below the high water mark
+    bool try_enqueue(std::string frame, SendClass type = SendClass::Interactive) override
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        if (throttled)
+            return false;
+        return push(std::move(frame), type);
+    }
+
+    // Delivered here means written to the socket
+    bool wait_drained() override
+    {
+        std::unique_lock<std::mutex> lock(mtx);
+        drained.wait(lock, [this]() { return queued_bytes == 0 || failed; });
+        return !failed;
+    }
+
+    // Frames not yet handed to the kernel, including the batch being written
+    std::size_t depth()
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        return pending.size() + in_flight.size();
+    }
+
+    std::size_t bytes()
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        return queued_bytes;
+    }
+
+    std::size_t peak_depth()
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        return max_depth;
+    }
+
+    std::size_t peak_bytes()
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        return max_bytes;
+    }
+
+    bool ok() override
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        return !failed;
+    }
+};
+
+// Printed when a session ends, next to the round-trip time
+void print_send_queue(SendQueue& queue)
+{
+    std::cout << "Send queue: " << queue.depth() << " frame(s), " << queue.bytes() << " bytes left (peak " << queue.peak_depth()
+              << " frames, " << queue.peak_bytes() << " bytes)\n";
+}
+
+#endif
@@ -8,36 +8,41 @@
 #include <string>
 #include <memory>
 #include "client.hpp"
-#include "readwriteds.hpp"
+#include "readwrite.hpp"
+#include "group.hpp"
+#include "executor.hpp"
+#include "rekey.hpp"
 
 std::atomic<bool> client_accepted = false;
 std::atomic<bool> keyex_socket_est = false;     // False == Key exchange socket not established yet and vice-versa
-Botan::secure_vector<uint8_t> shared_key;
-std::string ds_pass;
 
-void start_keyex(std::shared_ptr<tcp::socket> keyex_socket, Botan::secure_vector<uint8_t>& shared_key)
-{
-    key_exchange_server(*keyex_socket,shared_key, ds_pass);
-}
-
-void keyex_socket_accept(tcp::acceptor& keyex_acceptor, std::shared_ptr<tcp::socket> keyex_socket)
+// Only the connected client's address may open the key exchange socket; anyone else is turned away before any key exchange
+void keyex_socket_accept(tcp::acceptor& keyex_acceptor, std::shared_ptr<tcp::socket> keyex_socket, const boost::asio::ip::address& client_address)
 {   
     while(!client_accepted){            // Sleep (do not execute) until a connection is accepted
         std::this_thread::sleep_for(std::chrono::milliseconds(100));
     }
 
-    keyex_acceptor.accept(*keyex_socket);
+    while(true)
+    {
+        keyex_acceptor.accept(*keyex_socket);
+        boost::system::error_code error;
+        auto remote = keyex_socket->remote_endpoint(error);
+        if(!error && remote.address() == client_address)
+            break;
+        keyex_socket->close(error);
+    }
     keyex_socket_est = true;
 }
 
 void start_server_accept(tcp::acceptor& acceptor, std::shared_ptr<boost::asio::ip::tcp::socket> socket) {
     // Start accepting incoming connections from a user
-    acceptor.async_accept(*socket, [&](const boost::system::error_code& error) {
+    acceptor.async_accept(*socket, [socket](const boost::system::error_code& error) {
         if (!error) {
-            std::cout << "Connection accepted." << std::endl;
+            std::cout << "Connection accepted. Press Enter to start the session." << std::endl;
             client_accepted = true;
             stop_client_mode = true;
-        } else {
+        } else if (error != boost::asio::error::operation_aborted) {
             std::cerr << "Accept error: " << error.message() << std::endl;
         }
     });
@@ -48,114 +53,143 @@ void handle_connection_signal(boost::asio::io_context& io_context) {
     // Ask whether user wants to connect to a user -> Switches to client mode
     std::string connection_signal;
     std::cout << "Enter c to connect to a client: ";
-    std::getline(std::cin, connection_signal);
-    while (connection_signal != "c" && !client_accepted) {
+    bool open = static_cast<bool>(std::getline(std::cin, connection_signal));
+    while (open && connection_signal != "c" && !client_accepted) {
         std::cout << "Invalid response! Enter again: ";
-        std::getline(std::cin, connection_signal);
+        open = static_cast<bool>(std::getline(std::cin, connection_signal));
     }
+    if (!open)
+        quit_requested = true;      // The console is closed
 
     //  Return if a connection is accepted meanwhile -> and handle that connection
-    if(client_accepted)
+    if(client_accepted || quit_requested)
         return;
 
     // If "c" is entered -> switch to client mode asking the recipient details
     if (connection_signal == "c") {
-        std::thread client_thread([&io_context]() {
-            client(io_context);
-        });
-        client_thread.detach();
+        client(io_context);
     }
+
+    // Back from client mode (e.g. after queueing messages for an offline recipient): offer to connect again
+    if(!client_accepted && !quit_requested)
+        handle_connection_signal(io_context);
 }
 
-void handle_client(std::shared_ptr<tcp::socket> socket, const std::string& dbname, const Botan::secure_vector<uint8_t>& key) {
+// Send one message on the session's thread; the session's reader and rekeyer tasks run in the meantime
+template <class Mode>
+bool handle_client(FrameQueue& outbound, LogStore& store, KeyRing& keys, HistorySync<Mode>& sync, const GroupSender& to_group) {
     try {
-        
-        std::thread write_thread(write_to_socket, std::ref(*socket), dbname, std::ref(key), ds_pass);
-        std::thread read_thread(read_from_socket, std::ref(*socket), dbname, std::ref(key), ds_pass);
-        
-        write_thread.join();
-        read_thread.detach();
+        return write_to_socket<Mode>(outbound, store, keys, sync, to_group);
     } catch (std::exception& e) {
         std::cerr << "Client handling exception: " << e.what() << "\n";
     }
+    return true;
+}
+
+// One session with the accepted client, from the key exchange to the end
+template <class Mode>
+void serve_client(tcp::acceptor& keyex_acceptor, std::shared_ptr<tcp::socket> socket, std::shared_ptr<tcp::socket> keyex_socket, const std::string& clientIP)
+{
+    // Message history shared by the read and write threads, opened once per peer
+    auto store = log_store_for(clientIP);
+
+    auto keys = std::make_shared<KeyRing>();
+
+    // Frames go over the TCP connection, or over UDP with the TCP connection kept for setup and teardown
+    std::shared_ptr<FrameQueue> outbound;
+    std::shared_ptr<DatagramLink> link;
+    std::shared_ptr<SendQueue> send_queue;
+    if(data_transport == DataTransport::Udp)
+        outbound = link = open_datagram_link(*socket, keys, true);
+    else
+        outbound = send_queue = std::make_shared<SendQueue>(socket);   // Coalesces the session's outgoing frames
+
+    // Establish the key exchange socket
+    keyex_socket_accept(keyex_acceptor, keyex_socket, socket->remote_endpoint().address());
+
+    auto close_session = [socket, keyex_socket, link]() {
+        boost::system::error_code ignored;
+        socket->shutdown(tcp::socket::shutdown_both, ignored);
+        keyex_socket->shutdown(tcp::socket::shutdown_both, ignored);
+        if(link)
+            link->close();
+    };
+
+    // Pings the client and closes both sockets if it goes silent
+    auto heartbeat = std::make_shared<Heartbeat>(outbound, close_session);
+    heartbeat->start();
+
+    auto rekeyer = std::make_shared<Rekeyer>(KeyexRole::Server, keyex_socket, keys, heartbeat, close_session);
+
+    // History sync with the peer, answered and merged by the reader
+    auto sync = std::make_shared<HistorySync<Mode>>(store, outbound, keys);
+
+    start_reader<Mode>(socket, link, store, keys, heartbeat, sync, [heartbeat, rekeyer]() {
+        heartbeat->stop();
+        rekeyer->stop();
+    });
+
+    // The first key exchange has to finish before anything is sent; the later ones run in the background
+    if(!rekeyer->handshake()) {
+        std::cerr << "Server: Key exchange failed, closing the session\n";
+        close_session();
+        return;
+    }
+    std::cout << "Server: Cipher suite " << suite_name(keys->peek()->suite) << "\n";
+    rekeyer->start();
+
+    // Deliver what was written while the client was offline, before anything new
+    flush_outbox<Mode>(*outbound, *store, *keys);
+
+    // Then exchange the edits, deletes and messages each side missed since the last sync
+    sync->request();
+
+    // Messaging until the user terminates or the connection is lost
+    auto to_group = group_sender<Mode>(clientIP, outbound, store, keys);
+    while(handle_client(*outbound, *store, *keys, *sync, to_group));
+
+    group_rooms.leave(clientIP);
+    rekeyer->stop();
+    heartbeat->stop();
+    print_rtt(heartbeat->stats());
+    if(send_queue)
+        print_send_queue(*send_queue);
+    if(link)
+        std::cout << link->retransmitted() << " datagram(s) retransmitted\n";
+    close_session();        // Ends the reader too
 }
 
 void server(boost::asio::io_context& io_context, const std::string& address, const std::string& port) {
     try {
+        // The session, accepted or started from here, keeps its sockets, timers and crypto on one I/O shard;
+        // the tasks posted from this thread carry it along
+        ShardScope session_shard(executor.assign_shard());
+
         // Communication socket
         tcp::acceptor acceptor(io_context, tcp::endpoint(boost::asio::ip::make_address(address), std::stoi(port)));
-        auto socket = std::make_shared<tcp::socket>(io_context);
+        auto socket = std::make_shared<tcp::socket>(executor.io());
 
         // Key Exchange socket
         tcp::acceptor keyex_acceptor(io_context, tcp::endpoint(boost::asio::ip::make_address(address), std::stoi(port) + 1));
-        auto keyex_socket = std::make_shared<tcp::socket>(io_context);
-
-        std::thread start_server_thread([&]() {     // Thread to start accepting connections
-            start_server_accept(acceptor, socket);
-            io_context.run();
-        });
+        auto keyex_socket = std::make_shared<tcp::socket>(executor.io());
 
-        std::thread handle_connection_signal_thread([&io_context]() {   // Thread for the function of asking the user whether to connect to another user
-            handle_connection_signal(io_context);
-        });
+        start_server_accept(acceptor, socket);      // Completed on the acceptor's I/O shard
 
-        start_server_thread.detach();
-        handle_connection_signal_thread.detach();
-
-        // Sleep until a connection is accepted while keeping the handle_conc_signal thread running 
-        while (!client_accepted) {
-            std::this_thread::sleep_for(std::chrono::milliseconds(100));
-        }
+        // The console stays on this thread: it offers to connect to another user until a connection
+        // is accepted or the user quits
+        handle_connection_signal(executor.io());
+        if (!client_accepted || quit_requested)
+            return;
 
         std::cout << "CONNECTED TO A CLIENT!" << std::endl;     // client_accepted == true at this point -> control out of (sleep_for) loop
         std::string clientIP = socket->remote_endpoint().address().to_string();
         unsigned short clientPort = socket->remote_endpoint().port();
         std::cout << "CLIENT IP: " << clientIP << " CLIENT PORT: " << clientPort << "\n";
 
-        // Check and create DB
-        sqlite3* DB;
-        const std::string path = "../lib/logs/";
-        const std::string dbname = path + "msghist_" + clientIP + ".db";
-        sqlite3_open(dbname.c_str(), &DB);
-
-        // Create table if not exists
-        std::string create_table = "CREATE TABLE IF NOT EXISTS MSG_LOGS("
-                                   "ID INTEGER PRIMARY KEY AUTOINCREMENT,"
-                                   "PERSON TEXT NOT NULL,"
-                                   "MESSAGE TEXT NOT NULL,"
-                                   "TIME TEXT NOT NULL);";
-        execute_sql(DB, create_table);
-        sqlite3_close(DB);
-
-        // Start the key exchange socket thread and sleep until it is established
-        std::thread keyex_socket_thread([&](){
-            keyex_socket_accept(keyex_acceptor, keyex_socket);
+        // The session runs in the mode chosen at startup
+        with_mode(security_mode, [&](auto mode) {
+            serve_client<decltype(mode)>(keyex_acceptor, socket, keyex_socket, clientIP);
         });
-        keyex_socket_thread.detach();
-
-        while(!keyex_socket_est){
-            std::this_thread::sleep_for(std::chrono::milliseconds(100));
-        }
-
-        //  Key exchange and messaging until user terminates
-        while(true)
-        {   
-            if(!command_entered)
-            {
-                std::thread keyex_thread([&](){
-                    start_keyex(keyex_socket, shared_key);
-                });
-                keyex_thread.detach();
-
-                while(!key_exchange_status_server) {
-                std::this_thread::sleep_for(std::chrono::milliseconds(100));
-                }
-
-                key_exchange_status_server = false;
-            }
-
-            handle_client(socket, dbname, shared_key);
-        }
     } catch (std::exception& e) {
         std::cerr << "Server exception: " << e.what() << "\n";
     }
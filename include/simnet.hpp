@@ -0,0 +1,265 @@
+#ifndef SIMNET_HPP
+#define SIMNET_HPP
+
+#include <boost/asio.hpp>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <string>
+#include <utility>
+#include "transport.hpp"
+
+using tcp = boost::asio::ip::tcp;
+using sim_clk = std::chrono::steady_clock;
+
+// Link characteristics of a simulated network, the same in both directions
+struct SimLinkConfig
+{
+    std::chrono::microseconds latency{0};       // One way
+    double bandwidth = 0;                       // Bytes per second; 0 is unlimited
+    double loss = 0;                            // Fraction of writes lost once, then delivered after retransmit_delay
+    std::chrono::microseconds retransmit_delay{200000};     // What a loss costs, like a TCP retransmission timeout
+};
+
+// One direction of a simulated connection. Writes are delivered in order, each once its turn on the
+// link, the latency and any retransmission have passed; a lost write holds back everything after it,
+// as on a TCP connection. Losses are drawn from the pipe's own seeded generator, so a given seed
+// always loses the same writes.
+class SimPipe
+{
+    struct Chunk
+    {
+        sim_clk::time_point deliver_at;
+        std::string data;
+        std::size_t offset = 0;
+    };
+
+    SimLinkConfig config;
+    std::mt19937_64 gen;
+    std::mutex mtx;
+    std::condition_variable arrived;
+    std::deque<Chunk> chunks;
+    sim_clk::time_point link_free{};        // When the link has finished sending the earlier writes
+    sim_clk::time_point last_delivery{};
+    bool closed = false;
+
+    // Called with the lock held
+    bool deliverable(sim_clk::time_point now) const
+    {
+        return !chunks.empty() && chunks.front().deliver_at <= now;
+    }
+
+    // Called with the lock held: waits until the front chunk is due or the pipe is closed
+    void wait_deliverable(std::unique_lock<std::mutex>& lock)
+    {
+        while (!closed)
+        {
+            if (chunks.empty())
+                arrived.wait(lock);
+            else if (!deliverable(sim_clk::now()))
+                arrived.wait_until(lock, chunks.front().deliver_at);
+            else
+                return;
+        }
+    }
+
+public:
+    SimPipe(const SimLinkConfig& config, uint64_t seed) : config(config), gen(seed) {}
+
+    std::size_t write(const char* data, std::size_t size, boost::system::error_code& error)
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        if (closed)
+        {
+            error = boost::asio::error::broken_pipe;
+            return 0;
+        }
+
+        auto now = sim_clk::now();
+        link_free = std::max(link_free, now);
+        if (config.bandwidth > 0)
+            link_free += std::chrono::duration_cast<sim_clk::duration>(std::chrono::duration<double>(size / config.bandwidth));
+        auto deliver_at = link_free + config.latency;
+        if (config.loss > 0 && std::uniform_real_distribution<double>(0, 1)(gen) < config.loss)
+            deliver_at += config.retransmit_delay;
+        last_delivery = std::max(last_delivery, deliver_at);
+
+        chunks.push_back(Chunk{last_delivery, std::string(data, size)});
+        arrived.notify_all();
+        error = {};
+        return size;
+    }
+
+    std::size_t read(char* data, std::size_t size, boost::system::error_code& error)
+    {
+        std::unique_lock<std::mutex> lock(mtx);
+        wait_deliverable(lock);
+        if (closed)
+        {
+            error = boost::asio::error::eof;
+            return 0;
+        }
+
+        std::size_t copied = 0;
+        auto now = sim_clk::now();
+        while (copied < size && deliverable(now))
+        {
+            Chunk& chunk = chunks.front();
+            std::size_t n = std::min(size - copied, chunk.data.size() - chunk.offset);
+            std::copy_n(chunk.data.data() + chunk.offset, n, data + copied);
+            copied += n;
+            chunk.offset += n;
+            if (chunk.offset == chunk.data.size())
+                chunks.pop_front();
+        }
+        error = {};
+        return copied;
+    }
+
+    void wait_readable()
+    {
+        std::unique_lock<std::mutex> lock(mtx);
+        wait_deliverable(lock);
+    }
+
+    void close()
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        closed = true;
+        chunks.clear();
+        arrived.notify_all();
+    }
+};
+
+// One end of a simulated connection, usable wherever a ByteStream is expected
+class SimStream
+{
+    std::shared_ptr<SimPipe> in;
+    std::shared_ptr<SimPipe> out;
+    tcp::endpoint local;
+    tcp::endpoint remote;
+
+public:
+    SimStream(std::shared_ptr<SimPipe> in, std::shared_ptr<SimPipe> out, tcp::endpoint local, tcp::endpoint remote)
+        : in(std::move(in)), out(std::move(out)), local(local), remote(remote)
+    {
+    }
+
+    SimStream(const SimStream&) = delete;
+    SimStream& operator=(const SimStream&) = delete;
+
+    template <class MutableBufferSequence>
+    std::size_t read_some(const MutableBufferSequence& buffers, boost::system::error_code& error)
+    {
+        for (auto it = boost::asio::buffer_sequence_begin(buffers); it != boost::asio::buffer_sequence_end(buffers); ++it)
+        {
+            boost::asio::mutable_buffer buffer(*it);
+            if (buffer.size() > 0)
+                return in->read(static_cast<char*>(buffer.data()), buffer.size(), error);
+        }
+        error = {};
+        return 0;
+    }
+
+    template <class MutableBufferSequence>
+    std::size_t read_some(const MutableBufferSequence& buffers)
+    {
+        boost::system::error_code error;
+        std::size_t size = read_some(buffers, error);
+        if (error)
+            throw boost::system::system_error(error);
+        return size;
+    }
+
+    template <class ConstBufferSequence>
+    std::size_t write_some(const ConstBufferSequence& buffers, boost::system::error_code& error)
+    {
+        for (auto it = boost::asio::buffer_sequence_begin(buffers); it != boost::asio::buffer_sequence_end(buffers); ++it)
+        {
+            boost::asio::const_buffer buffer(*it);
+            if (buffer.size() > 0)
+                return out->write(static_cast<const char*>(buffer.data()), buffer.size(), error);
+        }
+        error = {};
+        return 0;
+    }
+
+    template <class ConstBufferSequence>
+    std::size_t write_some(const ConstBufferSequence& buffers)
+    {
+        boost::system::error_code error;
+        std::size_t size = write_some(buffers, error);
+        if (error)
+            throw boost::system::system_error(error);
+        return size;
+    }
+
+    // Only waiting for input is simulated; the link never refuses a write
+    void wait(tcp::socket::wait_type type)
+    {
+        if (type == tcp::socket::wait_read)
+            in->wait_readable();
+    }
+
+    void shutdown(tcp::socket::shutdown_type type, boost::system::error_code& error)
+    {
+        if (type != tcp::socket::shutdown_send)
+            in->close();
+        if (type != tcp::socket::shutdown_receive)
+            out->close();
+        error = {};
+    }
+
+    tcp::endpoint local_endpoint(boost::system::error_code& error) const
+    {
+        error = {};
+        return local;
+    }
+
+    tcp::endpoint remote_endpoint(boost::system::error_code& error) const
+    {
+        error = {};
+        return remote;
+    }
+};
+
+static_assert(ByteStream<SimStream>);
+static_assert(ByteStream<tcp::socket>);
+
+// In-process network: connects pairs of SimStreams over links with the configured latency,
+// bandwidth and loss. Every pipe gets its own generator seeded from the network's seed and the
+// order of connect() calls, so a run can be repeated exactly.
+class SimNetwork
+{
+    SimLinkConfig config;
+    uint64_t seed;
+    std::atomic<uint64_t> pipes = 0;
+
+    uint64_t next_seed()
+    {
+        std::seed_seq sequence{seed, pipes++};
+        uint64_t value;
+        sequence.generate(reinterpret_cast<uint32_t*>(&value), reinterpret_cast<uint32_t*>(&value) + 2);
+        return value;
+    }
+
+public:
+    SimNetwork(SimLinkConfig config, uint64_t seed = 1) : config(config), seed(seed) {}
+
+    // Returns the client's and the server's end of a new connection
+    std::pair<std::shared_ptr<SimStream>, std::shared_ptr<SimStream>> connect(const tcp::endpoint& client, const tcp::endpoint& server)
+    {
+        auto upstream = std::make_shared<SimPipe>(config, next_seed());
+        auto downstream = std::make_shared<SimPipe>(config, next_seed());
+        return {std::make_shared<SimStream>(downstream, upstream, client, server),
+                std::make_shared<SimStream>(upstream, downstream, server, client)};
+    }
+};
+
+#endif
@@ -0,0 +1,548 @@
+#ifndef SQLITELOG_HPP
+#define SQLITELOG_HPP
+
+#include <iostream>
+#include <string>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <algorithm>
+#include <chrono>
+#include <sqlite3.h>
+#include "logstore.hpp"
+
+#define SQLITE_VACUUM_PAGES 256     // Free pages returned to the file system per lock of the DB
+
+void execute_sql(sqlite3* DB, const std::string& sql) {
+    char* errmsg;
+    int rc = sqlite3_exec(DB, sql.c_str(), 0, 0, &errmsg);
+    if (rc != SQLITE_OK) {
+        std::cerr << "SQL error: " << errmsg << std::endl;
+        sqlite3_free(errmsg);
+    }
+}
+
+// Adds a column to a table created before the column existed
+void ensure_column(sqlite3* DB, const std::string& table, const std::string& column, const std::string& decl) {
+    sqlite3_stmt* stmt;
+    bool found = false;
+    if (sqlite3_prepare_v2(DB, ("PRAGMA table_info(" + table + ");").c_str(), -1, &stmt, nullptr) == SQLITE_OK) {
+        while (sqlite3_step(stmt) == SQLITE_ROW)
+            if (column == reinterpret_cast<const char*>(sqlite3_column_text(stmt, 1)))
+                found = true;
+    }
+    sqlite3_finalize(stmt);
+    if (!found)
+        execute_sql(DB, "ALTER TABLE " + table + " ADD COLUMN " + column + " " + decl + ";");
+}
+
+// One SQLite connection, shared by every store that keeps its messages in the same DB file
+class SqliteDatabase
+{
+public:
+    sqlite3* DB = nullptr;
+    std::mutex mtx;
+
+    explicit SqliteDatabase(const std::string& dbname)
+    {
+        if (sqlite3_open(dbname.c_str(), &DB) != SQLITE_OK)
+        {
+            std::string err = sqlite3_errmsg(DB);
+            sqlite3_close(DB);
+            throw std::runtime_error("Cannot open " + dbname + ": " + err);
+        }
+
+        // Only takes effect on a new DB; older ones are converted right here, before any store uses them
+        execute_sql(DB, "PRAGMA auto_vacuum=INCREMENTAL;");
+        if (pragma("auto_vacuum") != 2)
+            convert(dbname);
+        // WAL keeps the appends sequential and lets the reader and writer threads overlap
+        execute_sql(DB, "PRAGMA journal_mode=WAL;");
+        execute_sql(DB, "PRAGMA synchronous=NORMAL;");
+    }
+
+    // Value of a PRAGMA that returns a number; the lock must be held
+    int64_t pragma(const std::string& name)
+    {
+        int64_t value = 0;
+        sqlite3_stmt* stmt;
+        if (sqlite3_prepare_v2(DB, ("PRAGMA " + name + ";").c_str(), -1, &stmt, nullptr) == SQLITE_OK && sqlite3_step(stmt) == SQLITE_ROW)
+            value = sqlite3_column_int64(stmt, 0);
+        sqlite3_finalize(stmt);
+        return value;
+    }
+
+    // Peers with rows in a consolidated DB
+    std::vector<std::string> peers()
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        std::vector<std::string> found;
+        sqlite3_stmt* stmt;
+        if (sqlite3_prepare_v2(DB, "SELECT DISTINCT PEER FROM MSG_LOGS;", -1, &stmt, nullptr) == SQLITE_OK)
+            while (sqlite3_step(stmt) == SQLITE_ROW)
+                found.push_back(reinterpret_cast<const char*>(sqlite3_column_text(stmt, 0)));
+        sqlite3_finalize(stmt);
+        return found;
+    }
+
+    // A DB created before incremental vacuum was turned on only switches with a full VACUUM. It rewrites
+    // the whole file, so it takes time in proportion to the history and up to twice its size on disk,
+    // once. It runs when the DB is opened, before the store is handed to a session: in the consolidated
+    // layout a later conversion would hold the lock every peer's messages go through.
+    void convert(const std::string& dbname)
+    {
+        auto start = std::chrono::steady_clock::now();
+        execute_sql(DB, "VACUUM;");
+        if (pragma("auto_vacuum") == 2)
+            std::cout << "Converted " << dbname << " to incremental vacuum in "
+                      << std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count() << " s (once)\n";
+    }
+
+    // Gives the pages freed by deletes back to the file system, SQLITE_VACUUM_PAGES per lock so that the
+    // sessions using the DB get it in between, and returns the bytes reclaimed. A DB that could not be
+    // converted when it was opened (e.g. locked by another process) frees nothing here.
+    std::size_t vacuum()
+    {
+        int64_t page_size, before;
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            page_size = pragma("page_size");
+            before = pragma("page_count");
+            if (pragma("freelist_count") == 0 || pragma("auto_vacuum") != 2)
+                return 0;
+        }
+        while (true)
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            int64_t free_pages = pragma("freelist_count");
+            if (free_pages == 0)
+                break;
+            execute_sql(DB, "PRAGMA incremental_vacuum(" + std::to_string(SQLITE_VACUUM_PAGES) + ");");
+            if (pragma("freelist_count") >= free_pages)
+                break;      // No progress, e.g. the DB is locked by another process
+        }
+
+        // The file only shrinks once the WAL is checkpointed
+        std::lock_guard<std::mutex> lock(mtx);
+        execute_sql(DB, "PRAGMA wal_checkpoint(TRUNCATE);");
+        return static_cast<std::size_t>(std::max<int64_t>(before - pragma("page_count"), 0) * page_size);
+    }
+
+    SqliteDatabase(const SqliteDatabase&) = delete;
+    SqliteDatabase& operator=(const SqliteDatabase&) = delete;
+
+    ~SqliteDatabase()
+    {
+        sqlite3_close(DB);
+    }
+};
+
+// MSG_LOGS backend on SQLite. The statements are prepared once and reused, so each message costs
+// one bind/step/reset instead of a parse of a fresh SQL string.
+// With an empty peer the DB is the peer's own msghist_<ip>.db; otherwise the DB is the consolidated
+// history of all peers and every statement is restricted to this peer's rows.
+// Deletes leave a tombstone row (DELETED = 1, empty MESSAGE) so that they can be synced; CSEQ is the
+// change sequence of the row's latest local insert/edit/delete, and SYNC_STATE keeps the sync mark.
+// Rows dropped by retention are removed outright; CHANGE_STATE keeps the change sequence reached before.
+class SqliteLogStore : public LogStore
+{
+    std::shared_ptr<SqliteDatabase> db;
+    sqlite3* DB;
+    std::string peer;
+    uint64_t last_change = 0;
+    sqlite3_stmt* insert_stmt = nullptr;
+    sqlite3_stmt* update_stmt = nullptr;
+    sqlite3_stmt* delete_stmt = nullptr;
+    sqlite3_stmt* find_stmt = nullptr;
+    sqlite3_stmt* select_stmt = nullptr;
+    sqlite3_stmt* queued_stmt = nullptr;
+    sqlite3_stmt* status_stmt = nullptr;
+    sqlite3_stmt* changes_stmt = nullptr;
+    sqlite3_stmt* uid_stmt = nullptr;
+    sqlite3_stmt* mark_stmt = nullptr;
+    sqlite3_stmt* set_mark_stmt = nullptr;
+    sqlite3_stmt* retention_stmt = nullptr;
+    sqlite3_stmt* prune_stmt = nullptr;
+    sqlite3_stmt* set_change_stmt = nullptr;
+
+    sqlite3_stmt* prepare(const std::string& sql)
+    {
+        sqlite3_stmt* stmt = nullptr;
+        if (sqlite3_prepare_v2(DB, sql.c_str(), -1, &stmt, nullptr) != SQLITE_OK)
+            throw std::runtime_error(std::string("SQL prepare failed: ") + sqlite3_errmsg(DB));
+        return stmt;
+    }
+
+    // Binds the peer to the given parameter if the DB is shared between peers
+    void bind_peer(sqlite3_stmt* stmt, int index)
+    {
+        if (!peer.empty())
+            sqlite3_bind_text(stmt, index, peer.c_str(), -1, SQLITE_STATIC);
+    }
+
+    // Run a prepared statement that returns no rows and make it reusable
+    bool step_done(sqlite3_stmt* stmt)
+    {
+        int rc = sqlite3_step(stmt);
+        sqlite3_reset(stmt);
+        sqlite3_clear_bindings(stmt);
+        if (rc != SQLITE_DONE)
+            std::cerr << "SQL error: " << sqlite3_errmsg(DB) << std::endl;
+        return rc == SQLITE_DONE;
+    }
+
+    static LogRecord read_row(sqlite3_stmt* stmt)
+    {
+        LogRecord record;
+        record.id = sqlite3_column_int64(stmt, 0);
+        record.person = reinterpret_cast<const char*>(sqlite3_column_text(stmt, 1));
+        record.message = reinterpret_cast<const char*>(sqlite3_column_text(stmt, 2));
+        record.time = reinterpret_cast<const char*>(sqlite3_column_text(stmt, 3));
+        record.group = reinterpret_cast<const char*>(sqlite3_column_text(stmt, 4));
+        record.status = static_cast<DeliveryStatus>(sqlite3_column_int(stmt, 5));
+        record.uid = reinterpret_cast<const char*>(sqlite3_column_text(stmt, 6));
+        record.change = sqlite3_column_int64(stmt, 7);
+        record.modified = sqlite3_column_int64(stmt, 8);
+        record.deleted = sqlite3_column_int(stmt, 9) != 0;
+        return record;
+    }
+
+    void bind_insert(const LogRecord& record, uint64_t change)
+    {
+        sqlite3_bind_text(insert_stmt, 1, record.person.c_str(), -1, SQLITE_TRANSIENT);
+        sqlite3_bind_text(insert_stmt, 2, record.message.c_str(), -1, SQLITE_TRANSIENT);
+        sqlite3_bind_text(insert_stmt, 3, record.time.c_str(), -1, SQLITE_TRANSIENT);
+        sqlite3_bind_text(insert_stmt, 4, record.group.c_str(), -1, SQLITE_TRANSIENT);
+        sqlite3_bind_int(insert_stmt, 5, static_cast<int>(record.status));
+        sqlite3_bind_text(insert_stmt, 6, record.uid.c_str(), -1, SQLITE_TRANSIENT);
+        sqlite3_bind_int64(insert_stmt, 7, change);
+        sqlite3_bind_int64(insert_stmt, 8, record.modified);
+        sqlite3_bind_int(insert_stmt, 9, record.deleted);
+        bind_peer(insert_stmt, 10);
+    }
+
+    bool update_locked(std::size_t id, const std::string& message, uint64_t change, int64_t modified)
+    {
+        sqlite3_bind_text(update_stmt, 1, message.c_str(), -1, SQLITE_TRANSIENT);
+        sqlite3_bind_int64(update_stmt, 2, change);
+        sqlite3_bind_int64(update_stmt, 3, modified);
+        sqlite3_bind_int64(update_stmt, 4, id);
+        bind_peer(update_stmt, 5);
+        return step_done(update_stmt) && sqlite3_changes(DB) > 0;
+    }
+
+    bool delete_locked(std::size_t id, uint64_t change, int64_t modified)
+    {
+        sqlite3_bind_int64(delete_stmt, 1, change);
+        sqlite3_bind_int64(delete_stmt, 2, modified);
+        sqlite3_bind_int64(delete_stmt, 3, id);
+        bind_peer(delete_stmt, 4);
+        return step_done(delete_stmt) && sqlite3_changes(DB) > 0;
+    }
+
+public:
+    explicit SqliteLogStore(const std::string& dbname) : SqliteLogStore(std::make_shared<SqliteDatabase>(dbname)) {}
+
+    SqliteLogStore(std::shared_ptr<SqliteDatabase> database, const std::string& peer_id = "") : db(std::move(database)), DB(db->DB), peer(peer_id)
+    {
+        std::lock_guard<std::mutex> lock(db->mtx);
+        const std::string columns = "SELECT ID, PERSON, MESSAGE, TIME, GRP, STATUS, UID, CSEQ, MODIFIED, DELETED FROM MSG_LOGS ";
+        if (peer.empty())
+        {
+            // Create table if not exists
+            execute_sql(DB, "CREATE TABLE IF NOT EXISTS MSG_LOGS("
+                            "ID INTEGER PRIMARY KEY AUTOINCREMENT,"
+                            "PERSON TEXT NOT NULL,"
+                            "MESSAGE TEXT NOT NULL,"
+                            "TIME TEXT NOT NULL);");
+        } else {
+            execute_sql(DB, "CREATE TABLE IF NOT EXISTS MSG_LOGS("
+                            "ID INTEGER PRIMARY KEY AUTOINCREMENT,"
+                            "PEER TEXT NOT NULL,"
+                            "PERSON TEXT NOT NULL,"
+                            "MESSAGE TEXT NOT NULL,"
+                            "TIME TEXT NOT NULL);");
+        }
+        ensure_column(DB, "MSG_LOGS", "GRP", "TEXT NOT NULL DEFAULT ''");
+        ensure_column(DB, "MSG_LOGS", "STATUS", "INTEGER NOT NULL DEFAULT 0");
+        ensure_column(DB, "MSG_LOGS", "UID", "TEXT NOT NULL DEFAULT ''");
+        ensure_column(DB, "MSG_LOGS", "CSEQ", "INTEGER NOT NULL DEFAULT 0");
+        ensure_column(DB, "MSG_LOGS", "MODIFIED", "INTEGER NOT NULL DEFAULT 0");
+        ensure_column(DB, "MSG_LOGS", "DELETED", "INTEGER NOT NULL DEFAULT 0");
+        execute_sql(DB, "CREATE TABLE IF NOT EXISTS SYNC_STATE(PEER TEXT PRIMARY KEY, MARK INTEGER NOT NULL);");
+        execute_sql(DB, "CREATE TABLE IF NOT EXISTS CHANGE_STATE(PEER TEXT PRIMARY KEY, LAST INTEGER NOT NULL);");
+
+        if (peer.empty())
+        {
+            execute_sql(DB, "CREATE INDEX IF NOT EXISTS MSG_LOGS_QUEUED ON MSG_LOGS(ID) WHERE STATUS = 1;");     // Only the outbox
+            execute_sql(DB, "CREATE UNIQUE INDEX IF NOT EXISTS MSG_LOGS_UID ON MSG_LOGS(UID) WHERE UID != '';");
+            execute_sql(DB, "CREATE INDEX IF NOT EXISTS MSG_LOGS_CHANGES ON MSG_LOGS(CSEQ) WHERE CSEQ > 0;");
+
+            insert_stmt = prepare("INSERT OR IGNORE INTO MSG_LOGS (PERSON, MESSAGE, TIME, GRP, STATUS, UID, CSEQ, MODIFIED, DELETED) VALUES (?1, ?2, ?3, ?4, ?5, ?6, ?7, ?8, ?9);");
+            update_stmt = prepare("UPDATE MSG_LOGS SET MESSAGE = ?1, CSEQ = ?2, MODIFIED = ?3 WHERE ID = ?4 AND DELETED = 0;");
+            delete_stmt = prepare("UPDATE MSG_LOGS SET MESSAGE = '', DELETED = 1, STATUS = 0, CSEQ = ?1, MODIFIED = ?2 WHERE ID = ?3 AND DELETED = 0;");
+            find_stmt = prepare(columns + "WHERE ID = ?1 AND DELETED = 0;");
+            select_stmt = prepare(columns + "WHERE DELETED = 0 ORDER BY ID;");
+            queued_stmt = prepare(columns + "WHERE STATUS = 1 ORDER BY ID;");
+            status_stmt = prepare("UPDATE MSG_LOGS SET STATUS = ?1 WHERE ID = ?2;");
+            changes_stmt = prepare(columns + "WHERE CSEQ > 0 AND CSEQ > ?1 AND UID != '' ORDER BY CSEQ;");
+            uid_stmt = prepare(columns + "WHERE UID = ?1 AND UID != '';");
+            retention_stmt = prepare("SELECT ID, MODIFIED, STATUS, LENGTH(CAST(PERSON || MESSAGE || TIME || GRP || UID AS BLOB)) FROM MSG_LOGS "
+                                     "WHERE ID > ?1 ORDER BY ID LIMIT " + std::to_string(RETENTION_BATCH) + ";");
+            prune_stmt = prepare("DELETE FROM MSG_LOGS WHERE ID = ?1 AND STATUS = 0;");
+        } else {
+            execute_sql(DB, "CREATE INDEX IF NOT EXISTS MSG_LOGS_PEER ON MSG_LOGS(PEER, ID);");
+            execute_sql(DB, "CREATE INDEX IF NOT EXISTS MSG_LOGS_QUEUED ON MSG_LOGS(PEER, ID) WHERE STATUS = 1;");
+            execute_sql(DB, "CREATE UNIQUE INDEX IF NOT EXISTS MSG_LOGS_UID ON MSG_LOGS(PEER, UID) WHERE UID != '';");
+            execute_sql(DB, "CREATE INDEX IF NOT EXISTS MSG_LOGS_CHANGES ON MSG_LOGS(PEER, CSEQ) WHERE CSEQ > 0;");
+
+            insert_stmt = prepare("INSERT OR IGNORE INTO MSG_LOGS (PERSON, MESSAGE, TIME, GRP, STATUS, UID, CSEQ, MODIFIED, DELETED, PEER) VALUES (?1, ?2, ?3, ?4, ?5, ?6, ?7, ?8, ?9, ?10);");
+            update_stmt = prepare("UPDATE MSG_LOGS SET MESSAGE = ?1, CSEQ = ?2, MODIFIED = ?3 WHERE ID = ?4 AND DELETED = 0 AND PEER = ?5;");
+            delete_stmt = prepare("UPDATE MSG_LOGS SET MESSAGE = '', DELETED = 1, STATUS = 0, CSEQ = ?1, MODIFIED = ?2 WHERE ID = ?3 AND DELETED = 0 AND PEER = ?4;");
+            find_stmt = prepare(columns + "WHERE ID = ?1 AND DELETED = 0 AND PEER = ?2;");
+            select_stmt = prepare(columns + "WHERE PEER = ?1 AND DELETED = 0 ORDER BY ID;");
+            queued_stmt = prepare(columns + "WHERE PEER = ?1 AND STATUS = 1 ORDER BY ID;");
+            status_stmt = prepare("UPDATE MSG_LOGS SET STATUS = ?1 WHERE ID = ?2 AND PEER = ?3;");
+            changes_stmt = prepare(columns + "WHERE CSEQ > 0 AND CSEQ > ?1 AND UID != '' AND PEER = ?2 ORDER BY CSEQ;");
+            uid_stmt = prepare(columns + "WHERE UID = ?1 AND UID != '' AND PEER = ?2;");
+            retention_stmt = prepare("SELECT ID, MODIFIED, STATUS, LENGTH(CAST(PERSON || MESSAGE || TIME || GRP || UID AS BLOB)) FROM MSG_LOGS "
+                                     "WHERE ID > ?1 AND PEER = ?2 ORDER BY ID LIMIT " + std::to_string(RETENTION_BATCH) + ";");
+            prune_stmt = prepare("DELETE FROM MSG_LOGS WHERE ID = ?1 AND STATUS = 0 AND PEER = ?2;");
+        }
+        mark_stmt = prepare("SELECT MARK FROM SYNC_STATE WHERE PEER = ?1;");
+        set_mark_stmt = prepare("INSERT OR REPLACE INTO SYNC_STATE (PEER, MARK) VALUES (?1, ?2);");
+        set_change_stmt = prepare("INSERT OR REPLACE INTO CHANGE_STATE (PEER, LAST) VALUES (?1, ?2);");
+
+        // Change sequences only grow: merges and tombstones keep theirs, so the highest one is still in the
+        // table, unless retention dropped its row after saving it in CHANGE_STATE
+        sqlite3_stmt* max_stmt = prepare(peer.empty() ? "SELECT COALESCE(MAX(CSEQ), 0) FROM MSG_LOGS;" : "SELECT COALESCE(MAX(CSEQ), 0) FROM MSG_LOGS WHERE PEER = ?1;");
+        bind_peer(max_stmt, 1);
+        if (sqlite3_step(max_stmt) == SQLITE_ROW)
+            last_change = sqlite3_column_int64(max_stmt, 0);
+        sqlite3_finalize(max_stmt);
+
+        sqlite3_stmt* saved_stmt = prepare("SELECT LAST FROM CHANGE_STATE WHERE PEER = ?1;");
+        sqlite3_bind_text(saved_stmt, 1, peer.c_str(), -1, SQLITE_STATIC);
+        if (sqlite3_step(saved_stmt) == SQLITE_ROW)
+            last_change = std::max<uint64_t>(last_change, sqlite3_column_int64(saved_stmt, 0));
+        sqlite3_finalize(saved_stmt);
+    }
+
+    SqliteLogStore(const SqliteLogStore&) = delete;
+    SqliteLogStore& operator=(const SqliteLogStore&) = delete;
+
+    ~SqliteLogStore()
+    {
+        std::lock_guard<std::mutex> lock(db->mtx);
+        sqlite3_finalize(insert_stmt);
+        sqlite3_finalize(update_stmt);
+        sqlite3_finalize(delete_stmt);
+        sqlite3_finalize(find_stmt);
+        sqlite3_finalize(select_stmt);
+        sqlite3_finalize(queued_stmt);
+        sqlite3_finalize(status_stmt);
+        sqlite3_finalize(changes_stmt);
+        sqlite3_finalize(uid_stmt);
+        sqlite3_finalize(mark_stmt);
+        sqlite3_finalize(set_mark_stmt);
+        sqlite3_finalize(retention_stmt);
+        sqlite3_finalize(prune_stmt);
+        sqlite3_finalize(set_change_stmt);
+    }
+
+    void insert(const LogRecord& record) override
+    {
+        std::lock_guard<std::mutex> lock(db->mtx);
+        bind_insert(record, ++last_change);
+        step_done(insert_stmt);
+    }
+
+    bool edit(std::size_t id, const std::string& message) override
+    {
+        std::lock_guard<std::mutex> lock(db->mtx);
+        return update_locked(id, message, ++last_change, now_micros());
+    }
+
+    bool remove(std::size_t id) override
+    {
+        std::lock_guard<std::mutex> lock(db->mtx);
+        return delete_locked(id, ++last_change, now_micros());
+    }
+
+    std::optional<LogRecord> find(std::size_t id) override
+    {
+        std::lock_guard<std::mutex> lock(db->mtx);
+        std::optional<LogRecord> record;
+        sqlite3_bind_int64(find_stmt, 1, id);
+        bind_peer(find_stmt, 2);
+        if (sqlite3_step(find_stmt) == SQLITE_ROW)
+            record = read_row(find_stmt);
+        sqlite3_reset(find_stmt);
+        sqlite3_clear_bindings(find_stmt);
+        return record;
+    }
+
+    void scan(const std::function<void(const LogRecord&)>& visit) override
+    {
+        std::lock_guard<std::mutex> lock(db->mtx);
+        bind_peer(select_stmt, 1);
+        while (sqlite3_step(select_stmt) == SQLITE_ROW)
+            visit(read_row(select_stmt));
+        sqlite3_reset(select_stmt);
+        sqlite3_clear_bindings(select_stmt);
+    }
+
+    void scan_queued(const std::function<void(const LogRecord&)>& visit) override
+    {
+        std::lock_guard<std::mutex> lock(db->mtx);
+        bind_peer(queued_stmt, 1);
+        while (sqlite3_step(queued_stmt) == SQLITE_ROW)
+            visit(read_row(queued_stmt));
+        sqlite3_reset(queued_stmt);
+        sqlite3_clear_bindings(queued_stmt);
+    }
+
+    // One transaction for the whole batch, so a flushed backlog costs a single commit
+    void set_status(const std::vector<std::size_t>& ids, DeliveryStatus status) override
+    {
+        std::lock_guard<std::mutex> lock(db->mtx);
+        execute_sql(DB, "BEGIN;");
+        for (std::size_t id : ids)
+        {
+            sqlite3_bind_int(status_stmt, 1, static_cast<int>(status));
+            sqlite3_bind_int64(status_stmt, 2, id);
+            bind_peer(status_stmt, 3);
+            step_done(status_stmt);
+        }
+        execute_sql(DB, "COMMIT;");
+    }
+
+    void changes_since(uint64_t change, const std::function<void(const LogRecord&)>& visit) override
+    {
+        std::lock_guard<std::mutex> lock(db->mtx);
+        sqlite3_bind_int64(changes_stmt, 1, change);
+        bind_peer(changes_stmt, 2);
+        while (sqlite3_step(changes_stmt) == SQLITE_ROW)
+            visit(read_row(changes_stmt));
+        sqlite3_reset(changes_stmt);
+        sqlite3_clear_bindings(changes_stmt);
+    }
+
+    // One transaction per batch, like set_status. A row keeps its change sequence when the peer's change
+    // wins, so the sequence never goes back and sending the row again later is harmless.
+    void merge(const std::vector<LogRecord>& remote) override
+    {
+        std::lock_guard<std::mutex> lock(db->mtx);
+        execute_sql(DB, "BEGIN;");
+        for (const LogRecord& change : remote)
+        {
+            if (change.uid.empty())
+                continue;
+
+            std::optional<LogRecord> local;
+            sqlite3_bind_text(uid_stmt, 1, change.uid.c_str(), -1, SQLITE_TRANSIENT);
+            bind_peer(uid_stmt, 2);
+            if (sqlite3_step(uid_stmt) == SQLITE_ROW)
+                local = read_row(uid_stmt);
+            sqlite3_reset(uid_stmt);
+            sqlite3_clear_bindings(uid_stmt);
+
+            if (!local)
+            {
+                LogRecord record = change;
+                record.status = DeliveryStatus::Sent;
+                if (record.deleted)
+                    record.message.clear();
+                bind_insert(record, 0);
+                step_done(insert_stmt);
+            } else if (remote_wins(*local, change)) {
+                if (change.deleted)
+                    delete_locked(local->id, local->change, change.modified);
+                else
+                    update_locked(local->id, change.message, local->change, change.modified);
+            }
+        }
+        execute_sql(DB, "COMMIT;");
+    }
+
+    uint64_t sync_mark() override
+    {
+        std::lock_guard<std::mutex> lock(db->mtx);
+        uint64_t mark = 0;
+        sqlite3_bind_text(mark_stmt, 1, peer.c_str(), -1, SQLITE_STATIC);
+        if (sqlite3_step(mark_stmt) == SQLITE_ROW)
+            mark = sqlite3_column_int64(mark_stmt, 0);
+        sqlite3_reset(mark_stmt);
+        sqlite3_clear_bindings(mark_stmt);
+        return mark;
+    }
+
+    void set_sync_mark(uint64_t change) override
+    {
+        std::lock_guard<std::mutex> lock(db->mtx);
+        sqlite3_bind_text(set_mark_stmt, 1, peer.c_str(), -1, SQLITE_STATIC);
+        sqlite3_bind_int64(set_mark_stmt, 2, change);
+        step_done(set_mark_stmt);
+    }
+
+    // Reads the rows RETENTION_BATCH at a time and drops the expired ones in one transaction per batch,
+    // each saving the change sequence first. A row queued in the meantime is kept (STATUS = 0 in the delete).
+    MaintenanceReport maintain(const RetentionPolicy& policy) override
+    {
+        MaintenanceReport report;
+        if (policy.enabled())
+        {
+            std::vector<RetentionEntry> entries;
+            for (bool more = true; more;)
+            {
+                std::lock_guard<std::mutex> lock(db->mtx);
+                std::size_t read = 0;
+                sqlite3_bind_int64(retention_stmt, 1, entries.empty() ? 0 : entries.back().id);
+                bind_peer(retention_stmt, 2);
+                while (sqlite3_step(retention_stmt) == SQLITE_ROW)
+                {
+                    RetentionEntry entry;
+                    entry.id = sqlite3_column_int64(retention_stmt, 0);
+                    entry.modified = sqlite3_column_int64(retention_stmt, 1);
+                    entry.pinned = sqlite3_column_int(retention_stmt, 2) == static_cast<int>(DeliveryStatus::Queued);
+                    entry.bytes = sqlite3_column_int64(retention_stmt, 3);
+                    entries.push_back(entry);
+                    read++;
+                }
+                sqlite3_reset(retention_stmt);
+                sqlite3_clear_bindings(retention_stmt);
+                more = read == RETENTION_BATCH;
+            }
+
+            std::vector<std::size_t> expired = select_expired(entries, policy, now_micros());
+            for (std::size_t first = 0; first < expired.size(); first += RETENTION_BATCH)
+            {
+                std::lock_guard<std::mutex> lock(db->mtx);
+                execute_sql(DB, "BEGIN;");
+                sqlite3_bind_text(set_change_stmt, 1, peer.c_str(), -1, SQLITE_STATIC);
+                sqlite3_bind_int64(set_change_stmt, 2, last_change);
+                step_done(set_change_stmt);
+                for (std::size_t i = first; i < std::min(expired.size(), first + RETENTION_BATCH); i++)
+                {
+                    sqlite3_bind_int64(prune_stmt, 1, expired[i]);
+                    bind_peer(prune_stmt, 2);
+                    if (step_done(prune_stmt) && sqlite3_changes(DB) > 0)
+                        report.removed++;
+                }
+                execute_sql(DB, "COMMIT;");
+            }
+
+            std::size_t next = 0;
+            for (const RetentionEntry& entry : entries)
+                if (next < expired.size() && entry.id == expired[next])
+                {
+                    report.removed_bytes += entry.bytes;
+                    next++;
+                }
+        }
+        report.reclaimed_bytes = db->vacuum();
+        return report;
+    }
+};
+
+#endif
@@ -0,0 +1,164 @@
+#ifndef SUITE_HPP
+#define SUITE_HPP
+
+#include <botan/auto_rng.h>
+#include <botan/dh.h>
+#include <botan/dl_group.h>
+#include <botan/ecdh.h>
+#include <botan/pubkey.h>
+#include <botan/x25519.h>
+#include <algorithm>
+#include <cstddef>
+#include <memory>
+#include <optional>
+#include <string>
+#include <vector>
+
+// Record cipher that encrypts the messages under a session key. The MAC tag is computed on top of
+// it either way, so the AEAD ciphers' own tags only add integrity to the ciphertext.
+enum class RecordCipher
+{
+    Aes256Cbc,          // The original cipher, and what a peer that offers nothing gets
+    Aes256Gcm,
+    ChaCha20Poly1305
+};
+
+// Key agreement of the 3DH handshakes
+enum class KeyAgreement
+{
+    Modp1536,           // The original group, and what a peer that offers nothing gets
+    P256,
+    X25519
+};
+
+#define RECORD_CIPHERS 3
+#define KEY_AGREEMENTS 3
+
+struct CipherSuite
+{
+    RecordCipher cipher = RecordCipher::Aes256Cbc;
+    KeyAgreement kex = KeyAgreement::Modp1536;
+};
+
+const char* const record_cipher_names[RECORD_CIPHERS] = {"aes256cbc", "aes256gcm", "chacha20poly1305"};
+const char* const record_cipher_modes[RECORD_CIPHERS] = {"AES-256/CBC/PKCS7", "AES-256/GCM", "ChaCha20Poly1305"};
+const char* const key_agreement_names[KEY_AGREEMENTS] = {"modp1536", "p256", "x25519"};
+
+// This side's preferences, best first: ranked by the startup calibration (calibrate.hpp), or reduced
+// to a single entry by an override (DENIM_CIPHER, DENIM_KEX)
+std::vector<RecordCipher> cipher_preference = {RecordCipher::Aes256Gcm, RecordCipher::ChaCha20Poly1305, RecordCipher::Aes256Cbc};
+std::vector<KeyAgreement> kex_preference = {KeyAgreement::X25519, KeyAgreement::P256, KeyAgreement::Modp1536};
+
+std::string suite_name(const CipherSuite& suite)
+{
+    return std::string(record_cipher_names[static_cast<int>(suite.cipher)]) + "/" + key_agreement_names[static_cast<int>(suite.kex)];
+}
+
+template <class T>
+std::optional<T> parse_choice(const std::string& name, const char* const* names, std::size_t count)
+{
+    for (std::size_t i = 0; i < count; i++)
+        if (name == names[i])
+            return static_cast<T>(i);
+    return std::nullopt;
+}
+
+// Comma-separated names, best first; unknown names are skipped
+template <class T>
+std::vector<T> parse_ranking(const std::string& list, const char* const* names, std::size_t count)
+{
+    std::vector<T> ranking;
+    std::size_t start = 0;
+    while (start <= list.size())
+    {
+        std::size_t end = std::min(list.find(',', start), list.size());
+        auto choice = parse_choice<T>(list.substr(start, end - start), names, count);
+        if (choice)
+            ranking.push_back(*choice);
+        start = end + 1;
+    }
+    return ranking;
+}
+
+template <class T>
+std::string format_ranking(const std::vector<T>& ranking, const char* const* names)
+{
+    std::string list;
+    for (T choice : ranking)
+        list += (list.empty() ? "" : ",") + std::string(names[static_cast<int>(choice)]);
+    return list;
+}
+
+// The ranked ciphers and key agreements of this side, as sent in the handshake request:
+// "<cipher>,<cipher>,.../<kex>,<kex>,..."
+std::string suite_offer()
+{
+    return format_ranking(cipher_preference, record_cipher_names) + "/" + format_ranking(kex_preference, key_agreement_names);
+}
+
+// Picks from both rankings the entry with the best combined rank; a tie goes to the chooser's ranking
+template <class T>
+std::optional<T> pick(const std::vector<T>& offered, const std::vector<T>& own)
+{
+    std::optional<T> best;
+    std::size_t best_score = 0;
+    for (std::size_t i = 0; i < own.size(); i++)
+        for (std::size_t j = 0; j < offered.size(); j++)
+            if (offered[j] == own[i] && (!best || i + j < best_score))
+            {
+                best = own[i];
+                best_score = i + j;
+            }
+    return best;
+}
+
+// The server's choice for a client's offer, or nothing if the two sides have no cipher or no key
+// agreement in common. An empty offer stands for the original suite.
+std::optional<CipherSuite> choose_suite(const std::string& offer)
+{
+    std::size_t slash = offer.find('/');
+    std::vector<RecordCipher> ciphers = {RecordCipher::Aes256Cbc};
+    std::vector<KeyAgreement> kexes = {KeyAgreement::Modp1536};
+    if (slash != std::string::npos)
+    {
+        ciphers = parse_ranking<RecordCipher>(offer.substr(0, slash), record_cipher_names, RECORD_CIPHERS);
+        kexes = parse_ranking<KeyAgreement>(offer.substr(slash + 1), key_agreement_names, KEY_AGREEMENTS);
+    }
+    auto cipher = pick(ciphers, cipher_preference);
+    auto kex = pick(kexes, kex_preference);
+    if (!cipher || !kex)
+        return std::nullopt;
+    return CipherSuite{*cipher, *kex};
+}
+
+// The suite named in the server's answer, if it is one this side offered
+std::optional<CipherSuite> accept_suite(const std::string& name)
+{
+    std::size_t slash = name.find('/');
+    if (slash == std::string::npos)
+        return std::nullopt;
+    auto cipher = parse_choice<RecordCipher>(name.substr(0, slash), record_cipher_names, RECORD_CIPHERS);
+    auto kex = parse_choice<KeyAgreement>(name.substr(slash + 1), key_agreement_names, KEY_AGREEMENTS);
+    if (!cipher || !kex || std::find(cipher_preference.begin(), cipher_preference.end(), *cipher) == cipher_preference.end()
+        || std::find(kex_preference.begin(), kex_preference.end(), *kex) == kex_preference.end())
+        return std::nullopt;
+    return CipherSuite{*cipher, *kex};
+}
+
+// A fresh private key for one of the 3DH key pairs
+std::unique_ptr<Botan::PK_Key_Agreement_Key> new_agreement_key(KeyAgreement kex, Botan::RandomNumberGenerator& rng)
+{
+    static const Botan::DL_Group modp("modp/ietf/1536");
+    static const Botan::EC_Group p256("secp256r1");
+    switch (kex)
+    {
+    case KeyAgreement::X25519:
+        return std::make_unique<Botan::X25519_PrivateKey>(rng);
+    case KeyAgreement::P256:
+        return std::make_unique<Botan::ECDH_PrivateKey>(rng, p256);
+    default:
+        return std::make_unique<Botan::DH_PrivateKey>(rng, modp);
+    }
+}
+
+#endif
@@ -0,0 +1,209 @@
+#ifndef SYNC_HPP
+#define SYNC_HPP
+
+#include <boost/archive/text_iarchive.hpp>
+#include <boost/archive/text_oarchive.hpp>
+#include <boost/serialization/string.hpp>
+#include <boost/serialization/vector.hpp>
+#include <algorithm>
+#include <cstdint>
+#include <iostream>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <vector>
+#include "packet.hpp"
+#include "logstore.hpp"
+#include "sendqueue.hpp"
+#include "keyring.hpp"
+#include "executor.hpp"
+
+#define SYNC_BATCH_MAX 256      // Changes per sync frame
+
+// One insert, edit or delete in a sync batch, as its sender sees it
+struct SyncChange
+{
+    std::string uid;
+    std::string person;
+    std::string message;
+    std::string time;
+    std::string group;
+    int64_t modified = 0;
+    bool deleted = false;
+
+    template <class Archive>
+    void serialize(Archive& archive, const unsigned int version)
+    {
+        archive & uid;
+        archive & person;
+        archive & message;
+        archive & time;
+        archive & group;
+        archive & modified;
+        archive & deleted;
+    }
+};
+
+struct SyncBatch
+{
+    uint64_t upto = 0;      // Sender's change sequence of the last change in the batch: the receiver's new sync mark
+    std::vector<SyncChange> changes;
+
+    template <class Archive>
+    void serialize(Archive& archive, const unsigned int version)
+    {
+        archive & upto;
+        archive & changes;
+    }
+};
+
+// Incremental history sync with the peer of a session. Each side numbers its own inserts, edits and
+// deletes with a change sequence and keeps the highest change of the peer's it has merged (the sync
+// mark). A sync request carries the mark; the peer answers with its changes after it, in batches of
+// at most SYNC_BATCH_MAX encrypted and MAC'd like messages, and the mark moves with every batch
+// merged, so an interrupted sync resumes where it stopped. Conflicts resolve as in remote_wins().
+// Batches are sealed like the messages of the session's mode.
+template <class Mode>
+class HistorySync : public std::enable_shared_from_this<HistorySync<Mode>>
+{
+    std::shared_ptr<LogStore> store;
+    std::shared_ptr<FrameQueue> outbound;
+    std::shared_ptr<KeyRing> keys;
+    SerialQueue answers;        // Built off the reader thread, one request at a time
+
+    // The sender's "YOU" is this side's "USER" and the other way round
+    static std::string from_peer(const std::string& person)
+    {
+        if (person == "YOU")
+            return "USER";
+        if (person == "USER")
+            return "YOU";
+        return person;
+    }
+
+    void send_control(MessageKind kind, uint64_t value)
+    {
+        Message control;
+        control.set_control(kind, value);
+        outbound->try_enqueue(serialize_packet(control));     // Sent again with the next request if it does not fit
+    }
+
+    void answer(uint64_t since)
+    {
+        std::vector<LogRecord> changes;
+        store->changes_since(since, [&](const LogRecord& record) { changes.push_back(record); });
+        if (changes.empty())
+            return;
+
+        auto session_key = keys->current();
+        if (!session_key)
+            return;
+
+        for (std::size_t first = 0; first < changes.size(); first += SYNC_BATCH_MAX)
+        {
+            SyncBatch batch;
+            std::size_t last = std::min(changes.size(), first + SYNC_BATCH_MAX);
+            for (std::size_t i = first; i < last; i++)
+            {
+                const LogRecord& record = changes[i];
+                batch.changes.push_back({record.uid, record.person, record.message, record.time, record.group, record.modified, record.deleted});
+                batch.upto = record.change;
+            }
+
+            std::ostringstream archive_stream;
+            {
+                boost::archive::text_oarchive archive(archive_stream);
+                archive << batch;
+            }
+            auto msg_pkt = seal_packet<Mode>(archive_stream.str(), *session_key);
+            msg_pkt.set_kind(MessageKind::SyncBatch);
+            if (!outbound->enqueue(serialize_packet(msg_pkt), SendClass::Bulk))
+                return;
+        }
+    }
+
+    void merge(const PacketView<typename Mode::Packet>& msg_pkt)
+    {
+        auto session_key = keys->find(msg_pkt.get_epoch());
+        if (!session_key)
+        {
+            std::cerr << "Dropping a sync batch sent under unknown key epoch " << msg_pkt.get_epoch() << "\n";
+            return;
+        }
+
+        SyncBatch batch;
+        std::istringstream archive_stream(open_packet<Mode>(msg_pkt, *session_key));
+        boost::archive::text_iarchive archive(archive_stream);
+        archive >> batch;
+
+        std::vector<LogRecord> records;
+        records.reserve(batch.changes.size());
+        for (const SyncChange& change : batch.changes)
+        {
+            LogRecord record;
+            record.uid = change.uid;
+            record.person = from_peer(change.person);
+            record.message = change.message;
+            record.time = change.time;
+            record.group = change.group;
+            record.modified = change.modified;
+            record.deleted = change.deleted;
+            records.push_back(std::move(record));
+        }
+        store->merge(records);
+        if (batch.upto > store->sync_mark())
+            store->set_sync_mark(batch.upto);
+        std::cout << "History sync: " << records.size() << " change(s) merged\n";
+    }
+
+public:
+    HistorySync(std::shared_ptr<LogStore> store, std::shared_ptr<FrameQueue> outbound, std::shared_ptr<KeyRing> keys)
+        : store(std::move(store)), outbound(std::move(outbound)), keys(std::move(keys)), answers(executor.blocking())
+    {
+    }
+
+    // Asks the peer for its changes since the last sync
+    void request()
+    {
+        send_control(MessageKind::SyncRequest, store->sync_mark());
+    }
+
+    // Tells the peer this side has new changes for it (after a local edit or delete)
+    void hint()
+    {
+        send_control(MessageKind::SyncHint, 0);
+    }
+
+    // Called by the reader for every frame received. Returns true if it was a sync frame, which is then fully handled.
+    bool on_frame(const PacketView<typename Mode::Packet>& msg_pkt)
+    {
+        switch (msg_pkt.get_kind())
+        {
+        case MessageKind::SyncRequest:
+            answers.post([self = this->shared_from_this(), since = msg_pkt.get_timestamp()]() {
+                try
+                {
+                    self->answer(since);
+                } catch (std::exception& e) {
+                    std::cerr << "History sync exception: " << e.what() << "\n";
+                }
+            });
+            return true;
+        case MessageKind::SyncHint:
+            request();
+            return true;
+        case MessageKind::SyncBatch:
+            try
+            {
+                merge(msg_pkt);
+            } catch (std::exception& e) {
+                std::cerr << "History sync exception: " << e.what() << "\n";
+            }
+            return true;
+        default:
+            return false;
+        }
+    }
+};
+
+#endif
@@ -3,13 +3,27 @@
 
 #define KEYEX_INIT std::string("INIT_DHKE")              // Request to initiate key exchange
 #define KEYEX_INIT_ACK std::string("INIT_DHKE_ACK")      // Acknowledgement to the request indicating the server is ready for key exchange
+#define KEYEX_NO_SUITE std::string("NO_SUITE_DHKE")      // Answer to a request offering no cipher suite the server accepts
+#define KEYEX_CONFIRM std::string("CONFIRM_DHKE")        // Label of the key confirmation tags
 
 #include <iostream>
 #include <boost/asio.hpp>
 #include <atomic>
+#include <charconv>
+#include <string_view>
 #include <thread>
 #include <botan/kdf.h>
+#include <future>
+#include <memory>
+#include <optional>
 #include "crypt.hpp"
+#include "executor.hpp"
+#include "arena.hpp"
+#include "deadline.hpp"
+#include "floodguard.hpp"
+#include "keyring.hpp"
+#include "suite.hpp"
+#include "transport.hpp"
 
 using tcp = boost::asio::ip::tcp;
 
@@ -18,43 +32,122 @@ std::atomic<bool> init_dhke_flag = false;
 std::atomic<bool> init_dhke_ack_flag = false;
 std::atomic<bool> client_pk_sent = false;
 std::atomic<bool> server_pk_sent = false;
-std::atomic<bool> key_exchange_status_server = false; // False = Key Exchange Not done && True = Done
-std::atomic<bool> key_exchange_status_client = false;
 
-void key_exchange_client(tcp::socket& keyex_socket, Botan::secure_vector<uint8_t>& shared_key, std::string& ds_pass)
+// Runs one key agreement on the executor's CPU pool. Every task has its own RNG since an RNG must not be
+// shared between threads. The task owns the key and public value, so a handshake that gives up on a
+// malformed value while the other agreements still run leaves nothing dangling.
+std::future<Botan::secure_vector<uint8_t>> derive_async(std::shared_ptr<const Botan::PK_Key_Agreement_Key> private_key, std::vector<uint8_t> public_key, const std::string& kdf)
 {
+    return executor.cpu().submit([private_key = std::move(private_key), public_key = std::move(public_key), kdf]() {
+        Botan::AutoSeeded_RNG rng;
+        Botan::PK_Key_Agreement agreement(*private_key, rng, kdf);
+        return agreement.derive_key(32, public_key).bits_of();
+    });
+}
+
+// Hex of derived bytes, written straight into the locked page of the session key
+void assign_hex(arena_string& out, std::span<const uint8_t> bytes)
+{
+    out.resize(2 * bytes.size());
+    Botan::hex_encode(out.data(), bytes.data(), bytes.size());
+}
+
+// Final step of both sides: the record key, derived from the hash straight into the session key's page
+void derive_record_key(SessionKey& session_key, const arena_vector<uint8_t>& key_hash)
+{
+    auto kdf2 = Botan::KDF::create_or_throw("SP800-56A(SHA-256)");
+    session_key.key.resize(32);
+    kdf2->kdf(session_key.key.data(), session_key.key.size(), key_hash.data(), key_hash.size(), nullptr, 0, nullptr, 0);
+}
+
+// Generates a key pair of the given key agreement on the executor's CPU pool
+std::future<std::unique_ptr<Botan::PK_Key_Agreement_Key>> generate_async(KeyAgreement kex)
+{
+    return executor.cpu().submit([kex]() {
+        Botan::AutoSeeded_RNG rng;
+        return new_agreement_key(kex, rng);
+    });
+}
+
+// The handshake is abandoned (and the key exchange socket shut down) if it takes longer than timeout,
+// not counting the waits the server asks for. The request offers this side's ranked suites (suite_offer)
+// and the key's suite is set to the one the server picked. The transient key material lives in arena;
+// the derived key and password go to the session key's own page.
+template <ByteStream Stream>
+bool key_exchange_client(Stream& keyex_socket, SessionKey& session_key, SessionArena& arena, std::chrono::milliseconds timeout)
+{
+    CipherSuite& suite = session_key.suite;
+    arena.wipe();   // Drop the key material of the previous handshake
     char data[2048];
     boost::system::error_code error;
+    std::optional<Deadline<Stream>> deadline;
+    deadline.emplace(keyex_socket, timeout);
 
-    // Send key-exchange initiation request
-    boost::asio::write(keyex_socket, boost::asio::buffer(KEYEX_INIT), error);
-    if (error) {
-        std::cerr << "Client: Error sending INIT_DHKE: " << error.message() << "\n";
-        if(error.message() == "Connection reset by peer")
-            exit(0);
-        return;
-    }
-    init_dhke_flag = true;
-    
+    // Send key-exchange initiation request until the server admits it (see HandshakeBucket)
+    std::string recv_data;
+    std::string offer = suite_offer();
+    session_key.offer = offer;
+    while(true)
+    {
+        std::string request = KEYEX_INIT + " " + offer;
+        boost::asio::write(keyex_socket, boost::asio::buffer(request), error);
+        if (error) {
+            std::cerr << "Client: Error sending INIT_DHKE: " << error.message() << "\n";
+            return false;
+        }
+        init_dhke_flag = true;
 
-    size_t length = keyex_socket.read_some(boost::asio::buffer(data), error);
-    if (error) {
-        std::cerr << "Client: Error reading INIT_DHKE_ACK: " << error.message() << "\n";
-        return;
+        size_t length = keyex_socket.read_some(boost::asio::buffer(data), error);
+        if (error) {
+            std::cerr << "Client: Error reading INIT_DHKE_ACK: " << (deadline->expired() ? "timed out" : error.message()) << "\n";
+            return false;
+        }
+        recv_data.assign(data, length);
+
+        if(recv_data.rfind(KEYEX_RETRY + ":", 0) != 0)
+            break;
+
+        // The wait comes from the server: anything but a number below the timeout ends the handshake
+        long wait_ms = -1;
+        std::string_view wait_text = std::string_view(recv_data).substr(KEYEX_RETRY.size() + 1);
+        auto [end, parse_error] = std::from_chars(wait_text.data(), wait_text.data() + wait_text.size(), wait_ms);
+        if(parse_error != std::errc() || end != wait_text.data() + wait_text.size() || wait_ms < 0) {
+            std::cerr << "Client: Malformed " << KEYEX_RETRY << " from the server\n";
+            return false;
+        }
+        if(std::chrono::milliseconds(wait_ms) >= timeout) {
+            std::cerr << "Client: Server too busy for a key exchange\n";
+            return false;
+        }
+        deadline.reset();
+        std::this_thread::sleep_for(std::chrono::milliseconds(wait_ms));
+        deadline.emplace(keyex_socket, timeout);    // The retry gets the whole timeout again
     }
 
-    std::string recv_data(data,length);
-    if(recv_data == KEYEX_INIT_ACK)
+    // The acknowledgement names the suite the server picked from the offer
+    std::optional<CipherSuite> chosen;
+    if(recv_data.rfind(KEYEX_INIT_ACK + " ", 0) == 0)
+        chosen = accept_suite(recv_data.substr(KEYEX_INIT_ACK.size() + 1));
+    if(recv_data == KEYEX_NO_SUITE)
+        std::cerr << "Client: The server accepts none of the offered cipher suites (" << offer << ")\n";
+    else if(!chosen)
+        std::cerr << "Client: Unexpected answer to INIT_DHKE: " << recv_data << "\n";
+
+    if(chosen)
     {
         init_dhke_ack_flag = false;
+        suite = *chosen;
 
         // Compute Client's DH key pair after receiving INIT_DHKE_ACK from the server
         Botan::AutoSeeded_RNG rng;
-        Botan::DL_Group domain("modp/ietf/1536");
         const std::string kdf = "SP800-56A(SHA-256)";
         
+        // Client generates the second DH key pair in the background while the first public keys are exchanged
+        auto client_private_key2_future = generate_async(suite.kex);
+
        // Client generates first DH key pair
-        Botan::DH_PrivateKey client_private_key1(rng, domain); // a
+        std::shared_ptr<const Botan::PK_Key_Agreement_Key> client_private_key1_ptr = new_agreement_key(suite.kex, rng);
+        const Botan::PK_Key_Agreement_Key& client_private_key1 = *client_private_key1_ptr; // a
         auto client_public_key1 = client_private_key1.public_value();  // A = g^a 
         crypto::send_pubkey(keyex_socket, Botan::hex_encode(client_public_key1));
         client_pk_sent = true;
@@ -66,42 +159,49 @@ void key_exchange_client(tcp::socket& keyex_socket, Botan::secure_vector<uint8_t
         // Compute the password to unlock the signature
         Botan::PK_Key_Agreement dig_sign_key_agreement(client_private_key1, rng, kdf);
         auto dig_sign_key = dig_sign_key_agreement.derive_key(32, server_public_key1).bits_of();
-        ds_pass = Botan::hex_encode(dig_sign_key);
+        assign_hex(session_key.ds_pass, dig_sign_key);
 
-        // Client generates second DH key pair
-        Botan::DH_PrivateKey client_private_key2(rng, domain); // x
+        // Client's second DH key pair
+        std::shared_ptr<const Botan::PK_Key_Agreement_Key> client_private_key2_ptr = client_private_key2_future.get();
+        const Botan::PK_Key_Agreement_Key& client_private_key2 = *client_private_key2_ptr; // x
         auto client_public_key2 = client_private_key2.public_value(); // X = g^x
         crypto::send_pubkey(keyex_socket, Botan::hex_encode(client_public_key2));
         auto server_public_key2 = Botan::hex_decode(crypto::receive_pubkey(keyex_socket)); // Y = g^y
 
-        // Key agreement for S1, S2, S3
-        Botan::PK_Key_Agreement client_key1(client_private_key1, rng, kdf);
-        Botan::PK_Key_Agreement client_key2(client_private_key2, rng, kdf);
-
-        auto shared_key1 = client_key1.derive_key(32, server_public_key2).bits_of(); // S1 = Y^a
-        auto shared_key2 = client_key2.derive_key(32, server_public_key1).bits_of(); // S2 = B^x
-        auto shared_key3 = client_key2.derive_key(32, server_public_key2).bits_of(); // S3 = Y^x
+        // Key agreement for S1, S2, S3 in parallel
+        auto shared_key1_future = derive_async(client_private_key1_ptr, server_public_key2, kdf); // S1 = Y^a
+        auto shared_key2_future = derive_async(client_private_key2_ptr, server_public_key1, kdf); // S2 = B^x
+        auto shared_key3_future = derive_async(client_private_key2_ptr, server_public_key2, kdf); // S3 = Y^x
+        auto shared_key1 = shared_key1_future.get();
+        auto shared_key2 = shared_key2_future.get();
+        auto shared_key3 = shared_key3_future.get();
 
-        // Concatenate shared keys and hash
-        Botan::secure_vector<uint8_t> key;
+        // Concatenate shared keys and hash, both in the session's locked arena
+        arena_vector<uint8_t> key{ArenaAllocator<uint8_t>(arena)};
+        key.reserve(shared_key1.size() + shared_key2.size() + shared_key3.size());
         key.insert(key.end(), shared_key1.begin(), shared_key1.end());
         key.insert(key.end(), shared_key2.begin(), shared_key2.end());
         key.insert(key.end(), shared_key3.begin(), shared_key3.end());
 
         auto hash = Botan::HashFunction::create_or_throw("SHA-512");
         hash->update(key.data(), key.size());
-        auto key_hash = hash->final();
-        ds_pass = Botan::hex_encode(key_hash);
-
-        auto kdf2 = Botan::KDF::create_or_throw("SP800-56A(SHA-256)");
-        shared_key = kdf2->derive_key(32,key_hash);
-
-        key_exchange_status_client = true;
+        arena_vector<uint8_t> key_hash(hash->output_length(), 0, ArenaAllocator<uint8_t>(arena));
+        hash->final(key_hash.data());
+        assign_hex(session_key.ds_pass, key_hash);
+        derive_record_key(session_key, key_hash);
+        return true;
     }
+    return false;
 }   
 
-void key_exchange_server(tcp::socket& keyex_socket, Botan::secure_vector<uint8_t>& shared_key, std::string& ds_pass)
+// Waits for the client's request as long as it takes; from then on the handshake is bounded by timeout.
+// The key's suite is set to the best suite of the client's offer by both sides' rankings (choose_suite).
+// bucket is the session's handshake rate limit, kept by the caller from one handshake to the next.
+template <ByteStream Stream>
+bool key_exchange_server(Stream& keyex_socket, SessionKey& session_key, HandshakeBucket& bucket, SessionArena& arena, std::chrono::milliseconds timeout)
 {
+    CipherSuite& suite = session_key.suite;
+    arena.wipe();   // Drop the key material of the previous handshake
     char data[2048];
     boost::system::error_code error;
     
@@ -110,29 +210,73 @@ void key_exchange_server(tcp::socket& keyex_socket, Botan::secure_vector<uint8_t
     size_t length = keyex_socket.read_some(boost::asio::buffer(data), error);
     if (error) {
         std::cerr << "Server: Error reading INIT_DHKE: " << error.message() << "\n";
-        return;
+        return false;
     }
     std::string recv_data(data,length);
-    
-    // Send INIT_DHKE_ACK back to the client to initiate key exchange
-    if(recv_data == KEYEX_INIT)
+    std::optional<Deadline<Stream>> deadline;
+    deadline.emplace(keyex_socket, timeout);
+
+    // No DH work before the request is admitted: the peer must be within its handshake rate,
+    // otherwise it is asked to retry
+    std::string offer;
+    while(true)
     {
-        boost::asio::write(keyex_socket, boost::asio::buffer(KEYEX_INIT_ACK), error);
+        // The suite offer follows a space; a client that sends none only has the original suite
+        std::size_t space = recv_data.find(' ');
+        offer = space == std::string::npos ? "" : recv_data.substr(space + 1);
+        recv_data.resize(std::min(space, recv_data.size()));
+        if(recv_data != KEYEX_INIT)
+            return false;
+
+        auto wait = bucket.admit();
+        if(wait.count() == 0)
+            break;
+        std::string reply = KEYEX_RETRY + ":" + std::to_string(wait.count());
+
+        boost::asio::write(keyex_socket, boost::asio::buffer(reply), error);
+        if (!error)
+        {
+            deadline.reset();
+            deadline.emplace(keyex_socket, timeout + wait);     // The client waits, then gets the whole timeout again
+            length = keyex_socket.read_some(boost::asio::buffer(data), error);
+        }
         if (error) {
-            std::cerr << "Server: Error sending INIT_DHKE_ACK: " << error.message() << "\n";
-            return;
+            std::cerr << "Server: Error admitting INIT_DHKE: " << (deadline->expired() ? "timed out" : error.message()) << "\n";
+            return false;
         }
-        init_dhke_ack_flag = true;  
-        init_dhke_flag = false;     // Set this flag back to false
-    } else return;
+        recv_data.assign(data, length);
+    }
+    
+    std::optional<CipherSuite> chosen = choose_suite(offer);
+    if(!chosen)
+    {
+        std::cerr << "Server: No cipher suite in common with the client's offer (" << offer << ")\n";
+        boost::asio::write(keyex_socket, boost::asio::buffer(KEYEX_NO_SUITE), error);
+        return false;
+    }
+    suite = *chosen;
+    session_key.offer = offer;
+
+    // Send INIT_DHKE_ACK back to the client to initiate key exchange, naming the suite to a client that offered some
+    std::string ack = offer.empty() ? KEYEX_INIT_ACK : KEYEX_INIT_ACK + " " + suite_name(suite);
+    boost::asio::write(keyex_socket, boost::asio::buffer(ack), error);
+    if (error) {
+        std::cerr << "Server: Error sending INIT_DHKE_ACK: " << error.message() << "\n";
+        return false;
+    }
+    init_dhke_ack_flag = true;  
+    init_dhke_flag = false;     // Set this flag back to false
 
     // Compute server side's public key 
     Botan::AutoSeeded_RNG rng;
-    Botan::DL_Group domain("modp/ietf/1536");
     const std::string kdf = "SP800-56A(SHA-256)";
 
+    // Server generates the second DH key pair in the background while the first public keys are exchanged
+    auto server_private_key2_future = generate_async(suite.kex);
+
     // Server generates first DH key pair
-    Botan::DH_PrivateKey server_private_key1(rng, domain);   // b
+    std::shared_ptr<const Botan::PK_Key_Agreement_Key> server_private_key1_ptr = new_agreement_key(suite.kex, rng);
+    const Botan::PK_Key_Agreement_Key& server_private_key1 = *server_private_key1_ptr;   // b
     auto server_public_key1 = server_private_key1.public_value();   // B = g^b
 
     // Receive the client's public key and send the computed server's public key
@@ -143,37 +287,68 @@ void key_exchange_server(tcp::socket& keyex_socket, Botan::secure_vector<uint8_t
 
     // Compute the password for unlocking the digital signature
     Botan::PK_Key_Agreement dig_sign_key_agreement(server_private_key1, rng, kdf);
-    auto dig_sign_key = dig_sign_key_agreement.derive_key(32, client_public_key1);
-    ds_pass = Botan::hex_encode(dig_sign_key);
+    auto dig_sign_key = dig_sign_key_agreement.derive_key(32, client_public_key1).bits_of();
+    assign_hex(session_key.ds_pass, dig_sign_key);
 
-    // Server generates second DH key pair
-    Botan::DH_PrivateKey server_private_key2(rng, domain);   // y
+    // Server's second DH key pair
+    std::shared_ptr<const Botan::PK_Key_Agreement_Key> server_private_key2_ptr = server_private_key2_future.get();
+    const Botan::PK_Key_Agreement_Key& server_private_key2 = *server_private_key2_ptr;   // y
     auto server_public_key2 = server_private_key2.public_value(); // Y = g^y
     auto client_public_key2 = Botan::hex_decode(crypto::receive_pubkey(keyex_socket)); // X = g^x
     crypto::send_pubkey(keyex_socket, Botan::hex_encode(server_public_key2));
 
-    // Key agreement for S1, S2, S3
-    Botan::PK_Key_Agreement server_key1(server_private_key1, rng, kdf);
-    Botan::PK_Key_Agreement server_key2(server_private_key2, rng, kdf);
+    // Key agreement for S1, S2, S3 in parallel
+    auto shared_key1_future = derive_async(server_private_key2_ptr, client_public_key1, kdf);  // S1 = A^y
+    auto shared_key2_future = derive_async(server_private_key1_ptr, client_public_key2, kdf);  // S2 = X^b
+    auto shared_key3_future = derive_async(server_private_key2_ptr, client_public_key2, kdf);  // S3 = X^y
+    auto shared_key1 = shared_key1_future.get();
+    auto shared_key2 = shared_key2_future.get();
+    auto shared_key3 = shared_key3_future.get();
 
-    auto shared_key1 = server_key2.derive_key(32, client_public_key1).bits_of();  // S1 = A^y
-    auto shared_key2 = server_key1.derive_key(32, client_public_key2).bits_of();  // S2 = X^b
-    auto shared_key3 = server_key2.derive_key(32, client_public_key2).bits_of();  // S3 = X^y
-
-    // Concatenate shared keys and hash
-    Botan::secure_vector<uint8_t> key;
+    // Concatenate shared keys and hash, both in the session's locked arena
+    arena_vector<uint8_t> key{ArenaAllocator<uint8_t>(arena)};
+    key.reserve(shared_key1.size() + shared_key2.size() + shared_key3.size());
     key.insert(key.end(), shared_key1.begin(), shared_key1.end());
     key.insert(key.end(), shared_key2.begin(), shared_key2.end());
     key.insert(key.end(), shared_key3.begin(), shared_key3.end());
 
     auto hash = Botan::HashFunction::create_or_throw("SHA-512");
     hash->update(key.data(), key.size());
-    auto key_hash = hash->final();
-    ds_pass = Botan::hex_encode(key_hash);
+    arena_vector<uint8_t> key_hash(hash->output_length(), 0, ArenaAllocator<uint8_t>(arena));
+    hash->final(key_hash.data());
+    assign_hex(session_key.ds_pass, key_hash);
+    derive_record_key(session_key, key_hash);
+    return true;
+}
 
-    auto kdf2 = Botan::KDF::create_or_throw("SP800-56A(SHA-256)");
-    shared_key = kdf2->derive_key(32,key_hash);
-    key_exchange_status_server = true;
+// Key confirmation: each side proves it derived the same key for this epoch before switching to it.
+// The tag also covers the negotiation, the client's offer as this side saw it and the suite chosen
+// from it, so an offer stripped down to weaker suites on the way fails the confirmation.
+std::string key_confirmation_tag(const SessionKey& session_key, const std::string& role)
+{
+    return crypto::compute_mac(KEYEX_CONFIRM + ":" + role + ":" + std::to_string(session_key.epoch) + ":" + session_key.offer + ":"
+                               + suite_name(session_key.suite), session_key.key);
+}
+
+bool same_tag(const std::string& a, const std::string& b)
+{
+    return a.size() == b.size() && Botan::constant_time_compare(reinterpret_cast<const uint8_t*>(a.data()), reinterpret_cast<const uint8_t*>(b.data()), a.size());
+}
+
+template <ByteStream Stream>
+bool confirm_key_client(Stream& keyex_socket, const SessionKey& session_key)
+{
+    crypto::send_pubkey(keyex_socket, key_confirmation_tag(session_key, "client"));
+    return same_tag(crypto::receive_pubkey(keyex_socket), key_confirmation_tag(session_key, "server"));
+}
+
+template <ByteStream Stream>
+bool confirm_key_server(Stream& keyex_socket, const SessionKey& session_key)
+{
+    if (!same_tag(crypto::receive_pubkey(keyex_socket), key_confirmation_tag(session_key, "client")))
+        return false;
+    crypto::send_pubkey(keyex_socket, key_confirmation_tag(session_key, "server"));
+    return true;
 }
 
 
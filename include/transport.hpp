@@ -0,0 +1,21 @@
+#ifndef TRANSPORT_HPP
+#define TRANSPORT_HPP
+
+#include <boost/asio.hpp>
+#include <concepts>
+#include <cstddef>
+
+// What the key exchange and the framing need from a connection: Asio's synchronous stream operations
+// (so boost::asio::read and write work on it), waiting for input, shutdown and the peer's address.
+// tcp::socket is one; SimStream (simnet.hpp) is an in-process one for profiling the protocol.
+template <class Stream>
+concept ByteStream = requires(Stream& stream, boost::system::error_code& error, boost::asio::mutable_buffer in, boost::asio::const_buffer out)
+{
+    { stream.read_some(in, error) } -> std::convertible_to<std::size_t>;
+    { stream.write_some(out, error) } -> std::convertible_to<std::size_t>;
+    stream.wait(boost::asio::ip::tcp::socket::wait_read);
+    stream.shutdown(boost::asio::ip::tcp::socket::shutdown_both, error);
+    { stream.remote_endpoint(error) } -> std::convertible_to<boost::asio::ip::tcp::endpoint>;
+};
+
+#endif
@@ -0,0 +1,132 @@
+#ifndef URING_HPP
+#define URING_HPP
+
+// Only built with -DDENIM_IO_URING=ON (CMake) or IO_URING=1 (make), which also switches Boost.Asio
+// from epoll to its io_uring backend
+#ifdef DENIM_IO_URING
+
+#include <boost/asio.hpp>
+#include <boost/version.hpp>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+#include "executor.hpp"
+
+#if BOOST_VERSION < 107800
+#error "The io_uring build needs Boost 1.78 or newer, for registered buffers"
+#endif
+
+#define URING_FRAME_BUFFERS 16                  // Frames that can be in flight at once
+#define URING_FRAME_BUFFER_SIZE (64u << 10)     // Larger frames fall back to unregistered buffers
+
+// Frame buffers registered with an io_context's ring once, so that the framed reads and writes use
+// fixed-buffer io_uring operations instead of mapping the user pages on every call
+class RegisteredFramePool
+{
+    using Registration = boost::asio::buffer_registration<std::vector<boost::asio::mutable_buffer>>;
+
+    boost::asio::io_context& io_context;
+    std::vector<std::vector<char>> storage;
+    std::optional<Registration> registration;
+    std::vector<std::size_t> free_list;
+    std::once_flag registered;
+    std::mutex mtx;
+    std::condition_variable cv;
+
+    void register_buffers()
+    {
+        std::vector<boost::asio::mutable_buffer> buffers;
+        for (std::size_t i = 0; i < URING_FRAME_BUFFERS; i++)
+        {
+            storage.emplace_back(URING_FRAME_BUFFER_SIZE);
+            buffers.push_back(boost::asio::buffer(storage.back()));
+            free_list.push_back(i);
+        }
+        registration.emplace(boost::asio::register_buffers(io_context, buffers));
+    }
+
+    void release(std::size_t index)
+    {
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            free_list.push_back(index);
+        }
+        cv.notify_one();
+    }
+
+public:
+    explicit RegisteredFramePool(boost::asio::io_context& io_context) : io_context(io_context) {}
+
+    // A registered buffer held for one frame, returned to the pool on destruction
+    class Lease
+    {
+        RegisteredFramePool* pool;
+        std::size_t index;
+
+    public:
+        Lease(RegisteredFramePool* pool, std::size_t index) : pool(pool), index(index) {}
+        Lease(Lease&& other) noexcept : pool(std::exchange(other.pool, nullptr)), index(other.index) {}
+        Lease(const Lease&) = delete;
+        Lease& operator=(const Lease&) = delete;
+        ~Lease()
+        {
+            if (pool)
+                pool->release(index);
+        }
+
+        boost::asio::mutable_registered_buffer buffer(std::size_t size) const
+        {
+            return boost::asio::buffer((*pool->registration)[index], size);
+        }
+
+        char* data() const
+        {
+            return pool->storage[index].data();
+        }
+    };
+
+    // Waits while every buffer is in flight
+    Lease acquire()
+    {
+        std::call_once(registered, [this]() { register_buffers(); });
+
+        std::unique_lock<std::mutex> lock(mtx);
+        cv.wait(lock, [this]() { return !free_list.empty(); });
+        std::size_t index = free_list.back();
+        free_list.pop_back();
+        return Lease(this, index);
+    }
+
+    // For a thread of the ring's own shard, which must not wait for a buffer that only it can release
+    std::optional<Lease> try_acquire()
+    {
+        std::call_once(registered, [this]() { register_buffers(); });
+
+        std::lock_guard<std::mutex> lock(mtx);
+        if (free_list.empty())
+            return std::nullopt;
+        std::size_t index = free_list.back();
+        free_list.pop_back();
+        return Lease(this, index);
+    }
+};
+
+// Registered buffers belong to one ring, so every I/O shard has a pool of its own
+RegisteredFramePool& registered_frames(boost::asio::io_context& io_context)
+{
+    static std::mutex mtx;
+    static std::unordered_map<boost::asio::io_context*, std::unique_ptr<RegisteredFramePool>> pools;
+    std::lock_guard<std::mutex> lock(mtx);
+    auto& pool = pools[&io_context];
+    if (!pool)
+        pool = std::make_unique<RegisteredFramePool>(io_context);
+    return *pool;
+}
+
+#endif
+
+#endif
@@ -3,11 +3,40 @@
 #include <iostream>
 #include <string>
 #include <atomic>
+#include <cstdlib>
+#include <cstring>
+#include <optional>
+#include <type_traits>
 #include <include/server.hpp>
 #include <include/client.hpp>
+#include <include/retention.hpp>
+#include <include/calibrate.hpp>
 
 using tcp = boost::asio::ip::tcp;
 
+// Value of a numeric setting, or nothing if it is unset; a malformed value is reported and the default kept
+template <class T>
+std::optional<T> env_number(const char* name)
+{
+    const char* text = std::getenv(name);
+    if(text == nullptr)
+        return std::nullopt;
+    try
+    {
+        std::size_t used = 0;
+        T value{};
+        if constexpr (std::is_floating_point_v<T>)
+            value = std::stod(text, &used);
+        else if(text[0] != '-')
+            value = static_cast<T>(std::stoul(text, &used));
+        if(used > 0 && used == std::strlen(text))
+            return value;
+    } catch(std::exception&) {
+    }
+    std::cerr<<"Invalid "<<name<<" "<<text<<", keeping the default\n";
+    return std::nullopt;
+}
+
 void setup_mode()
 {
     std::cout<<"Welcome to DenIM!\n";
@@ -24,14 +53,15 @@ void setup_mode()
         std::getline(std::cin,mode);
         if(mode == "1")
         {
+            security_mode = SecurityMode::Deniable;
             return;
         } else if(mode == "2")
         {
-            edit_enabled = true;
+            security_mode = SecurityMode::UltraDeniable;
             return;
         } else if(mode == "3")
         {
-            ds_enabled = true;
+            security_mode = SecurityMode::NonDeniable;
             return;
         } else if(mode == "man")
         {
@@ -43,23 +73,155 @@ void setup_mode()
     }
 }
 
+// Picks the message history storage, e.g. DENIM_LOG_BACKEND=mmap DENIM_LOG_CACHE=64 ./denim
+void setup_log_backend()
+{
+    const char* backend = std::getenv("DENIM_LOG_BACKEND");
+    if(backend != nullptr && std::string(backend) == "mmap")
+        log_backend = LogBackend::Mmap;
+    else if(backend != nullptr && std::string(backend) != "sqlite")
+        std::cerr<<"Unknown DENIM_LOG_BACKEND "<<backend<<", using sqlite\n";
+
+    const char* layout = std::getenv("DENIM_LOG_LAYOUT");
+    if(layout != nullptr && std::string(layout) == "consolidated")
+        log_layout = LogLayout::Consolidated;
+    else if(layout != nullptr && std::string(layout) != "per-peer")
+        std::cerr<<"Unknown DENIM_LOG_LAYOUT "<<layout<<", using per-peer\n";
+
+    if(auto cache = env_number<std::size_t>("DENIM_LOG_CACHE"))
+        log_cache_capacity = *cache;
+}
+
+// Backpressure of the outgoing queues in bytes, e.g. DENIM_SEND_HIGH_WATER=4194304 ./denim
+void setup_send_queue()
+{
+    if(auto high = env_number<std::size_t>("DENIM_SEND_HIGH_WATER"))
+        send_high_water = *high;
+
+    if(auto low = env_number<std::size_t>("DENIM_SEND_LOW_WATER"))
+        send_low_water = *low;
+}
+
+// Liveness checks, e.g. DENIM_HEARTBEAT_MS=2000 DENIM_PEER_TIMEOUT_MS=6000 ./denim
+void setup_heartbeat()
+{
+    if(auto timeout = env_number<unsigned long>("DENIM_PEER_TIMEOUT_MS"))
+    {
+        if(*timeout > 0)
+            peer_timeout = std::chrono::milliseconds(*timeout);
+        else
+            std::cerr<<"Invalid DENIM_PEER_TIMEOUT_MS 0, keeping the default\n";
+    }
+
+    // A zero interval would re-arm the shard's timer without pause, and one at or above the timeout
+    // would let the peer give up on this side between two pings
+    if(auto interval = env_number<unsigned long>("DENIM_HEARTBEAT_MS"))
+    {
+        if(*interval > 0 && std::chrono::milliseconds(*interval) < peer_timeout)
+            heartbeat_interval = std::chrono::milliseconds(*interval);
+        else
+            std::cerr<<"Invalid DENIM_HEARTBEAT_MS "<<*interval<<", it has to be above 0 and below the peer timeout ("<<peer_timeout.count()<<" ms)\n";
+    }
+
+    // Only the timeout was lowered: ping three times per timeout, like the defaults
+    if(heartbeat_interval >= peer_timeout)
+        heartbeat_interval = std::max(std::chrono::milliseconds(1), peer_timeout / 3);
+}
+
+// Data transport of the sessions, e.g. DENIM_TRANSPORT=udp DENIM_UDP_LOSS=0.05 ./denim
+void setup_transport()
+{
+    const char* transport = std::getenv("DENIM_TRANSPORT");
+    if(transport != nullptr && std::string(transport) == "udp")
+        data_transport = DataTransport::Udp;
+    else if(transport != nullptr && std::string(transport) != "tcp")
+        std::cerr<<"Unknown DENIM_TRANSPORT "<<transport<<", using tcp\n";
+
+    if(auto loss = env_number<double>("DENIM_UDP_LOSS"))
+        datagram_loss = *loss;
+}
+
+// Key exchange admission, e.g. DENIM_HANDSHAKE_RATE=1 DENIM_HANDSHAKE_BURST=4 ./denim
+void setup_handshake_limits()
+{
+    if(auto rate = env_number<double>("DENIM_HANDSHAKE_RATE"))
+        handshake_rate = *rate;
+
+    if(auto burst = env_number<double>("DENIM_HANDSHAKE_BURST"))
+        handshake_burst = std::max(1.0, *burst);
+}
+
+// I/O shards, e.g. DENIM_IO_SHARDS=4 DENIM_PIN_THREADS=1 ./denim
+void setup_io_shards()
+{
+    if(auto shards = env_number<std::size_t>("DENIM_IO_SHARDS"))
+        io_shard_count = *shards;
+
+    const char* pin = std::getenv("DENIM_PIN_THREADS");
+    if(pin != nullptr)
+        pin_threads = std::string(pin) == "1";
+}
+
+// History retention per peer, e.g. DENIM_RETAIN_DAYS=30 DENIM_RETAIN_ROWS=100000 DENIM_RETAIN_BYTES=67108864 ./denim
+void setup_retention()
+{
+    if(auto days = env_number<double>("DENIM_RETAIN_DAYS"))
+        retention_policy.max_age = static_cast<int64_t>(std::max(0.0, *days) * 86400e6);
+
+    if(auto rows = env_number<std::size_t>("DENIM_RETAIN_ROWS"))
+        retention_policy.max_rows = *rows;
+
+    if(auto bytes = env_number<std::size_t>("DENIM_RETAIN_BYTES"))
+        retention_policy.max_bytes = *bytes;
+
+    if(auto interval = env_number<unsigned long>("DENIM_MAINTENANCE_S"))
+        maintenance_interval = std::chrono::seconds(std::max<unsigned long>(1, *interval));
+}
+
+// Cipher suites, e.g. DENIM_CIPHER=chacha20poly1305 DENIM_KEX=x25519,p256 ./denim; DENIM_RECALIBRATE=1 measures again
+void setup_crypto_suites()
+{
+    const char* cipher = std::getenv("DENIM_CIPHER");
+    if(cipher != nullptr)
+        cipher_override = cipher;
+
+    const char* kex = std::getenv("DENIM_KEX");
+    if(kex != nullptr)
+        kex_override = kex;
+
+    const char* recalibrate = std::getenv("DENIM_RECALIBRATE");
+    if(recalibrate != nullptr)
+        force_recalibration = std::string(recalibrate) == "1";
+}
+
 int main() 
 {
     setup_mode();
+    setup_log_backend();
+    setup_send_queue();
+    setup_heartbeat();
+    setup_transport();
+    setup_handshake_limits();
+    setup_retention();
+    setup_io_shards();
+    setup_crypto_suites();
 
-    boost::asio::io_context io_context;
+    executor.start();      // Worker pools and I/O shards shared by every session
     std::string address, port;
     boost::filesystem::create_directories("../lib/logs");   // Creates a directory to hold the message DBs
+    calibrate_suites();     // Ranks the cipher suites for this host, cached in ../lib
+    history_maintenance.start();
 
     std::cout << "Enter host IP address: ";
     std::getline(std::cin, address);
     std::cout << "Enter host port: ";
     std::getline(std::cin, port);
 
-    std::thread server_thread([&io_context, address, port]() {      // Server thread
-        server(io_context, address, port);
-    });
-    server_thread.join();
+    server(executor.io(), address, port);
 
+    // The session is over, or the user quit: stop the background work and join every thread
+    history_maintenance.stop();
+    mmap_flusher().stop();
+    executor.shutdown();
     return 0;
 }
@@ -0,0 +1,409 @@
+#include <boost/asio.hpp>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <ctime>
+#include <new>
+#include <iostream>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <include/simnet.hpp>
+#include <include/tdh.hpp>
+#include <include/packet.hpp>
+#include <include/readwrite.hpp>
+#include <include/group.hpp>
+
+// Protocol benchmark over the in-process simulated network: runs many sessions (3DH, key
+// confirmation, then a burst of messages) with no sockets and no terminal, so the CPU cost
+// of the protocol can be profiled apart from the kernel, e.g.
+//   ./simbench sessions=2000 concurrency=32 messages=20 latency_us=500 bandwidth=1e6 loss=0.01 seed=7
+// mode= picks the security mode of the sessions (deniable, ultra, non), or mixed to cycle through all three.
+// transport=tcp runs the sessions over loopback TCP connections instead, with the messages sent through
+// each connection's SendQueue like in a real session; comparing shards=1 with shards=<cores> (and pin=1)
+// shows how the I/O shards scale, e.g.
+//   ./simbench transport=tcp sessions=200 concurrency=64 messages=2000 shards=1
+// The io_uring build of the same benchmark (simbench_uring) runs it on io_uring with registered frame
+// buffers instead of epoll, so the two backends compare on the same arguments.
+// cipher= and kex= restrict the suites both ends offer (comma-separated, best first), so the suites can
+// be compared end to end, e.g.
+//   ./simbench messages=1000 size=1024 cipher=chacha20poly1305 kex=p256
+// group=<members> instead forms one group room over loopback TCP, a pairwise session with each member,
+// and times the fan-out of the broadcasts; workers= sets the CPU pool the room encrypts on, e.g.
+//   ./simbench group=100 messages=200 workers=1 vs workers=<cores>
+// Every run also reports the heap allocations of the message path and the key arena counters.
+
+using bench_clk = std::chrono::steady_clock;
+
+#define SIMBENCH_TIMEOUT std::chrono::milliseconds(60000)      // Per handshake; the simulated links never drop a session
+
+// Backend the loopback TCP sessions run on, chosen at build time
+#ifdef DENIM_IO_URING
+#define SIMBENCH_IO_BACKEND "io_uring"
+#else
+#define SIMBENCH_IO_BACKEND "epoll"
+#endif
+
+// Heap allocations made by the calling thread, counted by the replaced operator new
+thread_local std::size_t thread_allocations = 0;
+
+void* operator new(std::size_t size)
+{
+    thread_allocations++;
+    if (void* p = std::malloc(size ? size : 1))
+        return p;
+    throw std::bad_alloc();
+}
+
+void operator delete(void* p) noexcept
+{
+    std::free(p);
+}
+
+void operator delete(void* p, std::size_t) noexcept
+{
+    std::free(p);
+}
+
+// Heap allocations of the message path alone (sealing and framing, parsing and opening), over all sessions
+std::atomic<std::size_t> seal_allocations = 0;
+std::atomic<std::size_t> open_allocations = 0;
+
+// Counters of the locked key arenas and the crypto buffers (arena_stats), read before and after a run
+struct ArenaCounts
+{
+    std::size_t slab, heap, growths;
+};
+
+ArenaCounts arena_counts()
+{
+    return {arena_stats.slab_allocations, arena_stats.heap_allocations, arena_stats.buffer_growths};
+}
+
+void print_arena_delta(const ArenaCounts& start)
+{
+    ArenaCounts now = arena_counts();
+    std::cout << "Key arenas " << now.slab - start.slab << " slab allocation(s), " << now.heap - start.heap << " fell back to the heap; "
+              << now.growths - start.growths << " crypto buffer growth(s)\n";
+}
+
+struct BenchResult
+{
+    bool ok = false;
+    double handshake_ms = 0;
+    std::size_t queue_peak = 0;     // Over TCP: the most frames the client's SendQueue held at once
+};
+
+// Runs one session over a connected pair of streams. The client's messages go through outbound if
+// given, and are written to the stream directly otherwise.
+template <class Mode, ByteStream Stream>
+BenchResult run_session(Stream& client, Stream& server, FrameQueue* outbound, std::size_t index, std::size_t messages, std::size_t message_size)
+{
+    std::atomic<bool> server_ok = false;
+    std::thread server_side([&, shard = current_shard]() {
+        ShardScope session_shard(shard);
+        try
+        {
+            SessionArena arena;
+            SessionKey key{1};
+            HandshakeBucket bucket;
+            if (!key_exchange_server(server, key, bucket, arena, SIMBENCH_TIMEOUT) || !confirm_key_server(server, key))
+                return;
+            FrameBuffer buffer;
+            for (std::size_t i = 0; i < messages; i++)
+            {
+                std::string_view body = read_data_packet(server, buffer);
+                std::size_t allocations = thread_allocations;
+                PacketView<typename Mode::Packet> msg_pkt;
+                if (!msg_pkt.parse(body))
+                    return;
+                open_packet<Mode>(msg_pkt, key);
+                open_allocations += thread_allocations - allocations;
+            }
+            server_ok = true;
+        } catch (std::exception& e) {
+            std::cerr << "Session " << index << " server: " << e.what() << "\n";
+        }
+    });
+
+    BenchResult result;
+    try
+    {
+        SessionArena arena;
+        SessionKey key{1};
+        auto start = bench_clk::now();
+        if (key_exchange_client(client, key, arena, SIMBENCH_TIMEOUT) && confirm_key_client(client, key))
+        {
+            result.handshake_ms = std::chrono::duration<double, std::milli>(bench_clk::now() - start).count();
+            std::string message(message_size, 'm');
+            result.ok = true;
+            for (std::size_t i = 0; i < messages && result.ok; i++)
+            {
+                std::size_t allocations = thread_allocations;
+                std::string frame = serialize_packet(seal_packet<Mode>(message, key));
+                seal_allocations += thread_allocations - allocations;
+                if (outbound)
+                    result.ok = outbound->enqueue(std::move(frame));
+                else
+                    boost::asio::write(client, boost::asio::buffer(frame));
+            }
+            if (outbound)
+                result.ok = result.ok && outbound->wait_drained();
+        }
+    } catch (std::exception& e) {
+        std::cerr << "Session " << index << " client: " << e.what() << "\n";
+    }
+
+    server_side.join();
+    result.ok = result.ok && server_ok;
+    return result;
+}
+
+template <class Mode>
+BenchResult sim_session(SimNetwork& network, std::size_t index, std::size_t messages, std::size_t message_size)
+{
+    // Every client has an address of its own
+    auto client_address = boost::asio::ip::make_address_v4(0x0A000000u + static_cast<uint32_t>(index));
+    auto [client, server] = network.connect(tcp::endpoint(client_address, 40000), tcp::endpoint(boost::asio::ip::make_address("10.255.255.254"), 9000));
+    return run_session<Mode>(*client, *server, nullptr, index, messages, message_size);
+}
+
+// Both ends of the connection are on the session's shard, so its writes complete there
+template <class Mode>
+BenchResult tcp_session(tcp::acceptor& acceptor, std::mutex& accept_mtx, std::size_t index, std::size_t messages, std::size_t message_size)
+{
+    auto client = std::make_shared<tcp::socket>(executor.io());
+    auto server = std::make_shared<tcp::socket>(executor.io());
+    try
+    {
+        // One connection at a time, so the accepted one is this client's
+        std::lock_guard<std::mutex> lock(accept_mtx);
+        client->connect(acceptor.local_endpoint());
+        acceptor.accept(*server);
+        client->set_option(tcp::no_delay(true));
+    } catch (std::exception& e) {
+        std::cerr << "Session " << index << " connect: " << e.what() << "\n";
+        return {};
+    }
+    auto outbound = std::make_shared<SendQueue>(client);
+    BenchResult result = run_session<Mode>(*client, *server, outbound.get(), index, messages, message_size);
+    result.queue_peak = outbound->peak_depth();
+    return result;
+}
+
+// One room: the sender holds a pairwise session with every member and broadcasts the messages, each
+// member reads and verifies them on a thread of its own. Returns the seconds from the first broadcast
+// until every member has verified every message, or a negative value if a member failed.
+double group_bench(tcp::acceptor& acceptor, std::size_t member_count, std::size_t messages, std::size_t message_size)
+{
+    struct Member
+    {
+        std::shared_ptr<tcp::socket> sender_end = std::make_shared<tcp::socket>(executor.io());
+        tcp::socket member_end{executor.io()};
+        std::shared_ptr<SessionKey> sender_key = std::make_shared<SessionKey>(1);
+        SessionKey member_key{1};
+        std::atomic<bool> ok = false;
+    };
+
+    GroupRoom room("simbench");
+    std::vector<std::unique_ptr<Member>> members;
+    for (std::size_t i = 0; i < member_count; i++)
+    {
+        auto member = std::make_unique<Member>();
+        member->sender_end->connect(acceptor.local_endpoint());
+        acceptor.accept(member->member_end);
+        member->sender_end->set_option(tcp::no_delay(true));
+
+        Member& m = *member;
+        std::thread member_side([&m]() {
+            SessionArena arena;
+            HandshakeBucket bucket;
+            m.ok = key_exchange_server(m.member_end, m.member_key, bucket, arena, SIMBENCH_TIMEOUT)
+                && confirm_key_server(m.member_end, m.member_key);
+        });
+        SessionArena arena;
+        bool sender_ok = key_exchange_client(*m.sender_end, *m.sender_key, arena, SIMBENCH_TIMEOUT)
+            && confirm_key_client(*m.sender_end, *m.sender_key);
+        member_side.join();
+        if (!sender_ok || !m.ok)
+            return -1;
+
+        room.add_member<DeniableMode>("member" + std::to_string(i), std::make_shared<SendQueue>(m.sender_end), m.sender_key,
+                        std::make_shared<SqliteLogStore>(":memory:"));
+        m.ok = false;
+        members.push_back(std::move(member));
+    }
+
+    std::vector<std::thread> readers;
+    for (auto& member : members)
+        readers.emplace_back([&m = *member, messages]() {
+            try
+            {
+                Deadline deadline(m.member_end, SIMBENCH_TIMEOUT);     // A member dropped from the room gets nothing more
+                FrameBuffer buffer;
+                for (std::size_t i = 0; i < messages; i++)
+                {
+                    PacketView<Message> msg_pkt;
+                    if (!msg_pkt.parse(read_data_packet(m.member_end, buffer)) || msg_pkt.get_group_id() != "simbench")
+                        return;
+                    open_packet<DeniableMode>(msg_pkt, m.member_key);
+                }
+                m.ok = true;
+            } catch (std::exception& e) {
+                std::cerr << "Group member: " << e.what() << "\n";
+            }
+        });
+
+    std::string message(message_size, 'm');
+    auto start = bench_clk::now();
+    for (std::size_t i = 0; i < messages; i++)
+        room.broadcast(message);
+    for (auto& reader : readers)
+        reader.join();
+    double seconds = std::chrono::duration<double>(bench_clk::now() - start).count();
+
+    for (auto& member : members)
+        if (!member->ok)
+            return -1;
+    return seconds;
+}
+
+int main(int argc, char** argv)
+{
+    std::map<std::string, std::string> options = {
+        {"sessions", "1000"}, {"concurrency", "16"}, {"messages", "10"}, {"size", "64"},
+        {"latency_us", "0"}, {"bandwidth", "0"}, {"loss", "0"}, {"seed", "1"}, {"mode", "deniable"},
+        {"transport", "sim"}, {"shards", "0"}, {"pin", "0"}, {"cipher", suite_offer().substr(0, suite_offer().find('/'))},
+        {"kex", suite_offer().substr(suite_offer().find('/') + 1)}, {"group", "0"},
+        {"workers", std::to_string(std::thread::hardware_concurrency())}};
+    for (int i = 1; i < argc; i++)
+    {
+        std::string arg = argv[i];
+        auto equals = arg.find('=');
+        if (equals == std::string::npos || !options.count(arg.substr(0, equals)))
+        {
+            std::cerr << "Unknown option " << arg << "\nOptions (name=value):";
+            for (const auto& [name, value] : options)
+                std::cerr << " " << name << " (" << value << ")";
+            std::cerr << "\n";
+            return 1;
+        }
+        options[arg.substr(0, equals)] = arg.substr(equals + 1);
+    }
+
+    std::size_t sessions = std::stoul(options["sessions"]);
+    std::size_t concurrency = std::max<std::size_t>(1, std::stoul(options["concurrency"]));
+    std::size_t messages = std::stoul(options["messages"]);
+    std::size_t message_size = std::stoul(options["size"]);
+    std::map<std::string, SecurityMode> modes = {
+        {"deniable", SecurityMode::Deniable}, {"ultra", SecurityMode::UltraDeniable}, {"non", SecurityMode::NonDeniable}};
+    bool mixed = options["mode"] == "mixed";
+    if (!mixed && !modes.count(options["mode"]))
+    {
+        std::cerr << "Unknown mode " << options["mode"] << " (deniable, ultra, non or mixed)\n";
+        return 1;
+    }
+    SecurityMode fixed_mode = mixed ? SecurityMode::Deniable : modes[options["mode"]];
+    bool over_tcp = options["transport"] == "tcp";
+    if (!over_tcp && options["transport"] != "sim")
+    {
+        std::cerr << "Unknown transport " << options["transport"] << " (sim or tcp)\n";
+        return 1;
+    }
+
+    cipher_preference = parse_ranking<RecordCipher>(options["cipher"], record_cipher_names, RECORD_CIPHERS);
+    kex_preference = parse_ranking<KeyAgreement>(options["kex"], key_agreement_names, KEY_AGREEMENTS);
+    if (cipher_preference.empty() || kex_preference.empty())
+    {
+        std::cerr << "Unknown cipher or kex (ciphers: aes256cbc, aes256gcm, chacha20poly1305; key agreements: modp1536, p256, x25519)\n";
+        return 1;
+    }
+
+    SimLinkConfig config;
+    config.latency = std::chrono::microseconds(std::stol(options["latency_us"]));
+    config.bandwidth = std::stod(options["bandwidth"]);
+    config.loss = std::stod(options["loss"]);
+    SimNetwork network(config, std::stoull(options["seed"]));
+
+    io_shard_count = std::stoul(options["shards"]);
+    pin_threads = options["pin"] == "1";
+    std::size_t cpu_workers = std::max<std::size_t>(1, std::stoul(options["workers"]));
+    executor.start(cpu_workers);
+    tcp::acceptor acceptor(executor.io(0), tcp::endpoint(boost::asio::ip::make_address("127.0.0.1"), 0));
+    std::mutex accept_mtx;
+
+    ArenaCounts arena_start = arena_counts();
+    std::size_t group = std::stoul(options["group"]);
+    if (group > 0)
+    {
+        double seconds = group_bench(acceptor, group, messages, message_size);
+        std::cout << "Group of " << group << " member(s), " << messages << " broadcast(s) of " << message_size << " bytes on " << cpu_workers
+                  << " CPU worker(s) and " << executor.shard_count() << " I/O shard(s)\n";
+        if (seconds < 0)
+            std::cout << "Failed\n";
+        else
+            std::cout << "Fan-out " << seconds << " s, " << group * messages / seconds << " deliveries per second ("
+                      << messages / seconds << " broadcasts per second)\n";
+        print_arena_delta(arena_start);
+        executor.shutdown();
+        return seconds < 0 ? 1 : 0;
+    }
+
+    std::atomic<std::size_t> next = 0;
+    std::mutex mtx;
+    std::vector<double> handshakes;
+    std::size_t failed = 0;
+    std::size_t queue_peak = 0;
+
+    auto wall_start = bench_clk::now();
+    std::clock_t cpu_start = std::clock();
+    std::vector<std::thread> workers;
+    for (std::size_t w = 0; w < concurrency; w++)
+        workers.emplace_back([&]() {
+            for (std::size_t i = next++; i < sessions; i = next++)
+            {
+                SecurityMode mode = mixed ? static_cast<SecurityMode>(i % 3) : fixed_mode;
+                ShardScope session_shard(executor.assign_shard());
+                BenchResult result = with_mode(mode, [&](auto policy) {
+                    using Mode = decltype(policy);
+                    if (over_tcp)
+                        return tcp_session<Mode>(acceptor, accept_mtx, i, messages, message_size);
+                    return sim_session<Mode>(network, i, messages, message_size);
+                });
+                std::lock_guard<std::mutex> lock(mtx);
+                queue_peak = std::max(queue_peak, result.queue_peak);
+                if (result.ok)
+                    handshakes.push_back(result.handshake_ms);
+                else
+                    failed++;
+            }
+        });
+    for (auto& worker : workers)
+        worker.join();
+    double cpu = double(std::clock() - cpu_start) / CLOCKS_PER_SEC;
+    double wall = std::chrono::duration<double>(bench_clk::now() - wall_start).count();
+
+    std::sort(handshakes.begin(), handshakes.end());
+    auto percentile = [&](double p) {
+        return handshakes.empty() ? 0.0 : handshakes[std::min(handshakes.size() - 1, static_cast<std::size_t>(p * handshakes.size()))];
+    };
+
+    std::cout << sessions << " session(s) over " << (over_tcp ? "loopback TCP (" SIMBENCH_IO_BACKEND ")" : "the simulated network") << " on " << executor.shard_count()
+              << " I/O shard(s), " << failed << " failed, " << messages << " message(s) each, suite "
+              << suite_name({cipher_preference.front(), kex_preference.front()}) << "\n";
+    std::cout << "Wall " << wall << " s, CPU " << cpu << " s (" << (sessions ? 1000 * cpu / sessions : 0) << " ms per session)\n";
+    std::cout << "Messages " << (wall > 0 ? (sessions - failed) * messages / wall : 0) << " per second\n";
+    std::cout << "Handshake p50 " << percentile(0.5) << " ms, p99 " << percentile(0.99) << " ms\n";
+    if (over_tcp)
+        std::cout << "Send queue peak " << queue_peak << " frame(s) in one session\n";
+    double sealed = std::max<std::size_t>(1, sessions * messages);
+    std::cout << "Heap allocations per message " << seal_allocations / sealed << " sealing and framing, " << open_allocations / sealed
+              << " parsing and opening\n";
+    print_arena_delta(arena_start);
+
+    executor.shutdown();
+    return failed == 0 ? 0 : 1;
+}